@@ -6,6 +6,25 @@
 #define SDB_LOG_LEVEL 2
 #endif
 
+// NOTE(ingar): Build with -DSHARED_HALO=1 to exchange the border with neighbors on the same node
+// through a shared MPI window instead of messages
+#ifndef SHARED_HALO
+#define SHARED_HALO 0
+#endif
+
+// NOTE(ingar): Build with -DCOMPRESS_SNAPSHOTS=1 (and link with -lz) to have the root write the
+// snapshots gzip-compressed, as data/NNNNN.dat.gz
+#ifndef COMPRESS_SNAPSHOTS
+#define COMPRESS_SNAPSHOTS 0
+#endif
+
+// NOTE(ingar): Build with -DVECTOR_MATH=1 to compute the initial wave with the SIMD cos of glibc's
+// libmvec. It can differ from the scalar cos in the last bit, so the output no longer matches the
+// sequential version exactly
+#ifndef VECTOR_MATH
+#define VECTOR_MATH 0
+#endif
+
 #include "Sdb.h"
 
 #include <stddef.h>
@@ -13,8 +32,20 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <sched.h>
+#include <string.h>
+#include <pthread.h>
 #include <sys/time.h>
 
+#if COMPRESS_SNAPSHOTS
+#include <zlib.h>
+#endif
+
+#if VECTOR_MATH
+#pragma omp declare simd notinbranch
+double cos(double);
+#endif
+
 // TASK: T1a
 // Include the MPI headerfile
 // BEGIN: T1a
@@ -57,6 +88,7 @@ typedef struct
     const i64 NCells;
     const i64 NTimeSteps;
     const i64 SnapshotFrequency;
+    i64       FirstTimeStep; // Later than 0 when the run restarts from a checkpoint
 } sim_params;
 
 static sim_params SimParams = { .NCells = 65536, .NTimeSteps = 100000, .SnapshotFrequency = 500 };
@@ -82,6 +114,97 @@ typedef struct
 
 static time_steps TimeSteps = {};
 
+#if SHARED_HALO
+// The time steps of the ranks on a node are segments of one shared window, each after a counter of
+// the step its current buffer holds. Neighbors on the node read the border cell straight out of it.
+#define SHARED_HALO_HEADER     64   // Bytes for the counter, so that the buffers start on a cache line
+#define SHARED_HALO_SPIN_COUNT 4096 // Polls of a neighbor's counter before we start yielding the CPU
+
+typedef struct
+{
+    MPI_Comm NodeComm;
+    MPI_Win  Win;
+    f64     *Base;
+    i64     *Step;
+
+    // Left and right neighbor, NULL when there is none on this node
+    f64 *NeighborBase[2];
+    i64 *NeighborStep[2];
+    i64  NeighborCells[2]; // Including the ghost cells
+} shared_halo;
+
+static shared_halo SharedHalo = {};
+#endif
+
+// Snapshots are gathered without blocking, into a ring of buffers. The workers copy their cells
+// into a send buffer and go on computing, and the root hands each gathered snapshot to a writer
+// thread. A rank only waits when the buffer for the next snapshot is still in use.
+#define SNAPSHOT_SLOTS 4
+
+typedef enum
+{
+    SlotFree,
+    SlotGathering, // The gather into (or from) it is in flight
+    SlotWriting,   // The root's writer thread owns it
+} slot_state;
+
+typedef struct
+{
+    f64        *Data; // The whole domain at the root, this rank's cells elsewhere
+    MPI_Request Request;
+    i64         Snapshot;
+    slot_state  State;
+} snapshot_slot;
+
+typedef struct
+{
+    snapshot_slot Slots[SNAPSHOT_SLOTS];
+    i64           NStarted;
+    i64           NStalls; // Snapshots that had to wait for a buffer
+
+    // NOTE(ingar): Only used at the root. The writer makes no MPI calls, the main thread tests the
+    // requests and hands the slots over under the lock
+    pthread_t       Writer;
+    pthread_mutex_t Lock;
+    pthread_cond_t  Written;  // The writer freed a slot
+    pthread_cond_t  Gathered; // A slot is ready to be written, or the run is over
+    bool            Done;
+} snapshot_ring;
+
+static snapshot_ring SnapshotRing = {};
+
+// Checkpoints hold both time levels, so that '--restart' resumes the run and gives the same
+// snapshots as one that never stopped. The ranks write their cells collectively with MPI-IO while
+// the simulation goes on, under a temporary name that is renamed once every rank is done. The
+// interval follows Young's formula, sqrt(2*C*MTBF), where C is the time the slowest rank was held
+// up by the last checkpoint.
+#define CHECKPOINT_FILE  "checkpoint.dat"
+#define CHECKPOINT_MAGIC "WAVE1DCK"
+#define CHECKPOINT_MTBF  3600.0 // Expected seconds between failures
+#define CHECKPOINT_FIRST 1000   // Steps before the first checkpoint
+
+typedef struct
+{
+    char Magic[8];
+    i64  NCells;
+    i64  TimeStep;
+    f64  dt;
+} checkpoint_header;
+
+typedef struct
+{
+    MPI_File     File;
+    MPI_Datatype FileType; // Where this rank's cells of both time levels go in the file
+    MPI_Request  Request;
+    f64         *Staging;
+    i64          NCells; // Cells this rank writes, none for a root with children
+    bool         Pending;
+    i64          Last, Next; // Time steps of the last and next checkpoint
+    f64          TimeLast;   // When the last one was taken
+} checkpoint;
+
+static checkpoint Checkpoint = {};
+
 #define UPrev(i) TimeSteps.PrevStep[(i) + 1]
 #define UCurr(i) TimeSteps.CurrStep[(i) + 1]
 #define UNext(i) TimeSteps.NextStep[(i) + 1]
@@ -150,17 +273,278 @@ PrintAllMpiContexts(void)
 // TASK: T8
 // Save the present time step in a numbered file under 'data/'.
 static void
-SaveDomain(i64 Step)
+SaveDomain(i64 Step, const f64 *Data)
 {
     // BEGIN: T8
     char filename[256];
+#if COMPRESS_SNAPSHOTS
+    // NOTE(ingar): Level 1, the wave is smooth enough that the fastest level gets most of the gain
+    sprintf(filename, "data/%.5ld.dat.gz", Step);
+    gzFile out = gzopen(filename, "wb1");
+    gzwrite(out, Data, SimParams.NCells * sizeof(f64));
+    gzclose(out);
+#else
     sprintf(filename, "data/%.5ld.dat", Step);
     FILE *out = fopen(filename, "wb");
-    fwrite(&UCurr(0), sizeof(f64), SimParams.NCells, out);
+    fwrite(Data, sizeof(f64), SimParams.NCells, out);
     fclose(out);
+#endif
     // END: T8
 }
 
+// Write the gathered snapshots at the root, lowest first, until the run is over
+static void *
+SnapshotWriter(void *Arg)
+{
+    (void)Arg;
+    pthread_mutex_lock(&SnapshotRing.Lock);
+    for(;;) {
+        snapshot_slot *Slot = NULL;
+        for(int i = 0; i < SNAPSHOT_SLOTS; ++i) {
+            snapshot_slot *Candidate = &SnapshotRing.Slots[i];
+            if(Candidate->State == SlotWriting && (!Slot || Candidate->Snapshot < Slot->Snapshot)) {
+                Slot = Candidate;
+            }
+        }
+        if(!Slot) {
+            if(SnapshotRing.Done) {
+                break;
+            }
+            pthread_cond_wait(&SnapshotRing.Gathered, &SnapshotRing.Lock);
+            continue;
+        }
+
+        pthread_mutex_unlock(&SnapshotRing.Lock);
+        SaveDomain(Slot->Snapshot, Slot->Data);
+        pthread_mutex_lock(&SnapshotRing.Lock);
+
+        Slot->State = SlotFree;
+        pthread_cond_broadcast(&SnapshotRing.Written);
+    }
+    pthread_mutex_unlock(&SnapshotRing.Lock);
+    return NULL;
+}
+
+static void
+InitializeSnapshots(void)
+{
+    i64 NCells = MpiCtx.IAmRootRank ? SimParams.NCells : MpiCtx.NMyCells;
+    for(int i = 0; i < SNAPSHOT_SLOTS; ++i) {
+        SnapshotRing.Slots[i].Data  = malloc(NCells * sizeof(f64));
+        SnapshotRing.Slots[i].State = SlotFree;
+    }
+    if(MpiCtx.IAmRootRank) {
+        pthread_mutex_init(&SnapshotRing.Lock, NULL);
+        pthread_cond_init(&SnapshotRing.Written, NULL);
+        pthread_cond_init(&SnapshotRing.Gathered, NULL);
+        pthread_create(&SnapshotRing.Writer, NULL, SnapshotWriter, NULL);
+    }
+}
+
+// Give a slot whose gather is complete to the writer. Call with the lock held
+static void
+HandOverSnapshot(snapshot_slot *Slot)
+{
+    Slot->State = SlotWriting;
+    pthread_cond_signal(&SnapshotRing.Gathered);
+}
+
+// NOTE(ingar): Called by the root in every time step, so that a snapshot is written as soon as it
+// has arrived, and not when its buffer is needed again
+static void
+DrainSnapshots(void)
+{
+    pthread_mutex_lock(&SnapshotRing.Lock);
+    for(int i = 0; i < SNAPSHOT_SLOTS; ++i) {
+        snapshot_slot *Slot = &SnapshotRing.Slots[i];
+        int            Complete = 0;
+        if(Slot->State == SlotGathering) {
+            MPI_Test(&Slot->Request, &Complete, MPI_STATUS_IGNORE);
+            if(Complete) {
+                HandOverSnapshot(Slot);
+            }
+        }
+    }
+    pthread_mutex_unlock(&SnapshotRing.Lock);
+}
+
+// Wait until the slot is free: for its gather to complete, and at the root also to be written
+static void
+AcquireSnapshotSlot(snapshot_slot *Slot)
+{
+    if(MpiCtx.IAmRootRank) {
+        // NOTE(ingar): A root with children has nothing else to do, so its waits hold up no one
+        pthread_mutex_lock(&SnapshotRing.Lock);
+        if(Slot->State != SlotFree && MpiCtx.NChildren == 0) {
+            ++SnapshotRing.NStalls;
+        }
+        if(Slot->State == SlotGathering) {
+            MPI_Wait(&Slot->Request, MPI_STATUS_IGNORE);
+            HandOverSnapshot(Slot);
+        }
+        while(Slot->State != SlotFree) {
+            pthread_cond_wait(&SnapshotRing.Written, &SnapshotRing.Lock);
+        }
+        pthread_mutex_unlock(&SnapshotRing.Lock);
+    } else if(Slot->State == SlotGathering) {
+        int Complete = 0;
+        MPI_Test(&Slot->Request, &Complete, MPI_STATUS_IGNORE);
+        if(!Complete) {
+            ++SnapshotRing.NStalls;
+            MPI_Wait(&Slot->Request, MPI_STATUS_IGNORE);
+        }
+        Slot->State = SlotFree;
+    }
+}
+
+// Complete the gathers in flight, and let the writer finish
+static void
+FinalizeSnapshots(void)
+{
+    for(int i = 0; i < SNAPSHOT_SLOTS; ++i) {
+        AcquireSnapshotSlot(&SnapshotRing.Slots[i]);
+    }
+
+    // NOTE(ingar): The rank that waited the most tells whether SNAPSHOT_SLOTS is too small
+    i64 NStalls = SnapshotRing.NStalls;
+    MPI_Reduce(MpiCtx.IAmRootRank ? MPI_IN_PLACE : &NStalls, &NStalls, 1, MPI_INT64_T, MPI_MAX, 0,
+               MPI_COMM_WORLD);
+    if(MpiCtx.IAmRootRank) {
+        pthread_mutex_lock(&SnapshotRing.Lock);
+        SnapshotRing.Done = true;
+        pthread_cond_signal(&SnapshotRing.Gathered);
+        pthread_mutex_unlock(&SnapshotRing.Lock);
+        pthread_join(SnapshotRing.Writer, NULL);
+
+        SdbLogInfo("At most %ld of %ld snapshots waited for a free buffer", NStalls,
+                   SnapshotRing.NStarted);
+        pthread_mutex_destroy(&SnapshotRing.Lock);
+        pthread_cond_destroy(&SnapshotRing.Written);
+        pthread_cond_destroy(&SnapshotRing.Gathered);
+    }
+    for(int i = 0; i < SNAPSHOT_SLOTS; ++i) {
+        free(SnapshotRing.Slots[i].Data);
+    }
+}
+
+#if SHARED_HALO
+// Allocate the time steps in this rank's segment of the node's window, and find the segments of the
+// neighbors on the node. The window stays locked for the whole run, so that MPI_Win_sync can order
+// the loads and stores to it.
+static void
+InitializeSharedHalo(void)
+{
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &SharedHalo.NodeComm);
+
+    i64      NCells = MpiCtx.NMyCells + 2;
+    char    *Segment;
+    MPI_Info Info;
+    MPI_Info_create(&Info);
+    MPI_Info_set(Info, "alloc_shared_noncontig", "true");
+    MPI_Win_allocate_shared(SHARED_HALO_HEADER + 3 * NCells * sizeof(f64), 1, Info,
+                            SharedHalo.NodeComm, &Segment, &SharedHalo.Win);
+    MPI_Info_free(&Info);
+
+    SharedHalo.Step    = (i64 *)Segment;
+    SharedHalo.Base    = (f64 *)(Segment + SHARED_HALO_HEADER);
+    TimeSteps.PrevStep = SharedHalo.Base;
+    TimeSteps.CurrStep = SharedHalo.Base + NCells;
+    TimeSteps.NextStep = SharedHalo.Base + 2 * NCells;
+
+    // NOTE(ingar): No counter may be read before it is set
+    MPI_Win_lock_all(MPI_MODE_NOCHECK, SharedHalo.Win);
+    __atomic_store_n(SharedHalo.Step, -1, __ATOMIC_SEQ_CST);
+    MPI_Win_sync(SharedHalo.Win);
+    MPI_Barrier(SharedHalo.NodeComm);
+
+    // NOTE(ingar): The root and an only child do not exchange anything
+    bool Exchanges = !(MpiCtx.IAmRootRank || MpiCtx.IAmOnlyChild);
+    int  Neighbors[2]
+        = { (Exchanges && !MpiCtx.IAmFirstRank) ? MpiCtx.MyRank - 1 : MPI_PROC_NULL,
+            (Exchanges && !MpiCtx.IAmLastRank) ? MpiCtx.MyRank + 1 : MPI_PROC_NULL };
+    int       NodeRanks[2];
+    MPI_Group WorldGroup, NodeGroup;
+    MPI_Comm_group(MPI_COMM_WORLD, &WorldGroup);
+    MPI_Comm_group(SharedHalo.NodeComm, &NodeGroup);
+    MPI_Group_translate_ranks(WorldGroup, 2, Neighbors, NodeGroup, NodeRanks);
+    MPI_Group_free(&WorldGroup);
+    MPI_Group_free(&NodeGroup);
+
+    for(int Side = 0; Side < 2; ++Side) {
+        SharedHalo.NeighborBase[Side] = NULL;
+        SharedHalo.NeighborStep[Side] = NULL;
+        if(Neighbors[Side] == MPI_PROC_NULL || NodeRanks[Side] == MPI_UNDEFINED) {
+            continue;
+        }
+
+        MPI_Aint Size;
+        int      DispUnit;
+        char    *Neighbor;
+        MPI_Win_shared_query(SharedHalo.Win, NodeRanks[Side], &Size, &DispUnit, &Neighbor);
+        SharedHalo.NeighborStep[Side] = (i64 *)Neighbor;
+        SharedHalo.NeighborBase[Side] = (f64 *)(Neighbor + SHARED_HALO_HEADER);
+
+        // NOTE(ingar): The last rank has the remaining cells as well. The segment size cannot tell
+        // us, since MPI may round it up to whole pages
+        bool NeighborIsLast = (Neighbors[Side] == MpiCtx.CommSize - 1);
+        SharedHalo.NeighborCells[Side]
+            = MpiCtx.CellsPerRank + (NeighborIsLast ? MpiCtx.RemainingCells : 0) + 2;
+    }
+}
+
+static void
+FinalizeSharedHalo(void)
+{
+    // NOTE(ingar): Nothing was allocated if we bailed out before InitializeDomain
+    if(!SharedHalo.Base) {
+        return;
+    }
+    MPI_Win_unlock_all(SharedHalo.Win);
+    MPI_Win_free(&SharedHalo.Win);
+    MPI_Comm_free(&SharedHalo.NodeComm);
+}
+
+// Tell the neighbors on the node which step the current buffer holds, after the stores to it
+static void
+PublishSharedHalo(i64 Step)
+{
+    MPI_Win_sync(SharedHalo.Win);
+    __atomic_store_n(SharedHalo.Step, Step, __ATOMIC_RELEASE);
+}
+
+// Read the border cell of the neighbor on 'Side' from its current buffer, once it holds the same step
+// as ours. The buffers rotate in step, so its current buffer has the same index as ours. The
+// neighbor does not write to it again before it has waited for our next step.
+static void
+ReadSharedHalo(int Side)
+{
+    i64 Step = *SharedHalo.Step;
+    for(int Spin = 0; __atomic_load_n(SharedHalo.NeighborStep[Side], __ATOMIC_ACQUIRE) < Step;
+        ++Spin) {
+        if(Spin >= SHARED_HALO_SPIN_COUNT) {
+            sched_yield();
+        }
+    }
+    MPI_Win_sync(SharedHalo.Win);
+
+    i64  NCells = SharedHalo.NeighborCells[Side];
+    i64  Buffer = (TimeSteps.CurrStep - SharedHalo.Base) / (MpiCtx.NMyCells + 2);
+    f64 *Their  = SharedHalo.NeighborBase[Side] + Buffer * NCells + 1;
+    if(Side == 0) {
+        UCurr(-1) = Their[NCells - 3];
+    } else {
+        UCurr(MpiCtx.NMyCells) = Their[0];
+    }
+}
+#endif
+
+// Index of this rank's first cell in the whole domain
+static i64
+MyFirstCell(void)
+{
+    return MpiCtx.IAmRootRank ? 0 : (MpiCtx.MyRank - 1) * MpiCtx.CellsPerRank;
+}
+
 // TASK: T3
 // Allocate space for each process' sub-grids
 // Set up our three buffers, fill two with an initial cosine wave,
@@ -170,29 +554,31 @@ InitializeDomain(void)
 {
     // BEGIN: T3
     SdbLogDebug("Rank %ld allocating memory for %ld cells", MpiCtx.MyRank, MpiCtx.NMyCells + 2);
+#if SHARED_HALO
+    InitializeSharedHalo();
+#else
     TimeSteps.PrevStep = malloc((MpiCtx.NMyCells + 2) * sizeof(*TimeSteps.PrevStep));
     TimeSteps.CurrStep = malloc((MpiCtx.NMyCells + 2) * sizeof(*TimeSteps.CurrStep));
     TimeSteps.NextStep = malloc((MpiCtx.NMyCells + 2) * sizeof(*TimeSteps.NextStep));
+#endif
 
-    i64 StartingCell = 0;
-    i64 EndingCell   = 0;
-
-    if(MpiCtx.IAmRootRank) {
-        EndingCell = MpiCtx.NMyCells;
-    } else {
-        StartingCell = (MpiCtx.MyRank - 1) * MpiCtx.CellsPerRank;
-        EndingCell   = StartingCell + MpiCtx.NMyCells;
-    }
+    i64 StartingCell = MyFirstCell();
+    i64 EndingCell   = StartingCell + MpiCtx.NMyCells;
     SdbLogDebug("Rank %ld has starting cell %ld and ending cell %ld", MpiCtx.MyRank, StartingCell,
                 EndingCell);
 
     // NOTE(ingar): We must offset i to the correct part of the total domain, not just this rank's
     // part, for the initialization values to be correct
-    for(i64 i = StartingCell; i < EndingCell; ++i) {
-        f64 Point = cos(M_PI * i / (f64)SimParams.NCells);
-
-        UPrev(i - StartingCell) = Point;
-        UCurr(i - StartingCell) = Point;
+    // NOTE(ingar): The loop runs over an int from a double offset, since 64-bit integers do not
+    // convert to vectors of doubles before AVX-512. The cell numbers are whole, so the sum is exact
+    int NCells = EndingCell - StartingCell;
+    f64 First  = StartingCell;
+#pragma omp simd
+    for(int i = 0; i < NCells; ++i) {
+        f64 Point = cos(M_PI * (First + i) / (f64)SimParams.NCells);
+
+        UPrev(i) = Point;
+        UCurr(i) = Point;
     }
     // END: T3
 
@@ -204,9 +590,142 @@ InitializeDomain(void)
 void
 FinalizeDomain(void)
 {
+#if SHARED_HALO
+    FinalizeSharedHalo();
+#else
     free(TimeSteps.PrevStep);
     free(TimeSteps.CurrStep);
     free(TimeSteps.NextStep);
+#endif
+}
+
+// Wait for the checkpoint being written, and put it in place of the last one
+static void
+CompleteCheckpoint(void)
+{
+    if(!Checkpoint.Pending) {
+        return;
+    }
+    MPI_Wait(&Checkpoint.Request, MPI_STATUS_IGNORE);
+    MPI_File_close(&Checkpoint.File);
+    MPI_Barrier(MPI_COMM_WORLD);
+    if(MpiCtx.IAmRootRank && rename(CHECKPOINT_FILE ".tmp", CHECKPOINT_FILE) != 0) {
+        perror("Could not replace " CHECKPOINT_FILE);
+    }
+    Checkpoint.Pending = false;
+}
+
+// NOTE(ingar): Called at the snapshots, where all ranks meet anyway, since closing the file is
+// collective. A finished checkpoint is put in place there, and not only when the next one starts
+static void
+PollCheckpoint(void)
+{
+    if(!Checkpoint.Pending) {
+        return;
+    }
+    int Complete = 0;
+    MPI_Test(&Checkpoint.Request, &Complete, MPI_STATUS_IGNORE);
+    MPI_Allreduce(MPI_IN_PLACE, &Complete, 1, MPI_INT, MPI_LAND, MPI_COMM_WORLD);
+    if(Complete) {
+        CompleteCheckpoint();
+    }
+}
+
+// Start writing both time levels, and schedule the next checkpoint
+static void
+SaveCheckpoint(i64 TimeStep)
+{
+    f64 TimeStart = MPI_Wtime();
+
+    CompleteCheckpoint();
+    memcpy(Checkpoint.Staging, &UPrev(0), Checkpoint.NCells * sizeof(f64));
+    memcpy(Checkpoint.Staging + Checkpoint.NCells, &UCurr(0), Checkpoint.NCells * sizeof(f64));
+
+    MPI_File_open(MPI_COMM_WORLD, CHECKPOINT_FILE ".tmp", MPI_MODE_CREATE | MPI_MODE_WRONLY,
+                  MPI_INFO_NULL, &Checkpoint.File);
+    if(MpiCtx.IAmRootRank) {
+        checkpoint_header Header
+            = { .NCells = SimParams.NCells, .TimeStep = TimeStep, .dt = WaveEquationParams.dt };
+        memcpy(Header.Magic, CHECKPOINT_MAGIC, sizeof(Header.Magic));
+        MPI_File_write_at(Checkpoint.File, 0, &Header, sizeof(Header), MPI_BYTE,
+                          MPI_STATUS_IGNORE);
+    }
+    MPI_File_set_view(Checkpoint.File, sizeof(checkpoint_header) + MyFirstCell() * sizeof(f64),
+                      MPI_DOUBLE, Checkpoint.FileType, "native", MPI_INFO_NULL);
+    MPI_File_iwrite_all(Checkpoint.File, Checkpoint.Staging, 2 * Checkpoint.NCells, MPI_DOUBLE,
+                        &Checkpoint.Request);
+    Checkpoint.Pending = true;
+
+    // NOTE(ingar): The slowest rank decides both the cost and the time per step
+    f64 TimeEnd  = MPI_Wtime();
+    f64 Times[2] = { TimeEnd - TimeStart,
+                     (TimeStart - Checkpoint.TimeLast) / (TimeStep - Checkpoint.Last) };
+    MPI_Allreduce(MPI_IN_PLACE, Times, 2, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+    i64 Interval        = sqrt(2.0 * Times[0] * CHECKPOINT_MTBF) / Times[1];
+    Checkpoint.Next     = TimeStep + (Interval > 0 ? Interval : 1);
+    Checkpoint.Last     = TimeStep;
+    Checkpoint.TimeLast = TimeEnd;
+}
+
+// Load both time levels from the checkpoint, and return its time step
+static i64
+RestoreCheckpoint(void)
+{
+    MPI_File          In;
+    checkpoint_header Header = {};
+    if(MPI_File_open(MPI_COMM_WORLD, CHECKPOINT_FILE, MPI_MODE_RDONLY, MPI_INFO_NULL, &In)
+       != MPI_SUCCESS) {
+        SdbLogError("No checkpoint to restart from in '%s'", CHECKPOINT_FILE);
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+    MPI_File_read_at_all(In, 0, &Header, sizeof(Header), MPI_BYTE, MPI_STATUS_IGNORE);
+    if(memcmp(Header.Magic, CHECKPOINT_MAGIC, sizeof(Header.Magic)) != 0
+       || Header.NCells != SimParams.NCells || Header.dt != WaveEquationParams.dt) {
+        SdbLogError("'%s' is not a checkpoint of this simulation", CHECKPOINT_FILE);
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+
+    MPI_File_set_view(In, sizeof(checkpoint_header) + MyFirstCell() * sizeof(f64), MPI_DOUBLE,
+                      Checkpoint.FileType, "native", MPI_INFO_NULL);
+    MPI_File_read_all(In, Checkpoint.Staging, 2 * Checkpoint.NCells, MPI_DOUBLE,
+                      MPI_STATUS_IGNORE);
+    MPI_File_close(&In);
+
+    memcpy(&UPrev(0), Checkpoint.Staging, Checkpoint.NCells * sizeof(f64));
+    memcpy(&UCurr(0), Checkpoint.Staging + Checkpoint.NCells, Checkpoint.NCells * sizeof(f64));
+    if(MpiCtx.IAmRootRank) {
+        SdbLogInfo("Restarting from time step %ld", Header.TimeStep);
+    }
+    return Header.TimeStep;
+}
+
+// Set up the file layout and the staging buffer, restore the domain if the run restarts, and
+// schedule the first checkpoint
+static void
+InitializeCheckpoints(bool Restart)
+{
+    // NOTE(ingar): A root with children holds no part of the domain, but takes part in the
+    // collective writes with no cells
+    Checkpoint.NCells = (MpiCtx.IAmRootRank && MpiCtx.NChildren > 0) ? 0 : MpiCtx.NMyCells;
+    MPI_Type_vector(2, Checkpoint.NCells, SimParams.NCells, MPI_DOUBLE, &Checkpoint.FileType);
+    MPI_Type_commit(&Checkpoint.FileType);
+    Checkpoint.Staging = malloc(2 * Checkpoint.NCells * sizeof(f64));
+
+    if(Restart) {
+        SimParams.FirstTimeStep = RestoreCheckpoint();
+    }
+    Checkpoint.Pending  = false;
+    Checkpoint.Last     = SimParams.FirstTimeStep;
+    Checkpoint.Next     = SimParams.FirstTimeStep + CHECKPOINT_FIRST;
+    Checkpoint.TimeLast = MPI_Wtime();
+}
+
+static void
+FinalizeCheckpoints(void)
+{
+    CompleteCheckpoint();
+    MPI_Type_free(&Checkpoint.FileType);
+    free(Checkpoint.Staging);
 }
 
 // Rotate the time step buffers.
@@ -265,14 +784,28 @@ PerformBoundaryCondition(void)
 static void
 PerformBorderExchange(void)
 {
+#if SHARED_HALO
+    bool LeftOnNode  = (SharedHalo.NeighborBase[0] != NULL);
+    bool RightOnNode = (SharedHalo.NeighborBase[1] != NULL);
+    if(LeftOnNode) {
+        ReadSharedHalo(0);
+    }
+    if(RightOnNode) {
+        ReadSharedHalo(1);
+    }
+#else
+    bool LeftOnNode  = false;
+    bool RightOnNode = false;
+#endif
+
     // NOTE(ingar): First (left-most) rank has no neighbor to the left
-    if(!MpiCtx.IAmFirstRank) {
+    if(!MpiCtx.IAmFirstRank && !LeftOnNode) {
         MPI_Sendrecv(&UCurr(0), 1, MPI_DOUBLE, MpiCtx.MyRank - 1, 0, &UCurr(-1), 1, MPI_DOUBLE,
                      MpiCtx.MyRank - 1, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
     }
 
     // NOTE(ingar): Last (right-most) rank has no neighbor to the right
-    if(!MpiCtx.IAmLastRank) {
+    if(!MpiCtx.IAmLastRank && !RightOnNode) {
         MPI_Sendrecv(&UCurr(MpiCtx.NMyCells - 1), 1, MPI_DOUBLE, MpiCtx.MyRank + 1, 0,
                      &UCurr(MpiCtx.NMyCells), 1, MPI_DOUBLE, MpiCtx.MyRank + 1, 0, MPI_COMM_WORLD,
                      MPI_STATUS_IGNORE);
@@ -283,18 +816,34 @@ PerformBorderExchange(void)
 // Every process needs to communicate its results
 // to root and assemble it in the root buffer
 void
-SendDataToRoot(void)
+SendDataToRoot(i64 Snapshot)
 {
     // BEGIN: T7
 
-    f64 *SendBuf = (MpiCtx.IAmRootRank) ? NULL : &UCurr(0);
+    snapshot_slot *Slot = &SnapshotRing.Slots[SnapshotRing.NStarted++ % SNAPSHOT_SLOTS];
+    AcquireSnapshotSlot(Slot);
+    Slot->Snapshot = Snapshot;
+
+    // NOTE(ingar): With no children the root has the domain itself, and goes straight to the writer
+    if(MpiCtx.NChildren == 0) {
+        memcpy(Slot->Data, &UCurr(0), SimParams.NCells * sizeof(f64));
+        pthread_mutex_lock(&SnapshotRing.Lock);
+        HandOverSnapshot(Slot);
+        pthread_mutex_unlock(&SnapshotRing.Lock);
+        return;
+    }
+
+    // NOTE(ingar): The workers send from a copy, since their buffers are overwritten two steps on,
+    // and the gather may not have completed by then
     if(MpiCtx.IAmRootRank) {
-        MPI_Gatherv(SendBuf, 0, MPI_DOUBLE, &UCurr(0), MpiCtx.RecvCounts, MpiCtx.Displacements,
-                    MPI_DOUBLE, 0, MPI_COMM_WORLD);
+        MPI_Igatherv(NULL, 0, MPI_DOUBLE, Slot->Data, MpiCtx.RecvCounts, MpiCtx.Displacements,
+                     MPI_DOUBLE, 0, MPI_COMM_WORLD, &Slot->Request);
     } else {
-        MPI_Gatherv(SendBuf, MpiCtx.NMyCells, MPI_DOUBLE, NULL, NULL, NULL, MPI_DOUBLE, 0,
-                    MPI_COMM_WORLD);
+        memcpy(Slot->Data, &UCurr(0), MpiCtx.NMyCells * sizeof(f64));
+        MPI_Igatherv(Slot->Data, MpiCtx.NMyCells, MPI_DOUBLE, NULL, NULL, NULL, MPI_DOUBLE, 0,
+                     MPI_COMM_WORLD, &Slot->Request);
     }
+    Slot->State = SlotGathering;
 
     // END: T7
 }
@@ -303,14 +852,19 @@ SendDataToRoot(void)
 void
 Simulate(void)
 {
-    for(i64 i = 0; i <= SimParams.NTimeSteps; ++i) {
+#if SHARED_HALO
+    PublishSharedHalo(SimParams.FirstTimeStep);
+#endif
+    for(i64 i = SimParams.FirstTimeStep; i <= SimParams.NTimeSteps; ++i) {
+        if(i == Checkpoint.Next) {
+            SaveCheckpoint(i);
+        }
         if(0 == (i % SimParams.SnapshotFrequency)) {
-            if(MpiCtx.NChildren > 0) {
-                SendDataToRoot();
-            }
-            if(MpiCtx.IAmRootRank) {
-                SaveDomain(i / SimParams.SnapshotFrequency);
-            }
+            SendDataToRoot(i / SimParams.SnapshotFrequency);
+            PollCheckpoint();
+        }
+        if(MpiCtx.IAmRootRank && MpiCtx.NChildren > 0) {
+            DrainSnapshots();
         }
 
         // NOTE(ingar): In these two cases there is only one process performing work -> no exchanges
@@ -329,6 +883,9 @@ Simulate(void)
         }
 
         RotateBuffers();
+#if SHARED_HALO
+        PublishSharedHalo(i + 1);
+#endif
     }
 }
 
@@ -339,11 +896,25 @@ main(int ArgCount, char **ArgV)
     // Initialise MPI
     // BEGIN: T1c
 
-    int CommSize, MyRank;
-    MPI_Init(&ArgCount, &ArgV);
+    // NOTE(ingar): The root runs a thread that writes the snapshots, but it makes no MPI calls
+    int CommSize, MyRank, Provided;
+    MPI_Init_thread(&ArgCount, &ArgV, MPI_THREAD_FUNNELED, &Provided);
+    if(Provided < MPI_THREAD_FUNNELED) {
+        SdbLogError("The MPI library does not support MPI_THREAD_FUNNELED");
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
     MPI_Comm_size(MPI_COMM_WORLD, &CommSize);
     MPI_Comm_rank(MPI_COMM_WORLD, &MyRank);
 
+    // NOTE(ingar): The only option, '--restart', resumes the run from the last checkpoint
+    bool Restart = (ArgCount > 1 && 0 == strcmp(ArgV[1], "--restart"));
+    if(ArgCount > 1 && !Restart) {
+        if(MyRank == 0) {
+            SdbLogError("Usage: %s [--restart]", ArgV[0]);
+        }
+        goto exit;
+    }
+
     if(CommSize > SimParams.NCells) {
         SdbLogError("Cannot use more processes than simulation cells!\n");
         goto exit;
@@ -415,6 +986,8 @@ main(int ArgCount, char **ArgV)
     }
 
     InitializeDomain();
+    InitializeCheckpoints(Restart);
+    InitializeSnapshots();
 
     // END: T1c
 
@@ -435,6 +1008,8 @@ main(int ArgCount, char **ArgV)
     // step count, which will probably make the root exit Simulate() earlier than the others
     MPI_Barrier(MPI_COMM_WORLD);
     Simulate();
+    FinalizeSnapshots();
+    FinalizeCheckpoints();
     MPI_Barrier(MPI_COMM_WORLD);
 
     if(MpiCtx.IAmRootRank) {
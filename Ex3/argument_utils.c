@@ -5,30 +5,55 @@
 #include <stdio.h>
 #include <memory.h>
 #include <stdlib.h>
+#include <string.h>
 
 
 OPTIONS
 *parse_args ( int argc, char **argv )
+{
+    OPTIONS defaults = {
+        .L = 1, .M = 512, .N = 512, .max_iteration = 4000, .snapshot_frequency = 20,
+        .checkpoint_frequency = 0, .restart = 0, .order = 2, .exchange = EXCHANGE_SENDRECV,
+        .initial = "gaussian"
+    };
+    return parse_args_defaults( argc, argv, defaults );
+}
+
+
+OPTIONS
+*parse_args_defaults ( int argc, char **argv, OPTIONS defaults )
 {
     /*
-     * Argument parsing: don't change this!
+     * Argument parsing: the options override the defaults of the calling program
      */
 
-    int_t M = 512;
-    int_t N = 512;
-    int_t max_iteration = 4000;
-    int_t snapshot_frequency = 20;
+    int_t L = defaults.L;
+    int_t M = defaults.M;
+    int_t N = defaults.N;
+    int_t max_iteration = defaults.max_iteration;
+    int_t snapshot_frequency = defaults.snapshot_frequency;
+    int_t checkpoint_frequency = defaults.checkpoint_frequency;
+    int_t restart = defaults.restart;
+    int_t order = defaults.order;
+    int_t exchange = defaults.exchange;
+    char const *initial = defaults.initial[0] ? defaults.initial : "gaussian";
 
     static struct option const long_options[] =  {
         {"help",               no_argument,       0, 'h'},
+        {"z_size",             required_argument, 0, 'l'},
         {"y_size",             required_argument, 0, 'm'},
         {"x_size",             required_argument, 0, 'n'},
         {"max_iteration",      required_argument, 0, 'i'},
         {"snapshot_frequency", required_argument, 0, 's'},
+        {"checkpoint_frequency", required_argument, 0, 'c'},
+        {"restart",            no_argument,       0, 'r'},
+        {"order",              required_argument, 0, 'o'},
+        {"exchange",           required_argument, 0, 'x'},
+        {"initial",            required_argument, 0, 'I'},
         {0, 0, 0, 0}
     };
 
-    static char const * short_options = "hm:n:i:s:";
+    static char const * short_options = "hl:m:n:i:s:c:ro:x:I:";
     {
         char *endptr;
         int c;
@@ -42,6 +67,14 @@ OPTIONS
                     help( argv[0], 0, NULL );
                     exit(0);
                     break;
+                case 'l':
+                    L = strtol(optarg, &endptr, 10);
+                    if ( endptr == optarg || L < 0 )
+                    {
+                        help( argv[0], c, optarg );
+                        return NULL;
+                    }
+                    break;
                 case 'm':
                     M = strtol(optarg, &endptr, 10);
                     if ( endptr == optarg || M < 0 )
@@ -74,6 +107,52 @@ OPTIONS
                         return NULL;
                     }
                     break;
+                case 'c':
+                    checkpoint_frequency = strtol(optarg, &endptr, 10);
+                    if ( endptr == optarg || checkpoint_frequency < 0 )
+                    {
+                        help( argv[0], c, optarg );
+                        return NULL;
+                    }
+                    break;
+                case 'r':
+                    restart = 1;
+                    break;
+                case 'o':
+                    order = strtol(optarg, &endptr, 10);
+                    if ( endptr == optarg || order < 2 || order > 8 || order % 2 != 0 )
+                    {
+                        help( argv[0], c, optarg );
+                        return NULL;
+                    }
+                    break;
+                case 'x':
+                    if ( strcmp(optarg, "sendrecv") == 0 )
+                    {
+                        exchange = EXCHANGE_SENDRECV;
+                    }
+                    else if ( strcmp(optarg, "shared") == 0 )
+                    {
+                        exchange = EXCHANGE_SHARED;
+                    }
+                    else if ( strcmp(optarg, "rma") == 0 )
+                    {
+                        exchange = EXCHANGE_RMA;
+                    }
+                    else
+                    {
+                        help( argv[0], c, optarg );
+                        return NULL;
+                    }
+                    break;
+                case 'I':
+                    if ( strlen(optarg) >= sizeof(defaults.initial) )
+                    {
+                        help( argv[0], c, optarg );
+                        return NULL;
+                    }
+                    initial = optarg;
+                    break;
                 default:
                     abort();
              }
@@ -89,10 +168,16 @@ OPTIONS
     }
 
   OPTIONS *args_parsed = malloc( sizeof(OPTIONS) );
+  args_parsed->L = L;
   args_parsed->M = M;
   args_parsed->N = N;
   args_parsed->max_iteration = max_iteration;
   args_parsed->snapshot_frequency = snapshot_frequency;
+  args_parsed->checkpoint_frequency = checkpoint_frequency;
+  args_parsed->restart = restart;
+  args_parsed->order = order;
+  args_parsed->exchange = exchange;
+  strcpy(args_parsed->initial, initial);
 
   return args_parsed;
 }
@@ -119,10 +204,20 @@ help ( char const *exec, char const opt, char const *optarg )
     fprintf(out, "%s [options]\n", exec);
     fprintf(out, "\n");
     fprintf(out, "Options                   Description                     Restriction     Default\n");
+    fprintf(out, "  -l, --z_size            size of the z dimension (3D)    n>0             128 (3D)\n");
     fprintf(out, "  -m, --y_size            size of the y dimension         n>0             256\n"    );
     fprintf(out, "  -n, --x_size            size of the x dimension         n>0             256\n"    );
     fprintf(out, "  -i, --max_iteration     number of iterations            i>0             100000\n" );
     fprintf(out, "  -s, --snapshot_freq     snapshot frequency              s>0             1000\n"  );
+    fprintf(out, "  -c, --checkpoint_freq   checkpoint frequency, 0 = auto  c>=0            0\n"     );
+    fprintf(out, "  -r, --restart           resume from the last checkpoint\n"                        );
+    fprintf(out, "  -o, --order             order of the space derivative   2, 4, 6 or 8    2\n"     );
+    fprintf(out, "  -x, --exchange          halo exchange (2D parallel)     sendrecv,       sendrecv\n");
+    fprintf(out, "                                                          shared or rma\n"          );
+    fprintf(out, "  -I, --initial           initial condition (2D parallel) gaussian,       gaussian\n");
+    fprintf(out, "                                                          cosine or the\n"          );
+    fprintf(out, "                                                          path of M x N\n"          );
+    fprintf(out, "                                                          doubles\n"                );
 
     fprintf(out, "\n");
     fprintf(out, "Example: %s -m 256 -n 256 -i 100000 -s 1000\n", exec);
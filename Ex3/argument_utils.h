@@ -7,15 +7,30 @@
 typedef int64_t int_t;
 
 typedef struct options_struct {
+    int_t L;
     int_t M;
     int_t N;
     int_t max_iteration;
     int_t snapshot_frequency;
+    int_t checkpoint_frequency;
+    int_t restart;
+    int_t order;
+    int_t exchange;
+    char  initial[256]; // Name of a built-in initial condition, or a file to read it from
 } OPTIONS;
 
+// Halo exchange of the 2D parallel solver: messages only, shared memory between the ranks on a node,
+// or one-sided puts
+#define EXCHANGE_SENDRECV 0
+#define EXCHANGE_SHARED   1
+#define EXCHANGE_RMA      2
+
 
 OPTIONS *parse_args ( int argc, char **argv );
 
+// As parse_args, but with the defaults of a program that is not the 2D solver
+OPTIONS *parse_args_defaults ( int argc, char **argv, OPTIONS defaults );
+
 void help ( char const *exec, char const opt, char const *optarg );
 
 #endif
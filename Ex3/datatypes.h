@@ -26,6 +26,24 @@ typedef struct
     MPI_Datatype MpiGrid;
 } MpiCtx;
 
+// Context for each MPI process of the 3D solver, with the cartesian coordinates in (z, y, x) order
+typedef struct
+{
+    int_t rank;
+    int_t commsize;
+    bool  on_boundary;
+
+    int_t L, M, N;
+    int_t z, y, x;
+    int_t cart_dims[3];
+
+    MPI_Comm     cart_comm;
+    int          neighbors[3][2];   // Lower and upper neighbor along each axis
+    MPI_Datatype MpiFaceSend[3][2]; // Outermost interior layer on each side, in the same order
+    MPI_Datatype MpiFaceRecv[3][2]; // Ghost layer on each side
+    MPI_Datatype MpiGrid;           // Interior of the local buffer
+} MpiCtx3D;
+
 // NOTE: I use wrapper structs for the global state because I think it improves the readability of
 // the code
 
@@ -36,8 +54,22 @@ typedef struct
     int_t N;
     int_t max_iteration;
     int_t snapshot_frequency;
+    int_t checkpoint_frequency; // 0 picks it from the cost of writing a checkpoint
+    int_t start_iteration;      // Where a restarted run picks up
+    int_t order;                // Order of the space derivative, 2, 4, 6 or 8
+    int_t exchange;             // How the halo is exchanged, one of EXCHANGE_*
+    char  initial_condition[256];
 } SimParams;
 
+typedef struct
+{
+    int_t L;
+    int_t M;
+    int_t N;
+    int_t max_iteration;
+    int_t snapshot_frequency;
+} SimParams3D;
+
 // Wave equation parameters, time step is derived from the space step.
 typedef struct
 {
@@ -47,6 +79,25 @@ typedef struct
     real_t       dt;
 } WaveEquationParams; // wave_equation_params;
 
+typedef struct
+{
+    const real_t c;
+    const real_t dx;
+    const real_t dy;
+    const real_t dz;
+    real_t       dt;
+} WaveEquationParams3D;
+
+// Layout of a time step buffer: rows of 'pitch' points with 'halo' ghost points around the domain,
+// and point (0, 0) at offset 'origin' from the start of the buffer
+#define CACHE_LINE_SIZE 64
+typedef struct
+{
+    int_t pitch;
+    int_t halo;
+    int_t origin;
+} GridLayout;
+
 // Buffers for three time steps, indexed with 2 ghost points for the boundary
 typedef struct
 {
@@ -55,4 +106,50 @@ typedef struct
     real_t *next_step;
 } TimeSteps;
 
+// Halo exchange through the memory of the node. The time steps of the ranks on a node are segments
+// of one shared window, each after a counter of the step its present buffer holds, so that a rank
+// copies the ghost points of on-node neighbors straight out of their buffers.
+typedef struct
+{
+    MPI_Comm node_comm;
+    MPI_Win  win;
+    real_t  *base;             // First time step buffer of this rank
+    int_t   *step;             // Step counter of this rank
+    real_t  *neighbor_base[4]; // The same for each neighbor, NULL when it is not on the node
+    int_t   *neighbor_step[4];
+} HaloShared;
+
+// Halo exchange with one-sided communication. Each time step buffer is exposed in a window, and in
+// every step the ranks put their outermost rows and columns into the ghost points of the present
+// buffer of their neighbors, in a post-start-complete-wait epoch restricted to the neighbors.
+typedef struct
+{
+    MPI_Win   win[3];
+    real_t   *buffer[3]; // The buffer each window exposes
+    MPI_Group neighbors;
+    int       n_neighbors;
+} HaloRma;
+
+// Checkpoint file: this header, then the previous and the present time step of the whole domain
+typedef struct
+{
+    char   magic[8];
+    int_t  M, N;
+    int_t  order;
+    int_t  iteration;
+    real_t dt;
+} CheckpointHeader;
+
+// A checkpoint is written collectively from a staging buffer while the simulation goes on
+typedef struct
+{
+    real_t      *staging; // Previous and present time step of this rank
+    MPI_Datatype file_type;
+    MPI_File     file;
+    MPI_Request  request;
+    bool         pending;
+    int_t        last, next; // Iterations of the last and next checkpoint
+    double       time_last;  // When the last one was taken
+} Checkpoint;
+
 #endif
@@ -0,0 +1,83 @@
+#define _XOPEN_SOURCE 600
+#include "initial_condition.h"
+
+#include <math.h>
+#include <stddef.h>
+#include <string.h>
+
+// Build with -DVECTOR_MATH=1 to let the loops below call the SIMD variants of exp and cos in glibc's
+// libmvec. They can differ from the scalar results in the last bit, so the output is then no longer
+// identical to that of wave_2d_sequential.
+#ifndef VECTOR_MATH
+#define VECTOR_MATH 0
+#endif
+
+#if VECTOR_MATH
+#pragma omp declare simd notinbranch
+double exp ( double );
+#pragma omp declare simd notinbranch
+double cos ( double );
+#endif
+
+// The pulse of the sequential solver: exp(-4 delta^2), with delta the distance from the centre of
+// the domain, scaled by its size. The terms are evaluated in the same order, for the same bits.
+static void
+gaussian_fill ( const InitialDomain *domain, int_t i0, int_t i1, real_t *rows, int_t pitch )
+{
+    real_t M   = domain->M;
+    real_t N   = domain->N;
+    real_t col = domain->col_offset;
+    int    n   = domain->n_cols;
+
+    for ( int_t i = i0; i < i1; i++ ) {
+        real_t  y   = i + domain->row_offset - M / 2.0;
+        real_t  yy  = ( y * y ) / M;
+        real_t *row = rows + ( i - i0 ) * pitch;
+
+        // NOTE: An int column index, since 64-bit integers do not convert to vectors of doubles
+        // before AVX-512. The coordinates are whole numbers, so adding them as doubles is exact.
+#pragma omp simd
+        for ( int j = 0; j < n; j++ ) {
+            real_t x     = ( j + col ) - N / 2.0;
+            real_t delta = sqrt ( yy + ( x * x ) / N );
+            row[j]       = exp ( -4.0 * delta * delta );
+        }
+    }
+}
+
+// A standing wave, cos(pi y / M) cos(pi x / N): the 2D counterpart of the start of the 1D solvers,
+// with zero slope at the reflective boundary
+static void
+cosine_fill ( const InitialDomain *domain, int_t i0, int_t i1, real_t *rows, int_t pitch )
+{
+    real_t col = domain->col_offset;
+    int    n   = domain->n_cols;
+
+    for ( int_t i = i0; i < i1; i++ ) {
+        real_t  wave_y = cos ( M_PI * ( i + domain->row_offset ) / (real_t)domain->M );
+        real_t *row    = rows + ( i - i0 ) * pitch;
+
+#pragma omp simd
+        for ( int j = 0; j < n; j++ ) {
+            row[j] = wave_y * cos ( M_PI * ( j + col ) / (real_t)domain->N );
+        }
+    }
+}
+
+static const InitialCondition initial_conditions[] = {
+    { "gaussian", gaussian_fill },
+    { "cosine", cosine_fill },
+};
+
+static const InitialCondition initial_condition_file = { "file", NULL };
+
+const InitialCondition *
+initial_condition_find ( const char *name )
+{
+    for ( size_t k = 0; k < sizeof ( initial_conditions ) / sizeof ( initial_conditions[0] ); k++ ) {
+        if ( strcmp ( name, initial_conditions[k].name ) == 0 ) {
+            return &initial_conditions[k];
+        }
+    }
+    return &initial_condition_file;
+}
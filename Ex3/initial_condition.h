@@ -0,0 +1,32 @@
+#ifndef INITIAL_CONDITION_H_
+#define INITIAL_CONDITION_H_
+
+#include <stdint.h>
+
+typedef int64_t int_t;
+typedef double  real_t;
+
+// Initial conditions of the 2D solvers. A condition fills a block of rows of the local part of the
+// domain, given where that part sits in the global one, so that each thread fills the rows it will
+// compute on. Conditions that come from a file have no fill function: the solver streams them in.
+typedef struct
+{
+    int_t M, N;                   // The global domain
+    int_t row_offset, col_offset; // Where the local part starts in it
+    int_t n_cols;                 // Columns of the local part
+} InitialDomain;
+
+// Fill rows i0..i1-1 of the local part, where row i starts at rows + ( i - i0 ) * pitch
+typedef void ( *InitialConditionFill ) ( const InitialDomain *domain, int_t i0, int_t i1,
+                                         real_t *rows, int_t pitch );
+
+typedef struct
+{
+    const char          *name;
+    InitialConditionFill fill;
+} InitialCondition;
+
+// The built-in condition called 'name', or the one that reads a file when there is none
+const InitialCondition *initial_condition_find ( const char *name );
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef STENCIL_H_
+#define STENCIL_H_
+
+#include <math.h>
+
+// Central difference weights of the second derivative, for orders 2, 4, 6 and 8. Row r holds the
+// stencil of radius r (order 2r): the weight of the centre point, then of the points 1..r away.
+#define STENCIL_MAX_RADIUS 4
+static const double stencil_weights[STENCIL_MAX_RADIUS + 1][STENCIL_MAX_RADIUS + 1] = {
+    { 0.0 },
+    { -2.0, 1.0 },
+    { -5.0 / 2.0, 4.0 / 3.0, -1.0 / 12.0 },
+    { -49.0 / 18.0, 3.0 / 2.0, -3.0 / 20.0, 1.0 / 90.0 },
+    { -205.0 / 72.0, 8.0 / 5.0, -1.0 / 5.0, 8.0 / 315.0, -1.0 / 560.0 },
+};
+
+// The leapfrog step is stable while (c*dt)^2 times the largest eigenvalue of the discrete Laplacian
+// is at most 4. That eigenvalue is 4/dx^2 per dimension for the second order stencil and larger for
+// the wider ones, so their time step is the second order one scaled down by this factor.
+static inline double
+stencil_time_step_scale ( int radius )
+{
+    double lambda = -stencil_weights[radius][0];
+    for ( int k = 1; k <= radius; k++ ) {
+        lambda += ( k % 2 ? 2.0 : -2.0 ) * stencil_weights[radius][k];
+    }
+    return sqrt ( 4.0 / lambda );
+}
+
+#endif
@@ -0,0 +1,330 @@
+#define _XOPEN_SOURCE 600
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "argument_utils.h"
+#include "stencil.h"
+
+// Runs a batch of independent simulations of the same grid in one process. The members differ in
+// wave speed and in where the initial pulse sits, and are listed in a file given after the options,
+// one "c y x" line each (y and x in grid points, '#' starts a comment).
+//
+// The time steps store the members of each grid point next to each other, so the inner loop of the
+// stencil runs over members, and its SIMD lanes hold the same point of different simulations. Every
+// member gives the same numbers as a run of wave_2d_sequential with its parameters.
+//
+// All snapshots go to one file, ENSEMBLE_FILE: an EnsembleHeader, the EnsembleMember of each
+// member, and then for each snapshot the M x N grid of every member in turn.
+
+// Convert 'struct timeval' into seconds in double prec. floating point
+#define WALLTIME(t) ((double)(t).tv_sec + 1e-6 * (double)(t).tv_usec)
+
+// Option to change numerical precision
+typedef int64_t int_t;
+typedef double  real_t;
+
+#define ENSEMBLE_FILE  "ensemble.dat"
+#define ENSEMBLE_MAGIC "WAVE2DEN"
+
+// Members are padded to a multiple of this, so that every row of lanes is full
+#define MEMBER_ALIGN 8
+
+typedef struct {
+    char  magic[8];
+    int_t n_members, M, N;
+    int_t n_snapshots;
+} EnsembleHeader;
+
+// Wave equation parameters of one member, time step is derived from the space step
+typedef struct {
+    real_t c, dt;
+    real_t pulse_y, pulse_x;
+} EnsembleMember;
+
+// Simulation parameters: size, step count, and how often to save the state
+int_t N = 256, M = 256, max_iteration = 4000, snapshot_freq = 20;
+
+// Order of the space derivative, and the ghost points the stencil needs on each side
+int_t order = 2, halo = 1;
+
+// Space step, shared by all members
+const real_t dx = 1.0, dy = 1.0;
+
+// The members, their count, and the count padded to MEMBER_ALIGN
+EnsembleMember *members = NULL;
+int_t           B = 0, B_pad = 0;
+
+// Factor of the Laplacian in the integration formula, per (padded) member
+real_t *coefficient = NULL;
+
+// Buffers for three time steps, indexed with 2*halo ghost points for the boundary, and B_pad
+// members per point
+real_t *buffers[3] = { NULL, NULL, NULL };
+
+// Staging buffer for the snapshots, with the members one after the other
+real_t *snapshot = NULL;
+FILE   *out      = NULL;
+
+#define POINT(i, j)    ((((i) + halo) * (N + 2 * halo) + (j) + halo) * B_pad)
+#define U_prv(i, j, b) buffers[0][POINT(i, j) + (b)]
+#define U(i, j, b)     buffers[1][POINT(i, j) + (b)]
+#define U_nxt(i, j, b) buffers[2][POINT(i, j) + (b)]
+
+// Rotate the time step buffers.
+void
+move_buffer_window(void)
+{
+    real_t *temp = buffers[0];
+    buffers[0]   = buffers[1];
+    buffers[1]   = buffers[2];
+    buffers[2]   = temp;
+}
+
+// Read the members, one "c y x" line each
+void
+members_read(const char *filename)
+{
+    FILE *in = fopen(filename, "r");
+    if(!in) {
+        fprintf(stderr, "Could not open the member list '%s'\n", filename);
+        exit(EXIT_FAILURE);
+    }
+
+    char  line[256];
+    int_t capacity = 0;
+    while(fgets(line, sizeof(line), in)) {
+        char *comment = strchr(line, '#');
+        if(comment) {
+            *comment = '\0';
+        }
+        EnsembleMember member;
+        int            n = sscanf(line, "%lf %lf %lf", &member.c, &member.pulse_y, &member.pulse_x);
+        if(n <= 0) {
+            continue;
+        }
+        if(n != 3 || member.c <= 0.0) {
+            fprintf(stderr, "Member %ld: expected \"c y x\" with c>0, got: %s", B + 1, line);
+            exit(EXIT_FAILURE);
+        }
+        if(B == capacity) {
+            capacity = capacity ? 2 * capacity : 64;
+            members  = realloc(members, capacity * sizeof(EnsembleMember));
+        }
+        members[B++] = member;
+    }
+    fclose(in);
+
+    if(B == 0) {
+        fprintf(stderr, "No members in '%s'\n", filename);
+        exit(EXIT_FAILURE);
+    }
+    B_pad = (B + MEMBER_ALIGN - 1) / MEMBER_ALIGN * MEMBER_ALIGN;
+}
+
+// Write the header and the members, ahead of the snapshots
+void
+ensemble_open(void)
+{
+    out = fopen(ENSEMBLE_FILE, "wb");
+    if(!out) {
+        fprintf(stderr, "Could not create '%s'\n", ENSEMBLE_FILE);
+        exit(EXIT_FAILURE);
+    }
+    EnsembleHeader header = {
+        .n_members = B, .M = M, .N = N, .n_snapshots = max_iteration / snapshot_freq + 1
+    };
+    memcpy(header.magic, ENSEMBLE_MAGIC, sizeof(header.magic));
+    fwrite(&header, sizeof(header), 1, out);
+    fwrite(members, sizeof(EnsembleMember), B, out);
+    snapshot = malloc(B * M * N * sizeof(real_t));
+}
+
+// Append the present time step of every member to the ensemble file
+void
+domain_save(void)
+{
+    for(int_t i = 0; i < M; i++) {
+        for(int_t j = 0; j < N; j++) {
+            for(int_t b = 0; b < B; b++) {
+                snapshot[(b * M + i) * N + j] = U(i, j, b);
+            }
+        }
+    }
+    fwrite(snapshot, sizeof(real_t), B * M * N, out);
+}
+
+// Set up our three buffers, and fill two with the initial pulse of each member
+void
+domain_initialize(void)
+{
+    size_t size = (M + 2 * halo) * (N + 2 * halo) * B_pad * sizeof(real_t);
+    for(int k = 0; k < 3; k++) {
+        if(posix_memalign((void **)&buffers[k], 64, size) != 0) {
+            fprintf(stderr, "Could not allocate %zu bytes for a time step\n", size);
+            exit(EXIT_FAILURE);
+        }
+        memset(buffers[k], 0, size);
+    }
+
+    // The padding members stay at rest
+    coefficient = calloc(B_pad, sizeof(real_t));
+    for(int_t b = 0; b < B; b++) {
+        EnsembleMember *m = &members[b];
+
+        // Set the time step for 2D case, shorter for the wider stencils
+        real_t c = m->c;
+        real_t dt
+            = dx * dy / (c * sqrt(dx * dx + dy * dy)) * stencil_time_step_scale(halo);
+        m->dt          = dt;
+        coefficient[b] = (dt * dt * c * c) / (dx * dy);
+
+        for(int_t i = 0; i < M; i++) {
+            for(int_t j = 0; j < N; j++) {
+                // Calculate delta (radial distance) adjusted for M x N grid
+                real_t delta = sqrt(((i - m->pulse_y) * (i - m->pulse_y)) / (real_t)M
+                                    + ((j - m->pulse_x) * (j - m->pulse_x)) / (real_t)N);
+                U_prv(i, j, b) = U(i, j, b) = exp(-4.0 * delta * delta);
+            }
+        }
+    }
+}
+
+// Get rid of all the memory allocations
+void
+domain_finalize(void)
+{
+    fclose(out);
+    free(buffers[0]);
+    free(buffers[1]);
+    free(buffers[2]);
+    free(coefficient);
+    free(snapshot);
+    free(members);
+}
+
+// Integration formula, with the central difference stencil of radius R, for all members of a
+// point at once. Each radius gets its own inlined copy, where the stencil loop unrolls.
+static inline __attribute__((always_inline)) void
+time_step_radius(const int R)
+{
+    for(int_t i = 0; i < M; i++) {
+        for(int_t j = 0; j < N; j++) {
+            real_t *restrict       next = &U_nxt(i, j, 0);
+            const real_t *restrict prev = &U_prv(i, j, 0);
+            const real_t *restrict curr = &U(i, j, 0);
+
+            // Distance between the points above and below, in elements
+            int_t row = (N + 2 * halo) * B_pad;
+
+#pragma omp simd
+            for(int_t b = 0; b < B_pad; b++) {
+                real_t laplacian
+                    = stencil_weights[R][1]
+                    * (curr[b - row] + curr[b + row] + curr[b - B_pad] + curr[b + B_pad]);
+#pragma GCC unroll 4
+                for(int k = 2; k <= R; k++) {
+                    laplacian += stencil_weights[R][k]
+                               * (curr[b - k * row] + curr[b + k * row] + curr[b - k * B_pad]
+                                  + curr[b + k * B_pad]);
+                }
+                laplacian += 2.0 * stencil_weights[R][0] * curr[b];
+
+                next[b] = -prev[b] + 2.0 * curr[b] + coefficient[b] * laplacian;
+            }
+        }
+    }
+}
+
+void
+time_step(void)
+{
+    switch(halo) {
+    case 1: time_step_radius(1); break;
+    case 2: time_step_radius(2); break;
+    case 3: time_step_radius(3); break;
+    case 4: time_step_radius(4); break;
+    }
+}
+
+// Neumann (reflective) boundary condition, mirrored as deep as the halo
+void
+boundary_condition(void)
+{
+    size_t size = B_pad * sizeof(real_t);
+    for(int_t i = 0; i < M; i++) {
+        for(int_t k = 1; k <= halo; k++) {
+            memcpy(&U(i, -k, 0), &U(i, k, 0), size);
+            memcpy(&U(i, N - 1 + k, 0), &U(i, N - 1 - k, 0), size);
+        }
+    }
+    for(int_t j = 0; j < N; j++) {
+        for(int_t k = 1; k <= halo; k++) {
+            memcpy(&U(-k, j, 0), &U(k, j, 0), size);
+            memcpy(&U(M - 1 + k, j, 0), &U(M - 1 - k, j, 0), size);
+        }
+    }
+}
+
+// Main time integration.
+void
+simulate(void)
+{
+    // Go through each time step
+    for(int_t iteration = 0; iteration <= max_iteration; iteration++) {
+        if((iteration % snapshot_freq) == 0) {
+            domain_save();
+        }
+
+        // Derive step t+1 from steps t and t-1
+        boundary_condition();
+        time_step();
+
+        // Rotate the time step buffers
+        move_buffer_window();
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    OPTIONS *options = parse_args(argc, argv);
+    if(!options) {
+        fprintf(stderr, "Argument parsing failed\n");
+        exit(EXIT_FAILURE);
+    }
+    if(optind != argc - 1) {
+        fprintf(stderr, "Usage: %s [options] members.txt\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    M             = options->M;
+    N             = options->N;
+    max_iteration = options->max_iteration;
+    snapshot_freq = options->snapshot_frequency;
+    order         = options->order;
+    halo          = order / 2;
+    free(options);
+
+    // Set up the initial state of the domain
+    members_read(argv[optind]);
+    domain_initialize();
+    ensemble_open();
+
+    struct timeval t_start, t_end;
+
+    gettimeofday(&t_start, NULL);
+    simulate();
+    gettimeofday(&t_end, NULL);
+
+    printf("Total elapsed time: %lf seconds for %ld members\n", WALLTIME(t_end) - WALLTIME(t_start),
+           B);
+
+    // Clean up and shut down
+    domain_finalize();
+    exit(EXIT_SUCCESS);
+}
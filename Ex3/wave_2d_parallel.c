@@ -1,7 +1,9 @@
 #define _XOPEN_SOURCE 600
 #include <math.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/time.h>
 
 #define DO_DEBUG 1
@@ -13,6 +15,8 @@
 
 #include "argument_utils.h"
 #include "datatypes.h"
+#include "initial_condition.h"
+#include "stencil.h"
 
 // TASK: T1a
 // Include the MPI hederfile
@@ -20,13 +24,15 @@
 #include <mpi.h>
 // END: T1a
 
+#include <omp.h>
+
 // Convert 'struct timeval' into seconds in double prec. floating point
 // NOTE: I use MPI's timing functionality instead
 // #define WALLTIME( t ) ( (double)( t ).tv_sec + 1e-6 * (double)( t ).tv_usec )
 
-#define U_prv( i, j ) time_steps.prev_step[( ( i ) + 1 ) * ( mpi_ctx.N + 2 ) + ( j ) + 1]
-#define U( i, j )     time_steps.curr_step[( ( i ) + 1 ) * ( mpi_ctx.N + 2 ) + ( j ) + 1]
-#define U_nxt( i, j ) time_steps.next_step[( ( i ) + 1 ) * ( mpi_ctx.N + 2 ) + ( j ) + 1]
+#define U_prv( i, j ) time_steps.prev_step[grid.origin + ( i ) * grid.pitch + ( j )]
+#define U( i, j )     time_steps.curr_step[grid.origin + ( i ) * grid.pitch + ( j )]
+#define U_nxt( i, j ) time_steps.next_step[grid.origin + ( i ) * grid.pitch + ( j )]
 
 // TASK: T1b
 // Declare variables each MPI process will need
@@ -37,9 +43,29 @@ static MpiCtx mpi_ctx = {};
 
 // END: T1b
 
-static SimParams          sim_params           = { 512, 512, 4000, 20 };
+static SimParams          sim_params = { 512, 512, 4000, 20, 0, 0, 2, EXCHANGE_SENDRECV, "gaussian" };
 static WaveEquationParams wave_equation_params = { .c = 1.0, .dx = 1.0, .dy = 1.0 };
 static TimeSteps          time_steps           = {};
+static GridLayout         grid                 = {};
+static Checkpoint         checkpoint           = {};
+static HaloShared         halo_shared          = {};
+static HaloRma            halo_rma             = {};
+
+// Time the main thread of this rank spent in border_exchange, to compare the exchange modes
+static double exchange_time = 0.0;
+
+// Checkpoints hold both time levels, so that '--restart' resumes the run and gives the same results
+// as one that never stopped. The file is written under a temporary name, and renamed when the
+// collective write is complete, so that a failure during the write leaves the last checkpoint in
+// place. With no checkpoint frequency given, the interval follows Young's formula,
+// sqrt(2*C*MTBF), where C is the time the slowest rank was held up by the last checkpoint.
+#define CHECKPOINT_FILE  "checkpoint.dat"
+#define CHECKPOINT_MAGIC "WAVE2DCK"
+#define CHECKPOINT_MTBF  3600.0 // Expected seconds between failures
+#define CHECKPOINT_FIRST 1000   // Steps before the first checkpoint
+
+// Rows of the interior in a block, see interior_rows
+#define OVERLAP_ROWS 8
 
 // Rotate the time step buffers.
 static void
@@ -88,6 +114,156 @@ domain_save ( int_t step )
     // END: T8
 }
 
+// Both time levels of this rank go to the staging buffer, in the layout of the file
+static void
+checkpoint_copy ( bool to_staging )
+{
+    real_t *prev = checkpoint.staging;
+    real_t *curr = checkpoint.staging + mpi_ctx.M * mpi_ctx.N;
+    size_t  size = mpi_ctx.N * sizeof ( real_t );
+
+    for ( int_t i = 0; i < mpi_ctx.M; i++ ) {
+        if ( to_staging ) {
+            memcpy ( &prev[i * mpi_ctx.N], &U_prv ( i, 0 ), size );
+            memcpy ( &curr[i * mpi_ctx.N], &U ( i, 0 ), size );
+        } else {
+            memcpy ( &U_prv ( i, 0 ), &prev[i * mpi_ctx.N], size );
+            memcpy ( &U ( i, 0 ), &curr[i * mpi_ctx.N], size );
+        }
+    }
+}
+
+// The file holds two global grids after the header, and each rank its part of both
+static void
+checkpoint_initialize ( void )
+{
+    int global_dims[3]  = { 2, sim_params.M, sim_params.N };
+    int local_dims[3]   = { 2, mpi_ctx.M, mpi_ctx.N };
+    int local_coords[3] = { 0, mpi_ctx.y * mpi_ctx.M, mpi_ctx.x * mpi_ctx.N };
+    MPI_Type_create_subarray ( 3, global_dims, local_dims, local_coords, MPI_ORDER_C, MPI_DOUBLE,
+                               &checkpoint.file_type );
+    MPI_Type_commit ( &checkpoint.file_type );
+
+    checkpoint.staging   = malloc ( 2 * mpi_ctx.M * mpi_ctx.N * sizeof ( real_t ) );
+    checkpoint.pending   = false;
+    checkpoint.last      = sim_params.start_iteration;
+    checkpoint.next      = sim_params.start_iteration
+                      + ( sim_params.checkpoint_frequency > 0 ? sim_params.checkpoint_frequency
+                                                              : CHECKPOINT_FIRST );
+    checkpoint.time_last = MPI_Wtime ();
+}
+
+// Wait for the checkpoint being written, and put it in place of the last one
+static void
+checkpoint_complete ( void )
+{
+    if ( !checkpoint.pending ) {
+        return;
+    }
+    MPI_Wait ( &checkpoint.request, MPI_STATUS_IGNORE );
+    MPI_File_close ( &checkpoint.file );
+    MPI_Barrier ( mpi_ctx.cart_comm );
+    if ( mpi_ctx.rank == 0 && rename ( CHECKPOINT_FILE ".tmp", CHECKPOINT_FILE ) != 0 ) {
+        perror ( "Could not replace " CHECKPOINT_FILE );
+    }
+    checkpoint.pending = false;
+}
+
+// Put the checkpoint in place as soon as every rank has finished writing it, rather than when the
+// next one starts, so that a job that dies in between can still restart from it. Called at the
+// snapshots, where the ranks meet anyway, as closing the file is collective.
+static void
+checkpoint_poll ( void )
+{
+    if ( !checkpoint.pending ) {
+        return;
+    }
+    int done;
+    MPI_Test ( &checkpoint.request, &done, MPI_STATUS_IGNORE );
+    MPI_Allreduce ( MPI_IN_PLACE, &done, 1, MPI_INT, MPI_LAND, mpi_ctx.cart_comm );
+    if ( done ) {
+        checkpoint_complete ();
+    }
+}
+
+static void
+checkpoint_finalize ( void )
+{
+    checkpoint_complete ();
+    MPI_Type_free ( &checkpoint.file_type );
+    free ( checkpoint.staging );
+}
+
+// Start writing the present state, and schedule the next checkpoint
+static void
+checkpoint_save ( int_t iteration )
+{
+    double time_start = MPI_Wtime ();
+
+    checkpoint_complete ();
+    checkpoint_copy ( true );
+
+    MPI_File_open ( mpi_ctx.cart_comm, CHECKPOINT_FILE ".tmp", MPI_MODE_CREATE | MPI_MODE_WRONLY,
+                    MPI_INFO_NULL, &checkpoint.file );
+    if ( mpi_ctx.rank == 0 ) {
+        CheckpointHeader header = { .M         = sim_params.M,
+                                    .N         = sim_params.N,
+                                    .order     = sim_params.order,
+                                    .iteration = iteration,
+                                    .dt        = wave_equation_params.dt };
+        memcpy ( header.magic, CHECKPOINT_MAGIC, sizeof ( header.magic ) );
+        MPI_File_write_at ( checkpoint.file, 0, &header, sizeof ( header ), MPI_BYTE,
+                            MPI_STATUS_IGNORE );
+    }
+    MPI_File_set_view ( checkpoint.file, sizeof ( CheckpointHeader ), MPI_DOUBLE,
+                        checkpoint.file_type, "native", MPI_INFO_NULL );
+    MPI_File_iwrite_all ( checkpoint.file, checkpoint.staging, 2 * mpi_ctx.M * mpi_ctx.N,
+                          MPI_DOUBLE, &checkpoint.request );
+    checkpoint.pending = true;
+
+    if ( sim_params.checkpoint_frequency > 0 ) {
+        checkpoint.next = iteration + sim_params.checkpoint_frequency;
+        return;
+    }
+
+    // The slowest rank decides both the cost and the time per step
+    double time_end = MPI_Wtime ();
+    double times[2] = { time_end - time_start, ( time_start - checkpoint.time_last )
+                                                    / ( iteration - checkpoint.last ) };
+    MPI_Allreduce ( MPI_IN_PLACE, times, 2, MPI_DOUBLE, MPI_MAX, mpi_ctx.cart_comm );
+    int_t interval       = sqrt ( 2.0 * times[0] * CHECKPOINT_MTBF ) / times[1];
+    checkpoint.next      = iteration + ( interval > 0 ? interval : 1 );
+    checkpoint.last      = iteration;
+    checkpoint.time_last = time_end;
+}
+
+// Load both time levels from the checkpoint the run restarts from
+static void
+checkpoint_restore ( void )
+{
+    MPI_File in;
+    MPI_File_open ( mpi_ctx.cart_comm, CHECKPOINT_FILE, MPI_MODE_RDONLY, MPI_INFO_NULL, &in );
+    MPI_File_set_view ( in, sizeof ( CheckpointHeader ), MPI_DOUBLE, checkpoint.file_type,
+                        "native", MPI_INFO_NULL );
+    MPI_File_read_all ( in, checkpoint.staging, 2 * mpi_ctx.M * mpi_ctx.N, MPI_DOUBLE,
+                        MPI_STATUS_IGNORE );
+    MPI_File_close ( &in );
+    checkpoint_copy ( false );
+}
+
+// Read the header of the checkpoint to restart from, before the domain is set up
+static bool
+checkpoint_read_header ( CheckpointHeader *header )
+{
+    FILE *in = fopen ( CHECKPOINT_FILE, "rb" );
+    bool  ok = ( in != NULL && fread ( header, sizeof ( *header ), 1, in ) == 1
+                && memcmp ( header->magic, CHECKPOINT_MAGIC, sizeof ( header->magic ) ) == 0 );
+    if ( in != NULL ) {
+        fclose ( in );
+    }
+    return ok;
+}
+
 static void
 find_neighbors ( int *north, int *south, int *east, int *west )
 {
@@ -95,34 +271,388 @@ find_neighbors ( int *north, int *south, int *east, int *west )
     MPI_Cart_shift ( mpi_ctx.cart_comm, 1, 1, west, east );
 }
 
+// Index of the neighbors in HaloShared
+enum { NORTH, SOUTH, WEST, EAST };
+
+// Number of times a rank polls a neighbor's step counter before it starts yielding the CPU
+#define HALO_SPIN_COUNT 4096
+
+// Put the time steps of this rank in its segment of a window shared by the node, and find the
+// segments of the neighbors on the node. The window stays locked for the whole run, so that
+// MPI_Win_sync can order the loads and stores to it.
+static void
+halo_shared_initialize ( size_t alloc_size )
+{
+    MPI_Comm_split_type ( mpi_ctx.cart_comm, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL,
+                          &halo_shared.node_comm );
+
+    // Each segment is placed in the memory of its own rank
+    MPI_Info info;
+    MPI_Info_create ( &info );
+    MPI_Info_set ( info, "alloc_shared_noncontig", "true" );
+    char *segment;
+    MPI_Win_allocate_shared ( CACHE_LINE_SIZE + 3 * alloc_size, 1, info, halo_shared.node_comm,
+                              &segment, &halo_shared.win );
+    MPI_Info_free ( &info );
+
+    halo_shared.step     = (int_t *)segment;
+    halo_shared.base     = (real_t *)( segment + CACHE_LINE_SIZE );
+    time_steps.prev_step = halo_shared.base;
+    time_steps.curr_step = halo_shared.base + alloc_size / sizeof ( real_t );
+    time_steps.next_step = halo_shared.base + 2 * alloc_size / sizeof ( real_t );
+
+    // No counter is read before it is set
+    MPI_Win_lock_all ( MPI_MODE_NOCHECK, halo_shared.win );
+    __atomic_store_n ( halo_shared.step, -1, __ATOMIC_SEQ_CST );
+    MPI_Win_sync ( halo_shared.win );
+    MPI_Barrier ( halo_shared.node_comm );
+
+    int       neighbors[4], node_ranks[4];
+    MPI_Group cart_group, node_group;
+    find_neighbors ( &neighbors[NORTH], &neighbors[SOUTH], &neighbors[EAST], &neighbors[WEST] );
+    MPI_Comm_group ( mpi_ctx.cart_comm, &cart_group );
+    MPI_Comm_group ( halo_shared.node_comm, &node_group );
+    MPI_Group_translate_ranks ( cart_group, 4, neighbors, node_group, node_ranks );
+    MPI_Group_free ( &cart_group );
+    MPI_Group_free ( &node_group );
+
+    int n_on_node = 0;
+    for ( int d = 0; d < 4; d++ ) {
+        halo_shared.neighbor_base[d] = NULL;
+        halo_shared.neighbor_step[d] = NULL;
+        if ( neighbors[d] == MPI_PROC_NULL || node_ranks[d] == MPI_UNDEFINED ) {
+            continue;
+        }
+        MPI_Aint size;
+        int      disp_unit;
+        char    *neighbor;
+        MPI_Win_shared_query ( halo_shared.win, node_ranks[d], &size, &disp_unit, &neighbor );
+        halo_shared.neighbor_step[d] = (int_t *)neighbor;
+        halo_shared.neighbor_base[d] = (real_t *)( neighbor + CACHE_LINE_SIZE );
+        n_on_node++;
+    }
+    LogDebug ( "Rank %ld exchanges the halo with %d neighbors through shared memory\n", mpi_ctx.rank,
+               n_on_node );
+}
+
+static void
+halo_shared_finalize ( void )
+{
+    MPI_Win_unlock_all ( halo_shared.win );
+    MPI_Win_free ( &halo_shared.win );
+    MPI_Comm_free ( &halo_shared.node_comm );
+}
+
+// Tell the neighbors on the node which step the present buffer holds. The stores to the buffers are
+// made visible before the counter.
+static void
+halo_shared_publish ( int_t step )
+{
+    MPI_Win_sync ( halo_shared.win );
+    __atomic_store_n ( halo_shared.step, step, __ATOMIC_RELEASE );
+}
+
+// Copy the ghost points on side d from the present buffer of the neighbor there, once it holds the
+// same step as ours. The buffers of all ranks have the same size and rotate in step, so its present
+// buffer is at the same offset in its segment as ours. It cannot be overwritten while we read it: the
+// neighbor writes to it again two steps on, and it waits for our counter before the first of them.
+static void
+halo_shared_read ( int d )
+{
+    int_t  step = *halo_shared.step;
+    int_t *their_step = halo_shared.neighbor_step[d];
+    for ( int spin = 0; __atomic_load_n ( their_step, __ATOMIC_ACQUIRE ) < step; spin++ ) {
+        if ( spin >= HALO_SPIN_COUNT ) {
+            sched_yield ();
+        }
+    }
+    MPI_Win_sync ( halo_shared.win );
+
+    real_t *their = halo_shared.neighbor_base[d] + ( time_steps.curr_step - halo_shared.base );
+#define U_their( i, j ) their[grid.origin + ( i ) * grid.pitch + ( j )]
+
+    int_t M = mpi_ctx.M;
+    int_t N = mpi_ctx.N;
+    int_t h = grid.halo;
+    switch ( d ) {
+        case NORTH:
+            for ( int_t k = 0; k < h; k++ ) {
+                memcpy ( &U ( k - h, 0 ), &U_their ( M - h + k, 0 ), N * sizeof ( real_t ) );
+            }
+            break;
+        case SOUTH:
+            for ( int_t k = 0; k < h; k++ ) {
+                memcpy ( &U ( M + k, 0 ), &U_their ( k, 0 ), N * sizeof ( real_t ) );
+            }
+            break;
+        case WEST:
+            for ( int_t i = 0; i < M; i++ ) {
+                memcpy ( &U ( i, -h ), &U_their ( i, N - h ), h * sizeof ( real_t ) );
+            }
+            break;
+        case EAST:
+            for ( int_t i = 0; i < M; i++ ) {
+                memcpy ( &U ( i, N ), &U_their ( i, 0 ), h * sizeof ( real_t ) );
+            }
+            break;
+    }
+#undef U_their
+}
+
+// Expose each time step buffer in a window, and gather the neighbors into the group of the epochs
+static void
+halo_rma_initialize ( size_t alloc_size )
+{
+    // A lone rank has nothing to exchange, and not every MPI library opens a window on one process
+    halo_rma.n_neighbors = 0;
+    if ( mpi_ctx.commsize == 1 ) {
+        return;
+    }
+
+    // Only post-start-complete-wait epochs are used
+    MPI_Info info;
+    MPI_Info_create ( &info );
+    MPI_Info_set ( info, "no_locks", "true" );
+    halo_rma.buffer[0] = time_steps.prev_step;
+    halo_rma.buffer[1] = time_steps.curr_step;
+    halo_rma.buffer[2] = time_steps.next_step;
+    for ( int k = 0; k < 3; k++ ) {
+        MPI_Win_create ( halo_rma.buffer[k], alloc_size, sizeof ( real_t ), info, mpi_ctx.cart_comm,
+                         &halo_rma.win[k] );
+    }
+    MPI_Info_free ( &info );
+
+    int neighbors[4], ranks[4];
+    find_neighbors ( &neighbors[NORTH], &neighbors[SOUTH], &neighbors[EAST], &neighbors[WEST] );
+    for ( int d = 0; d < 4; d++ ) {
+        if ( neighbors[d] != MPI_PROC_NULL ) {
+            ranks[halo_rma.n_neighbors++] = neighbors[d];
+        }
+    }
+    MPI_Group cart_group;
+    MPI_Comm_group ( mpi_ctx.cart_comm, &cart_group );
+    MPI_Group_incl ( cart_group, halo_rma.n_neighbors, ranks, &halo_rma.neighbors );
+    MPI_Group_free ( &cart_group );
+}
+
+static void
+halo_rma_finalize ( void )
+{
+    if ( mpi_ctx.commsize == 1 ) {
+        return;
+    }
+    for ( int k = 0; k < 3; k++ ) {
+        MPI_Win_free ( &halo_rma.win[k] );
+    }
+    MPI_Group_free ( &halo_rma.neighbors );
+}
+
+// Put the outermost 'halo' rows and columns into the ghost points of the neighbors. The buffers of
+// all ranks have the same layout and rotate in step, so the target is the window of the buffer that
+// is our present one, at the offset of the ghost points in our own buffer.
+static void
+halo_rma_exchange ( void )
+{
+    if ( halo_rma.n_neighbors == 0 ) {
+        return;
+    }
+
+    MPI_Win win = MPI_WIN_NULL;
+    for ( int k = 0; k < 3; k++ ) {
+        if ( halo_rma.buffer[k] == time_steps.curr_step ) {
+            win = halo_rma.win[k];
+        }
+    }
+
+    int north, south, east, west;
+    find_neighbors ( &north, &south, &east, &west );
+
+    int_t M = mpi_ctx.M;
+    int_t N = mpi_ctx.N;
+    int_t h = grid.halo;
+#define DISP( i, j ) ( grid.origin + ( i ) * grid.pitch + ( j ) )
+
+    // Our ghost points are open to the neighbors while we put into theirs. The puts to a missing
+    // neighbor, MPI_PROC_NULL, do nothing.
+    MPI_Win_post ( halo_rma.neighbors, 0, win );
+    MPI_Win_start ( halo_rma.neighbors, 0, win );
+
+    MPI_Put ( &U ( 0, 0 ), 1, mpi_ctx.MpiRow, north, DISP ( M, 0 ), 1, mpi_ctx.MpiRow, win );
+    MPI_Put ( &U ( M - h, 0 ), 1, mpi_ctx.MpiRow, south, DISP ( -h, 0 ), 1, mpi_ctx.MpiRow, win );
+    MPI_Put ( &U ( 0, 0 ), 1, mpi_ctx.MpiCol, west, DISP ( 0, N ), 1, mpi_ctx.MpiCol, win );
+    MPI_Put ( &U ( 0, N - h ), 1, mpi_ctx.MpiCol, east, DISP ( 0, -h ), 1, mpi_ctx.MpiCol, win );
+
+    MPI_Win_complete ( win );
+    MPI_Win_wait ( win );
+#undef DISP
+}
+
 // TASK: T6
 // Communicate the border between processes.
 static void
 border_exchange ( void )
 {
     // BEGIN: T6
+    if ( sim_params.exchange == EXCHANGE_RMA ) {
+        halo_rma_exchange ();
+        return;
+    }
+
     int north, south, east, west;
     find_neighbors ( &north, &south, &east, &west );
 
-    // Send top row to north, receive top row from south in bottom ghost row
+    // Neighbors on the node are read from shared memory, and left out of the messages below
+    if ( sim_params.exchange == EXCHANGE_SHARED ) {
+        int *neighbors[4] = { &north, &south, &west, &east };
+        for ( int d = 0; d < 4; d++ ) {
+            if ( halo_shared.neighbor_base[d] != NULL ) {
+                halo_shared_read ( d );
+                *neighbors[d] = MPI_PROC_NULL;
+            }
+        }
+    }
+
+    // The datatypes cover 'halo' rows or columns, as deep as the stencil reaches
+    int_t h = grid.halo;
+
+    // Send top rows to north, receive top rows from south in bottom ghost rows
     MPI_Sendrecv ( &U ( 0, 0 ), 1, mpi_ctx.MpiRow, north, 0, &U ( mpi_ctx.M, 0 ), 1, mpi_ctx.MpiRow,
                    south, 0, mpi_ctx.cart_comm, MPI_STATUS_IGNORE );
 
-    // Send bottom row to south, receive bottom row from north in top ghost row
-    MPI_Sendrecv ( &U ( mpi_ctx.M - 1, 0 ), 1, mpi_ctx.MpiRow, south, 0, &U ( -1, 0 ), 1,
+    // Send bottom rows to south, receive bottom rows from north in top ghost rows
+    MPI_Sendrecv ( &U ( mpi_ctx.M - h, 0 ), 1, mpi_ctx.MpiRow, south, 0, &U ( -h, 0 ), 1,
                    mpi_ctx.MpiRow, north, 0, mpi_ctx.cart_comm, MPI_STATUS_IGNORE );
 
-    // Send right col to east, reveive right row from west into left ghost col
-    MPI_Sendrecv ( &U ( 0, mpi_ctx.N - 1 ), 1, mpi_ctx.MpiCol, east, 0, &U ( 0, -1 ), 1,
+    // Send right cols to east, reveive right cols from west into left ghost cols
+    MPI_Sendrecv ( &U ( 0, mpi_ctx.N - h ), 1, mpi_ctx.MpiCol, east, 0, &U ( 0, -h ), 1,
                    mpi_ctx.MpiCol, west, 0, mpi_ctx.cart_comm, MPI_STATUS_IGNORE );
 
-    // Send left col to west, receive left col from east into right ghost col
+    // Send left cols to west, receive left cols from east into right ghost cols
     MPI_Sendrecv ( &U ( 0, 0 ), 1, mpi_ctx.MpiCol, west, 0, &U ( 0, mpi_ctx.N ), 1, mpi_ctx.MpiCol,
                    east, 0, mpi_ctx.cart_comm, MPI_STATUS_IGNORE );
 
     //  END: T6
 }
 
+// Lay out the local M x N points with 'halo' ghost points on each side. The halo sits in the padding
+// in front of each row so that the interior of every row starts on a cache line. The pitch is an
+// odd number of cache lines: with a power-of-two pitch, the rows read by the stencil map to the
+// same cache sets and evict each other.
+static void
+grid_initialize ( int_t N, int_t halo )
+{
+    int_t line_len   = CACHE_LINE_SIZE / sizeof ( real_t );
+    int_t col_offset = ( halo + line_len - 1 ) / line_len * line_len;
+    int_t n_lines    = ( col_offset + N + halo + line_len - 1 ) / line_len;
+    if ( n_lines % 2 == 0 ) {
+        n_lines += 1;
+    }
+
+    grid.halo   = halo;
+    grid.pitch  = n_lines * line_len;
+    grid.origin = halo * grid.pitch + col_offset;
+}
+
+// Stream the initial condition in from a file of M x N doubles, in the layout of the snapshots.
+// Each rank reads its part straight into the present time step.
+static void
+domain_read_initial ( const char *filename )
+{
+    MPI_File   in;
+    MPI_Offset size;
+    if ( MPI_File_open ( mpi_ctx.cart_comm, filename, MPI_MODE_RDONLY, MPI_INFO_NULL, &in )
+         != MPI_SUCCESS ) {
+        fprintf ( stderr, "'%s' is neither an initial condition nor a file\n", filename );
+        MPI_Abort ( MPI_COMM_WORLD, EXIT_FAILURE );
+    }
+    MPI_File_get_size ( in, &size );
+    if ( size != (MPI_Offset)( sim_params.M * sim_params.N * sizeof ( real_t ) ) ) {
+        fprintf ( stderr, "'%s' does not hold %ldx%ld doubles\n", filename, sim_params.M,
+                  sim_params.N );
+        MPI_Abort ( MPI_COMM_WORLD, EXIT_FAILURE );
+    }
+
+    int global_grid_dims[2] = { sim_params.M, sim_params.N };
+    int local_grid_dims[2]  = { mpi_ctx.M, mpi_ctx.N };
+    int local_coords[2]     = { mpi_ctx.y * mpi_ctx.M, mpi_ctx.x * mpi_ctx.N };
+
+    MPI_Datatype my_area;
+    MPI_Type_create_subarray ( 2, global_grid_dims, local_grid_dims, local_coords, MPI_ORDER_C,
+                               MPI_DOUBLE, &my_area );
+    MPI_Type_commit ( &my_area );
+    MPI_File_set_view ( in, 0, MPI_DOUBLE, my_area, "native", MPI_INFO_NULL );
+    MPI_File_read_all ( in, &U ( 0, 0 ), 1, mpi_ctx.MpiGrid, MPI_STATUS_IGNORE );
+    MPI_File_close ( &in );
+    MPI_Type_free ( &my_area );
+
+#pragma omp parallel for schedule( static, OVERLAP_ROWS )
+    for ( int_t i = 0; i < mpi_ctx.M; i++ ) {
+        memcpy ( &U_prv ( i, 0 ), &U ( i, 0 ), mpi_ctx.N * sizeof ( real_t ) );
+    }
+}
+
+// One time step buffer, starting on a cache line
+static real_t *
+time_step_alloc ( size_t size )
+{
+    void *buffer = NULL;
+    if ( posix_memalign ( &buffer, CACHE_LINE_SIZE, size ) != 0 ) {
+        fprintf ( stderr, "Failed to allocate %zu bytes for a time step\n", size );
+        MPI_Abort ( MPI_COMM_WORLD, EXIT_FAILURE );
+    }
+    return buffer;
+}
+
+// Where the last 'halo' rows start, past the first ones on a small subdomain. The rows in between
+// are the interior, which does not need the halo of this step.
+static int_t
+interior_end ( void )
+{
+    int_t h = grid.halo;
+    return ( mpi_ctx.M - h > h ) ? mpi_ctx.M - h : h;
+}
+
+// The interior is cut into blocks of OVERLAP_ROWS rows, dealt round-robin to the threads other than
+// the master, which exchanges the halo meanwhile, or to the master when it is alone. The first
+// touch and the time step deal them out the same way, so every thread computes on the pages it
+// placed, in every step. Gives the first row of this thread and the stride to its next block, or
+// false when it has none.
+static bool
+interior_rows ( int_t *first, int_t *stride )
+{
+    int thread    = omp_get_thread_num ();
+    int n_threads = omp_get_num_threads ();
+    if ( n_threads > 1 ) {
+        if ( thread == 0 ) {
+            return false;
+        }
+        thread -= 1;
+        n_threads -= 1;
+    }
+    *first  = grid.halo + thread * OVERLAP_ROWS;
+    *stride = n_threads * OVERLAP_ROWS;
+    return true;
+}
+
+// Zero rows i0 to i1 - 1 of the three time steps, ghost points included, and fill the present and
+// previous one with the initial condition, unless it comes from a file
+static void
+domain_touch_rows ( int_t i0, int_t i1, const InitialCondition *initial,
+                    const InitialDomain *domain )
+{
+    size_t row_size = grid.pitch * sizeof ( real_t );
+    int_t  h        = grid.halo;
+    for ( int_t i = i0; i < i1; i++ ) {
+        memset ( time_steps.prev_step + ( i + h ) * grid.pitch, 0, row_size );
+        memset ( time_steps.curr_step + ( i + h ) * grid.pitch, 0, row_size );
+        memset ( time_steps.next_step + ( i + h ) * grid.pitch, 0, row_size );
+        if ( initial->fill != NULL && i >= 0 && i < mpi_ctx.M ) {
+            initial->fill ( domain, i, i + 1, &U ( i, 0 ), grid.pitch );
+            memcpy ( &U_prv ( i, 0 ), &U ( i, 0 ), mpi_ctx.N * sizeof ( real_t ) );
+        }
+    }
+}
+
 // TASK: T4
 // Set up our three buffers, and fill two with an initial perturbation
 // and set the time step.
@@ -130,38 +660,63 @@ static void
 domain_initialize ( void )
 {
     // BEGIN: T4
-    size_t alloc_size = ( mpi_ctx.M + 2 ) * ( mpi_ctx.N + 2 ) * sizeof ( real_t );
-    LogDebug ( "Allocating %zd bytes for each timestep\n", alloc_size );
-
-    time_steps.prev_step = malloc ( alloc_size );
-    time_steps.curr_step = malloc ( alloc_size );
-    time_steps.next_step = malloc ( alloc_size );
-
-    real_t c        = wave_equation_params.c;
-    real_t dx       = wave_equation_params.dx;
-    real_t dy       = wave_equation_params.dy;
-    int_t  M_offset = mpi_ctx.M * mpi_ctx.y;
-    int_t  N_offset = mpi_ctx.N * mpi_ctx.x;
-    int_t  global_M = sim_params.M;
-    int_t  global_N = sim_params.N;
-    LogDebug ( "Rank (%ld, %ld) has offsets M(%ld) N(%ld)\n", mpi_ctx.y, mpi_ctx.x, M_offset,
-               N_offset );
+    size_t alloc_size = ( mpi_ctx.M + 2 * grid.halo ) * grid.pitch * sizeof ( real_t );
+    LogDebug ( "Allocating %zd bytes for each timestep (pitch %ld)\n", alloc_size, grid.pitch );
+
+    if ( sim_params.exchange == EXCHANGE_SHARED ) {
+        halo_shared_initialize ( alloc_size );
+    } else {
+        time_steps.prev_step = time_step_alloc ( alloc_size );
+        time_steps.curr_step = time_step_alloc ( alloc_size );
+        time_steps.next_step = time_step_alloc ( alloc_size );
+    }
 
-    for ( int_t i = 0; i < mpi_ctx.M; i++ ) {
-        for ( int_t j = 0; j < mpi_ctx.N; j++ ) {
-            // Calculate delta (radial distance) adjusted for M x N grid
-            real_t delta
-                = sqrt ( ( ( i + M_offset - global_M / 2.0 ) * ( i + M_offset - global_M / 2.0 ) )
-                             / (real_t)global_M
-                         + ( ( j + N_offset - global_N / 2.0 ) * ( j + N_offset - global_N / 2.0 ) )
-                               / (real_t)global_N );
-
-            U_prv ( i, j ) = U ( i, j ) = exp ( -4.0 * delta * delta );
+    real_t c  = wave_equation_params.c;
+    real_t dx = wave_equation_params.dx;
+    real_t dy = wave_equation_params.dy;
+    int_t  M  = mpi_ctx.M;
+    int_t  h  = grid.halo;
+
+    const InitialCondition *initial = initial_condition_find ( sim_params.initial_condition );
+    InitialDomain           domain  = { .M          = sim_params.M,
+                                        .N          = sim_params.N,
+                                        .row_offset = mpi_ctx.M * mpi_ctx.y,
+                                        .col_offset = mpi_ctx.N * mpi_ctx.x,
+                                        .n_cols     = mpi_ctx.N };
+    LogDebug ( "Rank (%ld, %ld) has offsets M(%ld) N(%ld)\n", mpi_ctx.y, mpi_ctx.x,
+               domain.row_offset, domain.col_offset );
+
+    // The threads touch the rows of all three time steps first, in the blocks of rows they
+    // compute, so that the pages end up in the memory closest to them. The few rows next to the
+    // halo go to the master.
+    int_t M_h = interior_end ();
+#pragma omp parallel
+    {
+        int_t first, stride;
+        if ( interior_rows ( &first, &stride ) ) {
+            for ( int_t i = first; i < M_h; i += stride ) {
+                domain_touch_rows ( i, ( i + OVERLAP_ROWS < M_h ) ? i + OVERLAP_ROWS : M_h, initial,
+                                    &domain );
+            }
+        }
+#pragma omp master
+        {
+            domain_touch_rows ( -h, h, initial, &domain );
+            domain_touch_rows ( M_h, M + h, initial, &domain );
         }
     }
+    if ( initial->fill == NULL ) {
+        domain_read_initial ( sim_params.initial_condition );
+    }
+
+    // After the first touch, as the window may pin the pages
+    if ( sim_params.exchange == EXCHANGE_RMA ) {
+        halo_rma_initialize ( alloc_size );
+    }
 
-    // Set the time step for 2D case
-    wave_equation_params.dt = dx * dy / ( c * sqrt ( dx * dx + dy * dy ) );
+    // Set the time step for 2D case, shorter for the wider stencils
+    wave_equation_params.dt
+        = dx * dy / ( c * sqrt ( dx * dx + dy * dy ) ) * stencil_time_step_scale ( grid.halo );
     // END: T4
 }
 
@@ -169,35 +724,78 @@ domain_initialize ( void )
 static void
 domain_finalize ( void )
 {
+    if ( sim_params.exchange == EXCHANGE_SHARED ) {
+        halo_shared_finalize ();
+        return;
+    }
+    if ( sim_params.exchange == EXCHANGE_RMA ) {
+        halo_rma_finalize ();
+    }
     free ( time_steps.prev_step );
     free ( time_steps.curr_step );
     free ( time_steps.next_step );
 }
 
 // TASK: T5
-// Integration formula
-static void
-time_step ( void )
+// Integration formula, with the central difference stencil of radius R, for rows i0..i1-1 and
+// columns j0..j1-1. It is inlined into one kernel per radius, so the loop over the stencil points
+// unrolls with the weights as constants, and the loop over j vectorizes.
+static inline __attribute__ ( ( always_inline ) ) void
+time_step_radius ( const int R, int_t i0, int_t i1, int_t j0, int_t j1 )
 {
-    int_t  M  = mpi_ctx.M;
-    int_t  N  = mpi_ctx.N;
     real_t c  = wave_equation_params.c;
     real_t dx = wave_equation_params.dx;
     real_t dy = wave_equation_params.dy;
     real_t dt = wave_equation_params.dt;
 
     // BEGIN: T5
-    for ( int_t i = 0; i < M; i++ ) {
-        for ( int_t j = 0; j < N; j++ ) {
+    for ( int_t i = i0; i < i1; i++ ) {
+        for ( int_t j = j0; j < j1; j++ ) {
+            real_t laplacian = stencil_weights[R][1]
+                             * ( U ( i - 1, j ) + U ( i + 1, j ) + U ( i, j - 1 ) + U ( i, j + 1 ) );
+            for ( int k = 2; k <= R; k++ ) {
+                laplacian += stencil_weights[R][k]
+                           * ( U ( i - k, j ) + U ( i + k, j ) + U ( i, j - k ) + U ( i, j + k ) );
+            }
+            laplacian += 2.0 * stencil_weights[R][0] * U ( i, j );
+
             U_nxt ( i, j ) = -U_prv ( i, j ) + 2.0 * U ( i, j )
-                           + ( dt * dt * c * c ) / ( dx * dy )
-                                 * ( U ( i - 1, j ) + U ( i + 1, j ) + U ( i, j - 1 )
-                                     + U ( i, j + 1 ) - 4.0 * U ( i, j ) );
+                           + ( dt * dt * c * c ) / ( dx * dy ) * laplacian;
         }
     }
     // END: T5
 }
 
+static void
+time_step_2 ( int_t i0, int_t i1, int_t j0, int_t j1 )
+{
+    time_step_radius ( 1, i0, i1, j0, j1 );
+}
+
+static void
+time_step_4 ( int_t i0, int_t i1, int_t j0, int_t j1 )
+{
+    time_step_radius ( 2, i0, i1, j0, j1 );
+}
+
+static void
+time_step_6 ( int_t i0, int_t i1, int_t j0, int_t j1 )
+{
+    time_step_radius ( 3, i0, i1, j0, j1 );
+}
+
+static void
+time_step_8 ( int_t i0, int_t i1, int_t j0, int_t j1 )
+{
+    time_step_radius ( 4, i0, i1, j0, j1 );
+}
+
+// Kernel for the order of the run, indexed by the stencil radius
+typedef void ( *TimeStepKernel ) ( int_t i0, int_t i1, int_t j0, int_t j1 );
+static const TimeStepKernel time_step_kernels[STENCIL_MAX_RADIUS + 1]
+    = { NULL, time_step_2, time_step_4, time_step_6, time_step_8 };
+static TimeStepKernel time_step;
+
 // TASK: T7
 // Neumann (reflective) boundary condition
 static void
@@ -205,46 +803,111 @@ boundary_condition ( void )
 {
     int_t M = mpi_ctx.M;
     int_t N = mpi_ctx.N;
+    int_t h = grid.halo;
 
     // BEGIN: T7
 
+    // The ghost points mirror the domain around the outermost points, as deep as the halo
     for ( int_t i = 0; i < M; i++ ) {
-        if ( mpi_ctx.x == 0 ) {
-            U ( i, -1 ) = U ( i, 1 );
-        }
-        if ( mpi_ctx.x == ( mpi_ctx.cart_cols - 1 ) ) {
-            U ( i, N ) = U ( i, N - 2 );
+        for ( int_t k = 1; k <= h; k++ ) {
+            if ( mpi_ctx.x == 0 ) {
+                U ( i, -k ) = U ( i, k );
+            }
+            if ( mpi_ctx.x == ( mpi_ctx.cart_cols - 1 ) ) {
+                U ( i, N - 1 + k ) = U ( i, N - 1 - k );
+            }
         }
     }
     for ( int_t j = 0; j < N; j++ ) {
-        if ( mpi_ctx.y == 0 ) {
-            U ( -1, j ) = U ( 1, j );
-        }
-        if ( mpi_ctx.y == ( mpi_ctx.cart_rows - 1 ) ) {
-            U ( M, j ) = U ( M - 2, j );
+        for ( int_t k = 1; k <= h; k++ ) {
+            if ( mpi_ctx.y == 0 ) {
+                U ( -k, j ) = U ( k, j );
+            }
+            if ( mpi_ctx.y == ( mpi_ctx.cart_rows - 1 ) ) {
+                U ( M - 1 + k, j ) = U ( M - 1 - k, j );
+            }
         }
     }
     // END: T7
 }
 
+
+// Exchange the halo and take the time step, with the exchange overlapped with the stencil. The main
+// thread makes the MPI calls and applies the boundary condition, while the other threads compute the
+// points that read no ghost points, and joins them when it is done. After a barrier, the threads
+// compute the outermost 'halo' rows and columns, which read the ghost points. With one thread, this
+// is the order of the flat MPI version.
+static void
+exchange_and_time_step ( void )
+{
+    int_t M = mpi_ctx.M;
+    int_t N = mpi_ctx.N;
+    int_t h = grid.halo;
+
+    // Where the last 'halo' rows and columns start, past the first ones on a small subdomain
+    int_t M_h = interior_end ();
+    int_t N_h = ( N - h > h ) ? N - h : h;
+
+#pragma omp parallel
+    {
+#pragma omp master
+        {
+            double time_start = MPI_Wtime ();
+            border_exchange ();
+            exchange_time += MPI_Wtime () - time_start;
+            if ( mpi_ctx.on_boundary ) {
+                boundary_condition ();
+            }
+        }
+
+        int_t first, stride;
+        if ( interior_rows ( &first, &stride ) ) {
+            for ( int_t i = first; i < M_h; i += stride ) {
+                time_step ( i, ( i + OVERLAP_ROWS < M_h ) ? i + OVERLAP_ROWS : M_h, h, N_h );
+            }
+        }
+
+#pragma omp barrier
+
+        // Top and bottom rows, then the left and right columns in between
+#pragma omp for schedule( static )
+        for ( int side = 0; side < 4; side++ ) {
+            switch ( side ) {
+                case 0: time_step ( 0, h, 0, N ); break;
+                case 1: time_step ( M_h, M, 0, N ); break;
+                case 2: time_step ( h, M_h, 0, h ); break;
+                case 3: time_step ( h, M_h, N_h, N ); break;
+            }
+        }
+    }
+}
+
 // Main time integration.
 static void
 simulate ( void )
 {
     int_t max_iteration      = sim_params.max_iteration;
     int_t snapshot_frequency = sim_params.snapshot_frequency;
+    bool  shared             = ( sim_params.exchange == EXCHANGE_SHARED );
+
+    if ( shared ) {
+        halo_shared_publish ( sim_params.start_iteration );
+    }
 
-    for ( int_t iteration = 0; iteration <= max_iteration; iteration++ ) {
+    for ( int_t iteration = sim_params.start_iteration; iteration <= max_iteration; iteration++ ) {
+        if ( iteration == checkpoint.next ) {
+            checkpoint_save ( iteration );
+        }
         if ( ( iteration % snapshot_frequency ) == 0 ) {
             domain_save ( iteration / snapshot_frequency );
+            checkpoint_poll ();
         }
 
-        border_exchange ();
-        if ( mpi_ctx.on_boundary ) {
-            boundary_condition ();
-        }
-        time_step ();
+        exchange_and_time_step ();
         move_buffer_window ();
+        if ( shared ) {
+            halo_shared_publish ( iteration + 1 );
+        }
     }
 }
 
@@ -266,10 +929,133 @@ on_boundary ( void )
     return on_boundary;
 }
 
+// Pick the process grid for an M x N domain: of the ways to factor the ranks into rows x cols, the
+// one whose cuts carry the fewest halo points, preferring those that split the domain evenly
+static void
+plan_process_grid ( int n_ranks, int_t M, int_t N, int dims[2] )
+{
+    bool  best_even   = false;
+    int_t best_volume = -1;
+    for ( int rows = 1; rows <= n_ranks; rows++ ) {
+        if ( n_ranks % rows != 0 ) {
+            continue;
+        }
+        int  cols = n_ranks / rows;
+        bool even = ( M % rows == 0 && N % cols == 0 );
+
+        // Each cut between two rows of ranks is N points long, and between two columns M
+        int_t volume = ( rows - 1 ) * N + ( cols - 1 ) * M;
+        if ( best_volume < 0 || ( even && !best_even )
+             || ( even == best_even && volume < best_volume ) ) {
+            best_even   = even;
+            best_volume = volume;
+            dims[0]     = rows;
+            dims[1]     = cols;
+        }
+    }
+}
+
+// Number the ranks so that each node holds a block of the process grid, which keeps most of the
+// halo inside the nodes. The blocks are rows x cols of subdomains, in the shape with the shortest
+// border that tiles the grid, and are laid out row by row in the order of the first rank of each
+// node. If the nodes differ in size, or no block tiles the grid, the ranks keep their order.
+static int
+node_aware_rank ( const int dims[2], int_t M_local, int_t N_local )
+{
+    int      world_rank = mpi_ctx.rank;
+    MPI_Comm node_comm;
+    int      node_size, node_rank, leader = world_rank;
+    MPI_Comm_split_type ( MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &node_comm );
+    MPI_Comm_size ( node_comm, &node_size );
+    MPI_Comm_rank ( node_comm, &node_rank );
+    MPI_Bcast ( &leader, 1, MPI_INT, 0, node_comm );
+    MPI_Comm_free ( &node_comm );
+
+    int sizes[2] = { node_size, -node_size };
+    MPI_Allreduce ( MPI_IN_PLACE, sizes, 2, MPI_INT, MPI_MAX, MPI_COMM_WORLD );
+    if ( sizes[0] != -sizes[1] ) {
+        return world_rank;
+    }
+
+    int   block[2]    = { 0, 0 };
+    int_t best_border = -1;
+    for ( int rows = 1; rows <= node_size; rows++ ) {
+        int cols = node_size / rows;
+        if ( node_size % rows != 0 || dims[0] % rows != 0 || dims[1] % cols != 0 ) {
+            continue;
+        }
+        int_t border = rows * M_local + cols * N_local;
+        if ( best_border < 0 || border < best_border ) {
+            best_border = border;
+            block[0]    = rows;
+            block[1]    = cols;
+        }
+    }
+    if ( best_border < 0 ) {
+        return world_rank;
+    }
+
+    int *leaders = malloc ( mpi_ctx.commsize * sizeof ( int ) );
+    MPI_Allgather ( &leader, 1, MPI_INT, leaders, 1, MPI_INT, MPI_COMM_WORLD );
+    int node = 0;
+    for ( int r = 0; r < leader; r++ ) {
+        if ( leaders[r] == r ) {
+            node++;
+        }
+    }
+    free ( leaders );
+
+    int blocks_per_row = dims[1] / block[1];
+    int y              = ( node / blocks_per_row ) * block[0] + node_rank / block[1];
+    int x              = ( node % blocks_per_row ) * block[1] + node_rank % block[1];
+    return y * dims[1] + x;
+}
+
+// Tell how many bytes the halo exchange moves in each step, and how many of them between nodes
+static void
+report_halo_volume ( void )
+{
+    int neighbors[4], node_ranks[4];
+    find_neighbors ( &neighbors[NORTH], &neighbors[SOUTH], &neighbors[EAST], &neighbors[WEST] );
+
+    MPI_Comm  node_comm;
+    MPI_Group cart_group, node_group;
+    MPI_Comm_split_type ( mpi_ctx.cart_comm, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &node_comm );
+    MPI_Comm_group ( mpi_ctx.cart_comm, &cart_group );
+    MPI_Comm_group ( node_comm, &node_group );
+    MPI_Group_translate_ranks ( cart_group, 4, neighbors, node_group, node_ranks );
+    MPI_Group_free ( &cart_group );
+    MPI_Group_free ( &node_group );
+    MPI_Comm_free ( &node_comm );
+
+    // What this rank sends, all of it and to other nodes
+    double row_bytes = grid.halo * mpi_ctx.N * sizeof ( real_t );
+    double col_bytes = grid.halo * mpi_ctx.M * sizeof ( real_t );
+    double bytes[2]  = { 0.0, 0.0 };
+    for ( int d = 0; d < 4; d++ ) {
+        if ( neighbors[d] == MPI_PROC_NULL ) {
+            continue;
+        }
+        double message = ( d == NORTH || d == SOUTH ) ? row_bytes : col_bytes;
+        bytes[0] += message;
+        if ( node_ranks[d] == MPI_UNDEFINED ) {
+            bytes[1] += message;
+        }
+    }
+    MPI_Reduce ( mpi_ctx.rank == 0 ? MPI_IN_PLACE : bytes, bytes, 2, MPI_DOUBLE, MPI_SUM, 0,
+                 mpi_ctx.cart_comm );
+    if ( mpi_ctx.rank == 0 ) {
+        printf ( "Process grid %ldx%ld of %ldx%ld subdomains, halo of %.1f kB per step, %.1f kB of it "
+                 "between nodes\n",
+                 mpi_ctx.cart_rows, mpi_ctx.cart_cols, mpi_ctx.M, mpi_ctx.N, bytes[0] / 1024.0,
+                 bytes[1] / 1024.0 );
+    }
+}
+
 static void
 mpi_ctx_initialize ( int argc, char **argv )
 {
-    size_t param_send_buf_size = 4 * sizeof ( int_t );
+    size_t param_send_buf_size = 8 * sizeof ( int_t );
     void  *param_send_buffer   = malloc ( param_send_buf_size );
     if ( mpi_ctx.rank == 0 ) {
         OPTIONS *options = parse_args ( argc, argv );
@@ -278,10 +1064,29 @@ mpi_ctx_initialize ( int argc, char **argv )
             exit ( EXIT_FAILURE );
         }
 
-        sim_params.M                  = options->M;
-        sim_params.N                  = options->N;
-        sim_params.max_iteration      = options->max_iteration;
-        sim_params.snapshot_frequency = options->snapshot_frequency;
+        sim_params.M                    = options->M;
+        sim_params.N                    = options->N;
+        sim_params.max_iteration        = options->max_iteration;
+        sim_params.snapshot_frequency   = options->snapshot_frequency;
+        sim_params.checkpoint_frequency = options->checkpoint_frequency;
+        sim_params.order                = options->order;
+        sim_params.exchange             = options->exchange;
+        strcpy ( sim_params.initial_condition, options->initial );
+
+        // A restarted run carries on with the domain of the checkpoint
+        if ( options->restart ) {
+            CheckpointHeader header;
+            if ( !checkpoint_read_header ( &header ) ) {
+                fprintf ( stderr, "No checkpoint to restart from in '%s'\n", CHECKPOINT_FILE );
+                MPI_Abort ( MPI_COMM_WORLD, EXIT_FAILURE );
+            }
+            sim_params.M               = header.M;
+            sim_params.N               = header.N;
+            sim_params.order           = header.order;
+            sim_params.start_iteration = header.iteration;
+            printf ( "Restarting a %ldx%ld run of order %ld from iteration %ld\n", header.M,
+                     header.N, header.order, header.iteration );
+        }
 
         int buffer_pos = 0;
         MPI_Pack ( &sim_params.M, 1, MPI_INT64_T, param_send_buffer, param_send_buf_size,
@@ -292,9 +1097,19 @@ mpi_ctx_initialize ( int argc, char **argv )
                    param_send_buf_size, &buffer_pos, MPI_COMM_WORLD );
         MPI_Pack ( &sim_params.snapshot_frequency, 1, MPI_INT64_T, param_send_buffer,
                    param_send_buf_size, &buffer_pos, MPI_COMM_WORLD );
+        MPI_Pack ( &sim_params.checkpoint_frequency, 1, MPI_INT64_T, param_send_buffer,
+                   param_send_buf_size, &buffer_pos, MPI_COMM_WORLD );
+        MPI_Pack ( &sim_params.start_iteration, 1, MPI_INT64_T, param_send_buffer,
+                   param_send_buf_size, &buffer_pos, MPI_COMM_WORLD );
+        MPI_Pack ( &sim_params.order, 1, MPI_INT64_T, param_send_buffer, param_send_buf_size,
+                   &buffer_pos, MPI_COMM_WORLD );
+        MPI_Pack ( &sim_params.exchange, 1, MPI_INT64_T, param_send_buffer, param_send_buf_size,
+                   &buffer_pos, MPI_COMM_WORLD );
     }
 
     MPI_Bcast ( param_send_buffer, param_send_buf_size, MPI_PACKED, 0, MPI_COMM_WORLD );
+    MPI_Bcast ( sim_params.initial_condition, sizeof ( sim_params.initial_condition ), MPI_CHAR, 0,
+                MPI_COMM_WORLD );
 
     if ( !( mpi_ctx.rank == 0 ) ) {
         int buffer_pos = 0;
@@ -306,21 +1121,35 @@ mpi_ctx_initialize ( int argc, char **argv )
                      1, MPI_INT64_T, MPI_COMM_WORLD );
         MPI_Unpack ( param_send_buffer, param_send_buf_size, &buffer_pos,
                      &sim_params.snapshot_frequency, 1, MPI_INT64_T, MPI_COMM_WORLD );
+        MPI_Unpack ( param_send_buffer, param_send_buf_size, &buffer_pos,
+                     &sim_params.checkpoint_frequency, 1, MPI_INT64_T, MPI_COMM_WORLD );
+        MPI_Unpack ( param_send_buffer, param_send_buf_size, &buffer_pos,
+                     &sim_params.start_iteration, 1, MPI_INT64_T, MPI_COMM_WORLD );
+        MPI_Unpack ( param_send_buffer, param_send_buf_size, &buffer_pos, &sim_params.order, 1,
+                     MPI_INT64_T, MPI_COMM_WORLD );
+        MPI_Unpack ( param_send_buffer, param_send_buf_size, &buffer_pos, &sim_params.exchange, 1,
+                     MPI_INT64_T, MPI_COMM_WORLD );
     }
     free ( param_send_buffer );
 
     LogDebug ( "Rank %ld has sim_params:\n M=%ld\n N=%ld\n max_iteration=%ld\n "
-               "snapshot_frequency=%ld\n",
+               "snapshot_frequency=%ld\n order=%ld\n",
                mpi_ctx.rank, sim_params.M, sim_params.N, sim_params.max_iteration,
-               sim_params.snapshot_frequency );
+               sim_params.snapshot_frequency, sim_params.order );
 
+    // The ranks are numbered for the nodes here, so MPI is not asked to reorder them again
+    int      world_rank   = mpi_ctx.rank;
     int      n_cart_dims  = 2;
     int      cart_dims[2] = { 0 };
     int      periods[2]   = { 0 };
     int      reorder      = 0;
-    MPI_Comm cart_comm;
-    MPI_Dims_create ( mpi_ctx.commsize, n_cart_dims, cart_dims );
-    MPI_Cart_create ( MPI_COMM_WORLD, n_cart_dims, cart_dims, periods, reorder, &cart_comm );
+    MPI_Comm ordered_comm, cart_comm;
+    plan_process_grid ( mpi_ctx.commsize, sim_params.M, sim_params.N, cart_dims );
+    int ordered_rank = node_aware_rank ( cart_dims, sim_params.M / cart_dims[0],
+                                         sim_params.N / cart_dims[1] );
+    MPI_Comm_split ( MPI_COMM_WORLD, 0, ordered_rank, &ordered_comm );
+    MPI_Cart_create ( ordered_comm, n_cart_dims, cart_dims, periods, reorder, &cart_comm );
+    MPI_Comm_free ( &ordered_comm );
 
     int cart_rank;
     int coords[2];
@@ -337,25 +1166,40 @@ mpi_ctx_initialize ( int argc, char **argv )
     mpi_ctx.M           = sim_params.M / mpi_ctx.cart_rows;
     mpi_ctx.N           = sim_params.N / mpi_ctx.cart_cols;
 
+    // The stencil of order 2R reaches R points out, and the mirrored boundary needs R + 1 points
+    int_t halo = sim_params.order / 2;
+    if ( mpi_ctx.M <= halo || mpi_ctx.N <= halo ) {
+        fprintf ( stderr, "A %ldx%ld subdomain is too small for a stencil of order %ld\n", mpi_ctx.M,
+                  mpi_ctx.N, sim_params.order );
+        MPI_Abort ( MPI_COMM_WORLD, EXIT_FAILURE );
+    }
+    time_step = time_step_kernels[halo];
+
+    // The datatypes stride over whole rows of the padded layout
+    grid_initialize ( mpi_ctx.N, halo );
+
     MPI_Datatype MpiCol;
-    MPI_Type_vector ( mpi_ctx.M, 1, mpi_ctx.N + 2, MPI_DOUBLE, &MpiCol );
+    MPI_Type_vector ( mpi_ctx.M, halo, grid.pitch, MPI_DOUBLE, &MpiCol );
     MPI_Type_commit ( &MpiCol );
     mpi_ctx.MpiCol = MpiCol;
 
     MPI_Datatype MpiRow;
-    MPI_Type_contiguous ( mpi_ctx.N, MPI_DOUBLE, &MpiRow );
+    MPI_Type_vector ( halo, mpi_ctx.N, grid.pitch, MPI_DOUBLE, &MpiRow );
     MPI_Type_commit ( &MpiRow );
     mpi_ctx.MpiRow = MpiRow;
 
     MPI_Datatype MpiGrid;
-    MPI_Type_vector ( mpi_ctx.M, mpi_ctx.N, mpi_ctx.N + 2, MPI_DOUBLE, &MpiGrid );
+    MPI_Type_vector ( mpi_ctx.M, mpi_ctx.N, grid.pitch, MPI_DOUBLE, &MpiGrid );
     MPI_Type_commit ( &MpiGrid );
     mpi_ctx.MpiGrid = MpiGrid;
 
-    LogDebug ( "Process %ld in MPI_COMM_WORLD is now process %d in cart_comm "
+    LogDebug ( "Process %d in MPI_COMM_WORLD is now process %d in cart_comm "
                "with coordinates "
-               "(%ld, %ld) is %son the boundary\n",
-               mpi_ctx.rank, cart_rank, mpi_ctx.y, mpi_ctx.x, mpi_ctx.on_boundary ? "" : "not " );
+               "(%ld, %ld) is %son the boundary, and runs %d threads\n",
+               world_rank, cart_rank, mpi_ctx.y, mpi_ctx.x, mpi_ctx.on_boundary ? "" : "not ",
+               omp_get_max_threads () );
+
+    report_halo_volume ();
 }
 
 int
@@ -365,8 +1209,13 @@ main ( int argc, char **argv )
     // Initialise MPI
     // BEGIN: T1c
 
-    int commsize, my_rank;
-    MPI_Init ( &argc, &argv );
+    // Ranks may run OpenMP threads, but only the main thread makes MPI calls
+    int commsize, my_rank, provided;
+    MPI_Init_thread ( &argc, &argv, MPI_THREAD_FUNNELED, &provided );
+    if ( provided < MPI_THREAD_FUNNELED ) {
+        fprintf ( stderr, "The MPI library does not support MPI_THREAD_FUNNELED\n" );
+        MPI_Abort ( MPI_COMM_WORLD, EXIT_FAILURE );
+    }
     MPI_Comm_size ( MPI_COMM_WORLD, &commsize );
     MPI_Comm_rank ( MPI_COMM_WORLD, &my_rank );
 
@@ -383,6 +1232,10 @@ main ( int argc, char **argv )
 
     // Set up the initial state of the domain
     domain_initialize ();
+    checkpoint_initialize ();
+    if ( sim_params.start_iteration > 0 ) {
+        checkpoint_restore ();
+    }
 
     // TASK: T2
     // Time your code
@@ -404,9 +1257,19 @@ main ( int argc, char **argv )
         printf ( "Simulation time: %f\n", time_end - time_start );
     }
 
+    // The slowest rank sets the pace
+    static const char *exchange_names[] = { "sendrecv", "shared", "rma" };
+    MPI_Reduce ( mpi_ctx.rank == 0 ? MPI_IN_PLACE : &exchange_time, &exchange_time, 1, MPI_DOUBLE,
+                 MPI_MAX, 0, mpi_ctx.cart_comm );
+    if ( mpi_ctx.rank == 0 ) {
+        printf ( "Border exchange time (%s): %f\n", exchange_names[sim_params.exchange],
+                 exchange_time );
+    }
+
     // END: T2
 
     // Clean up and shut down
+    checkpoint_finalize ();
     domain_finalize ();
     mpi_types_free ();
     MPI_Comm_free ( &mpi_ctx.cart_comm );
@@ -7,6 +7,7 @@
 #include <sys/time.h>
 
 #include "argument_utils.h"
+#include "stencil.h"
 
 // Convert 'struct timeval' into seconds in double prec. floating point
 #define WALLTIME(t) ((double)(t).tv_sec + 1e-6 * (double)(t).tv_usec)
@@ -18,16 +19,19 @@ typedef double  real_t;
 // Simulation parameters: size, step count, and how often to save the state
 int_t N = 256, M = 256, max_iteration = 4000, snapshot_freq = 20;
 
+// Order of the space derivative, and the ghost points the stencil needs on each side
+int_t order = 2, halo = 1;
+
 // Wave equation parameters, time step is derived from the space step
 const real_t c = 1.0, dx = 1.0, dy = 1.0;
 real_t       dt;
 
-// Buffers for three time steps, indexed with 2 ghost points for the boundary
+// Buffers for three time steps, indexed with 2*halo ghost points for the boundary
 real_t *buffers[3] = { NULL, NULL, NULL };
 
-#define U_prv(i, j) buffers[0][((i) + 1) * (N + 2) + (j) + 1]
-#define U(i, j)     buffers[1][((i) + 1) * (N + 2) + (j) + 1]
-#define U_nxt(i, j) buffers[2][((i) + 1) * (N + 2) + (j) + 1]
+#define U_prv(i, j) buffers[0][((i) + halo) * (N + 2 * halo) + (j) + halo]
+#define U(i, j)     buffers[1][((i) + halo) * (N + 2 * halo) + (j) + halo]
+#define U_nxt(i, j) buffers[2][((i) + halo) * (N + 2 * halo) + (j) + halo]
 
 // Rotate the time step buffers.
 void
@@ -56,9 +60,9 @@ domain_save(int_t step)
 void
 domain_initialize(void)
 {
-    buffers[0] = malloc((M + 2) * (N + 2) * sizeof(real_t));
-    buffers[1] = malloc((M + 2) * (N + 2) * sizeof(real_t));
-    buffers[2] = malloc((M + 2) * (N + 2) * sizeof(real_t));
+    buffers[0] = malloc((M + 2 * halo) * (N + 2 * halo) * sizeof(real_t));
+    buffers[1] = malloc((M + 2 * halo) * (N + 2 * halo) * sizeof(real_t));
+    buffers[2] = malloc((M + 2 * halo) * (N + 2 * halo) * sizeof(real_t));
 
     for(int_t i = 0; i < M; i++) {
         for(int_t j = 0; j < N; j++) {
@@ -69,8 +73,8 @@ domain_initialize(void)
         }
     }
 
-    // Set the time step for 2D case
-    dt = dx * dy / (c * sqrt(dx * dx + dy * dy));
+    // Set the time step for 2D case, shorter for the wider stencils
+    dt = dx * dy / (c * sqrt(dx * dx + dy * dy)) * stencil_time_step_scale(halo);
 }
 
 // Get rid of all the memory allocations
@@ -82,31 +86,52 @@ domain_finalize(void)
     free(buffers[2]);
 }
 
-// Integration formula (Eq. 9 from the pdf document)
-void
-time_step(void)
+// Integration formula (Eq. 9 from the pdf document), with the central difference stencil of
+// radius R. Each radius gets its own inlined copy, where the stencil loop unrolls.
+static inline __attribute__((always_inline)) void
+time_step_radius(const int R)
 {
     for(int_t i = 0; i < M; i++) {
         for(int_t j = 0; j < N; j++) {
-            U_nxt(i, j)
-                = -U_prv(i, j) + 2.0 * U(i, j)
-                + (dt * dt * c * c) / (dx * dy)
-                      * (U(i - 1, j) + U(i + 1, j) + U(i, j - 1) + U(i, j + 1) - 4.0 * U(i, j));
+            real_t laplacian
+                = stencil_weights[R][1] * (U(i - 1, j) + U(i + 1, j) + U(i, j - 1) + U(i, j + 1));
+            for(int k = 2; k <= R; k++) {
+                laplacian += stencil_weights[R][k]
+                           * (U(i - k, j) + U(i + k, j) + U(i, j - k) + U(i, j + k));
+            }
+            laplacian += 2.0 * stencil_weights[R][0] * U(i, j);
+
+            U_nxt(i, j) = -U_prv(i, j) + 2.0 * U(i, j) + (dt * dt * c * c) / (dx * dy) * laplacian;
         }
     }
 }
 
-// Neumann (reflective) boundary condition
+void
+time_step(void)
+{
+    switch(halo) {
+    case 1: time_step_radius(1); break;
+    case 2: time_step_radius(2); break;
+    case 3: time_step_radius(3); break;
+    case 4: time_step_radius(4); break;
+    }
+}
+
+// Neumann (reflective) boundary condition, mirrored as deep as the halo
 void
 boundary_condition(void)
 {
     for(int_t i = 0; i < M; i++) {
-        U(i, -1) = U(i, 1);
-        U(i, N)  = U(i, N - 2);
+        for(int_t k = 1; k <= halo; k++) {
+            U(i, -k)        = U(i, k);
+            U(i, N - 1 + k) = U(i, N - 1 - k);
+        }
     }
     for(int_t j = 0; j < N; j++) {
-        U(-1, j) = U(1, j);
-        U(M, j)  = U(M - 2, j);
+        for(int_t k = 1; k <= halo; k++) {
+            U(-k, j)        = U(k, j);
+            U(M - 1 + k, j) = U(M - 1 - k, j);
+        }
     }
 }
 
@@ -142,6 +167,8 @@ main(int argc, char **argv)
     N             = options->N;
     max_iteration = options->max_iteration;
     snapshot_freq = options->snapshot_frequency;
+    order         = options->order;
+    halo          = order / 2;
 
     // Set up the initial state of the domain
     domain_initialize();
@@ -0,0 +1,438 @@
+#define _XOPEN_SOURCE 600
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mpi.h>
+#include <omp.h>
+
+#include "argument_utils.h"
+#include "datatypes.h"
+
+// The 3D counterpart of wave_2d_parallel: a 7-point stencil on an L x M x N grid, split over a 3D
+// cartesian communicator. Each rank holds its block with one ghost layer on each side, exchanges
+// the six faces with datatypes made with MPI_Type_create_subarray, and runs the stencil with
+// OpenMP threads. The snapshots hold the whole volume, written collectively, in (z, y, x) order.
+
+#define INDEX( k, i, j ) ( grid.origin + ( k ) * grid.plane + ( i ) * grid.pitch + ( j ) )
+#define U_prv( k, i, j ) time_steps.prev_step[INDEX ( k, i, j )]
+#define U( k, i, j )     time_steps.curr_step[INDEX ( k, i, j )]
+#define U_nxt( k, i, j ) time_steps.next_step[INDEX ( k, i, j )]
+
+// Layout of a local time step buffer: the block with one ghost layer on each side
+typedef struct
+{
+    int_t pitch; // Points in a row
+    int_t plane; // Points in a z plane
+    int_t origin;
+} GridLayout3D;
+
+static MpiCtx3D             mpi_ctx              = {};
+static SimParams3D          sim_params           = {};
+static WaveEquationParams3D wave_equation_params = { .c = 1.0, .dx = 1.0, .dy = 1.0, .dz = 1.0 };
+static TimeSteps            time_steps           = {};
+static GridLayout3D         grid                 = {};
+
+// Rotate the time step buffers.
+static void
+move_buffer_window ( void )
+{
+    real_t *prev_step    = time_steps.prev_step;
+    time_steps.prev_step = time_steps.curr_step;
+    time_steps.curr_step = time_steps.next_step;
+    time_steps.next_step = prev_step;
+}
+
+// Save the present time step in a numbered file under 'data/'
+static void
+domain_save ( int_t step )
+{
+    char filename[256];
+    sprintf ( filename, "data/%.5ld.dat", step );
+    MPI_File out;
+    MPI_File_open ( mpi_ctx.cart_comm, filename, MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL,
+                    &out );
+
+    int global_grid_dims[3] = { sim_params.L, sim_params.M, sim_params.N };
+    int local_grid_dims[3]  = { mpi_ctx.L, mpi_ctx.M, mpi_ctx.N };
+    int local_coords[3]     = { mpi_ctx.z * mpi_ctx.L, mpi_ctx.y * mpi_ctx.M,
+                                mpi_ctx.x * mpi_ctx.N };
+
+    MPI_Datatype my_volume;
+    MPI_Type_create_subarray ( 3, global_grid_dims, local_grid_dims, local_coords, MPI_ORDER_C,
+                               MPI_DOUBLE, &my_volume );
+    MPI_Type_commit ( &my_volume );
+
+    MPI_File_set_view ( out, 0, MPI_DOUBLE, my_volume, "native", MPI_INFO_NULL );
+    MPI_File_write_all ( out, time_steps.curr_step, 1, mpi_ctx.MpiGrid, MPI_STATUS_IGNORE );
+
+    MPI_File_close ( &out );
+    MPI_Type_free ( &my_volume );
+}
+
+// Communicate the faces between processes, one axis at a time
+static void
+border_exchange ( void )
+{
+    real_t *u = time_steps.curr_step;
+    for ( int axis = 0; axis < 3; axis++ ) {
+        int lower = mpi_ctx.neighbors[axis][0];
+        int upper = mpi_ctx.neighbors[axis][1];
+
+        // Send upper face up, receive the face of the lower neighbor in the lower ghost layer
+        MPI_Sendrecv ( u, 1, mpi_ctx.MpiFaceSend[axis][1], upper, 0, u, 1,
+                       mpi_ctx.MpiFaceRecv[axis][0], lower, 0, mpi_ctx.cart_comm,
+                       MPI_STATUS_IGNORE );
+
+        // Send lower face down, receive the face of the upper neighbor in the upper ghost layer
+        MPI_Sendrecv ( u, 1, mpi_ctx.MpiFaceSend[axis][0], lower, 0, u, 1,
+                       mpi_ctx.MpiFaceRecv[axis][1], upper, 0, mpi_ctx.cart_comm,
+                       MPI_STATUS_IGNORE );
+    }
+}
+
+// One time step buffer, starting on a cache line
+static real_t *
+time_step_alloc ( size_t size )
+{
+    void *buffer = NULL;
+    if ( posix_memalign ( &buffer, CACHE_LINE_SIZE, size ) != 0 ) {
+        fprintf ( stderr, "Failed to allocate %zu bytes for a time step\n", size );
+        MPI_Abort ( MPI_COMM_WORLD, EXIT_FAILURE );
+    }
+    return buffer;
+}
+
+// Set up our three buffers, and fill two with an initial perturbation and set the time step. The
+// threads touch the planes they will compute first, so the pages land on their NUMA node.
+static void
+domain_initialize ( void )
+{
+    grid.pitch  = mpi_ctx.N + 2;
+    grid.plane  = ( mpi_ctx.M + 2 ) * grid.pitch;
+    grid.origin = grid.plane + grid.pitch + 1;
+
+    size_t alloc_size = ( mpi_ctx.L + 2 ) * grid.plane * sizeof ( real_t );
+    time_steps.prev_step = time_step_alloc ( alloc_size );
+    time_steps.curr_step = time_step_alloc ( alloc_size );
+    time_steps.next_step = time_step_alloc ( alloc_size );
+
+    real_t c        = wave_equation_params.c;
+    real_t dx       = wave_equation_params.dx;
+    real_t dy       = wave_equation_params.dy;
+    real_t dz       = wave_equation_params.dz;
+    int_t  L_offset = mpi_ctx.L * mpi_ctx.z;
+    int_t  M_offset = mpi_ctx.M * mpi_ctx.y;
+    int_t  N_offset = mpi_ctx.N * mpi_ctx.x;
+    int_t  global_L = sim_params.L;
+    int_t  global_M = sim_params.M;
+    int_t  global_N = sim_params.N;
+
+#pragma omp parallel for collapse( 2 ) schedule( static )
+    for ( int_t k = -1; k <= mpi_ctx.L; k++ ) {
+        for ( int_t i = -1; i <= mpi_ctx.M; i++ ) {
+            for ( int_t j = -1; j <= mpi_ctx.N; j++ ) {
+                U_prv ( k, i, j ) = U ( k, i, j ) = U_nxt ( k, i, j ) = 0.0;
+                if ( k < 0 || k == mpi_ctx.L || i < 0 || i == mpi_ctx.M || j < 0
+                     || j == mpi_ctx.N ) {
+                    continue;
+                }
+
+                // Calculate delta (radial distance) adjusted for L x M x N grid
+                real_t z     = k + L_offset - global_L / 2.0;
+                real_t y     = i + M_offset - global_M / 2.0;
+                real_t x     = j + N_offset - global_N / 2.0;
+                real_t delta = sqrt ( z * z / (real_t)global_L + y * y / (real_t)global_M
+                                      + x * x / (real_t)global_N );
+
+                U_prv ( k, i, j ) = U ( k, i, j ) = exp ( -4.0 * delta * delta );
+            }
+        }
+    }
+
+    // Set the time step for 3D case
+    wave_equation_params.dt
+        = 1.0 / ( c * sqrt ( 1.0 / ( dx * dx ) + 1.0 / ( dy * dy ) + 1.0 / ( dz * dz ) ) );
+}
+
+// Get rid of all the memory allocations
+static void
+domain_finalize ( void )
+{
+    free ( time_steps.prev_step );
+    free ( time_steps.curr_step );
+    free ( time_steps.next_step );
+}
+
+// Integration formula, with the 7-point Laplacian
+static void
+time_step ( void )
+{
+    int_t  L  = mpi_ctx.L;
+    int_t  M  = mpi_ctx.M;
+    int_t  N  = mpi_ctx.N;
+    real_t c  = wave_equation_params.c;
+    real_t dx = wave_equation_params.dx;
+    real_t dy = wave_equation_params.dy;
+    real_t dz = wave_equation_params.dz;
+    real_t dt = wave_equation_params.dt;
+
+#pragma omp parallel for collapse( 2 ) schedule( static )
+    for ( int_t k = 0; k < L; k++ ) {
+        for ( int_t i = 0; i < M; i++ ) {
+            for ( int_t j = 0; j < N; j++ ) {
+                U_nxt ( k, i, j )
+                    = -U_prv ( k, i, j ) + 2.0 * U ( k, i, j )
+                    + ( dt * dt * c * c )
+                          * ( ( U ( k, i, j - 1 ) + U ( k, i, j + 1 ) - 2.0 * U ( k, i, j ) )
+                                  / ( dx * dx )
+                              + ( U ( k, i - 1, j ) + U ( k, i + 1, j ) - 2.0 * U ( k, i, j ) )
+                                    / ( dy * dy )
+                              + ( U ( k - 1, i, j ) + U ( k + 1, i, j ) - 2.0 * U ( k, i, j ) )
+                                    / ( dz * dz ) );
+            }
+        }
+    }
+}
+
+// Neumann (reflective) boundary condition on the faces of the whole domain
+static void
+boundary_condition ( void )
+{
+    int_t L = mpi_ctx.L;
+    int_t M = mpi_ctx.M;
+    int_t N = mpi_ctx.N;
+
+#pragma omp parallel
+    {
+        if ( mpi_ctx.z == 0 || mpi_ctx.z == mpi_ctx.cart_dims[0] - 1 ) {
+#pragma omp for collapse( 2 ) nowait
+            for ( int_t i = 0; i < M; i++ ) {
+                for ( int_t j = 0; j < N; j++ ) {
+                    if ( mpi_ctx.z == 0 ) {
+                        U ( -1, i, j ) = U ( 1, i, j );
+                    }
+                    if ( mpi_ctx.z == mpi_ctx.cart_dims[0] - 1 ) {
+                        U ( L, i, j ) = U ( L - 2, i, j );
+                    }
+                }
+            }
+        }
+        if ( mpi_ctx.y == 0 || mpi_ctx.y == mpi_ctx.cart_dims[1] - 1 ) {
+#pragma omp for collapse( 2 ) nowait
+            for ( int_t k = 0; k < L; k++ ) {
+                for ( int_t j = 0; j < N; j++ ) {
+                    if ( mpi_ctx.y == 0 ) {
+                        U ( k, -1, j ) = U ( k, 1, j );
+                    }
+                    if ( mpi_ctx.y == mpi_ctx.cart_dims[1] - 1 ) {
+                        U ( k, M, j ) = U ( k, M - 2, j );
+                    }
+                }
+            }
+        }
+        if ( mpi_ctx.x == 0 || mpi_ctx.x == mpi_ctx.cart_dims[2] - 1 ) {
+#pragma omp for collapse( 2 ) nowait
+            for ( int_t k = 0; k < L; k++ ) {
+                for ( int_t i = 0; i < M; i++ ) {
+                    if ( mpi_ctx.x == 0 ) {
+                        U ( k, i, -1 ) = U ( k, i, 1 );
+                    }
+                    if ( mpi_ctx.x == mpi_ctx.cart_dims[2] - 1 ) {
+                        U ( k, i, N ) = U ( k, i, N - 2 );
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Main time integration.
+static void
+simulate ( void )
+{
+    int_t max_iteration      = sim_params.max_iteration;
+    int_t snapshot_frequency = sim_params.snapshot_frequency;
+
+    for ( int_t iteration = 0; iteration <= max_iteration; iteration++ ) {
+        if ( ( iteration % snapshot_frequency ) == 0 ) {
+            domain_save ( iteration / snapshot_frequency );
+        }
+
+        border_exchange ();
+        if ( mpi_ctx.on_boundary ) {
+            boundary_condition ();
+        }
+        time_step ();
+        move_buffer_window ();
+    }
+}
+
+static void
+mpi_types_free ( void )
+{
+    for ( int axis = 0; axis < 3; axis++ ) {
+        for ( int side = 0; side < 2; side++ ) {
+            MPI_Type_free ( &mpi_ctx.MpiFaceSend[axis][side] );
+            MPI_Type_free ( &mpi_ctx.MpiFaceRecv[axis][side] );
+        }
+    }
+    MPI_Type_free ( &mpi_ctx.MpiGrid );
+}
+
+// A face of the local buffer: the layer at 'layer' along 'axis' (0 and n + 1 are the ghost layers),
+// spanning the interior along the two other axes
+static MPI_Datatype
+face_type ( int axis, int layer )
+{
+    int sizes[3]    = { mpi_ctx.L + 2, mpi_ctx.M + 2, mpi_ctx.N + 2 };
+    int subsizes[3] = { mpi_ctx.L, mpi_ctx.M, mpi_ctx.N };
+    int starts[3]   = { 1, 1, 1 };
+    subsizes[axis]  = 1;
+    starts[axis]    = layer;
+
+    MPI_Datatype face;
+    MPI_Type_create_subarray ( 3, sizes, subsizes, starts, MPI_ORDER_C, MPI_DOUBLE, &face );
+    MPI_Type_commit ( &face );
+    return face;
+}
+
+static void
+mpi_ctx_initialize ( int argc, char **argv )
+{
+    int_t params[5];
+    if ( mpi_ctx.rank == 0 ) {
+        OPTIONS  defaults = { .L = 128, .M = 128, .N = 128, .max_iteration = 1000,
+                              .snapshot_frequency = 20, .order = 2 };
+        OPTIONS *options  = parse_args_defaults ( argc, argv, defaults );
+        if ( !options ) {
+            fprintf ( stderr, "Argument parsing failed\n" );
+            MPI_Abort ( MPI_COMM_WORLD, EXIT_FAILURE );
+        }
+        if ( options->order != 2 || options->restart || options->checkpoint_frequency ) {
+            fprintf ( stderr, "The 3D solver has neither higher orders nor checkpoints\n" );
+            MPI_Abort ( MPI_COMM_WORLD, EXIT_FAILURE );
+        }
+        if ( options->exchange != EXCHANGE_SENDRECV
+             || strcmp ( options->initial, "gaussian" ) != 0 ) {
+            fprintf ( stderr, "The 3D solver has one halo exchange and one initial condition\n" );
+            MPI_Abort ( MPI_COMM_WORLD, EXIT_FAILURE );
+        }
+        params[0] = options->L;
+        params[1] = options->M;
+        params[2] = options->N;
+        params[3] = options->max_iteration;
+        params[4] = options->snapshot_frequency;
+        free ( options );
+    }
+    MPI_Bcast ( params, 5, MPI_INT64_T, 0, MPI_COMM_WORLD );
+    sim_params.L                  = params[0];
+    sim_params.M                  = params[1];
+    sim_params.N                  = params[2];
+    sim_params.max_iteration      = params[3];
+    sim_params.snapshot_frequency = params[4];
+
+    int      cart_dims[3] = { 0 };
+    int      periods[3]   = { 0 };
+    int      reorder      = 0;
+    MPI_Comm cart_comm;
+    MPI_Dims_create ( mpi_ctx.commsize, 3, cart_dims );
+    MPI_Cart_create ( MPI_COMM_WORLD, 3, cart_dims, periods, reorder, &cart_comm );
+
+    int cart_rank;
+    int coords[3];
+    MPI_Comm_rank ( cart_comm, &cart_rank );
+    MPI_Cart_coords ( cart_comm, cart_rank, 3, coords );
+
+    mpi_ctx.rank      = cart_rank;
+    mpi_ctx.cart_comm = cart_comm;
+    mpi_ctx.z         = coords[0];
+    mpi_ctx.y         = coords[1];
+    mpi_ctx.x         = coords[2];
+    for ( int axis = 0; axis < 3; axis++ ) {
+        mpi_ctx.cart_dims[axis] = cart_dims[axis];
+        MPI_Cart_shift ( cart_comm, axis, 1, &mpi_ctx.neighbors[axis][0],
+                         &mpi_ctx.neighbors[axis][1] );
+        if ( coords[axis] == 0 || coords[axis] == cart_dims[axis] - 1 ) {
+            mpi_ctx.on_boundary = true;
+        }
+    }
+    mpi_ctx.L = sim_params.L / cart_dims[0];
+    mpi_ctx.M = sim_params.M / cart_dims[1];
+    mpi_ctx.N = sim_params.N / cart_dims[2];
+
+    if ( sim_params.L % cart_dims[0] || sim_params.M % cart_dims[1]
+         || sim_params.N % cart_dims[2] || mpi_ctx.L < 2 || mpi_ctx.M < 2 || mpi_ctx.N < 2 ) {
+        if ( mpi_ctx.rank == 0 ) {
+            fprintf ( stderr, "A %ldx%ldx%ld grid does not split evenly over %dx%dx%d ranks\n",
+                      sim_params.L, sim_params.M, sim_params.N, cart_dims[0], cart_dims[1],
+                      cart_dims[2] );
+        }
+        MPI_Abort ( MPI_COMM_WORLD, EXIT_FAILURE );
+    }
+
+    int n[3] = { mpi_ctx.L, mpi_ctx.M, mpi_ctx.N };
+    for ( int axis = 0; axis < 3; axis++ ) {
+        mpi_ctx.MpiFaceSend[axis][0] = face_type ( axis, 1 );
+        mpi_ctx.MpiFaceSend[axis][1] = face_type ( axis, n[axis] );
+        mpi_ctx.MpiFaceRecv[axis][0] = face_type ( axis, 0 );
+        mpi_ctx.MpiFaceRecv[axis][1] = face_type ( axis, n[axis] + 1 );
+    }
+
+    int sizes[3]  = { mpi_ctx.L + 2, mpi_ctx.M + 2, mpi_ctx.N + 2 };
+    int starts[3] = { 1, 1, 1 };
+    MPI_Type_create_subarray ( 3, sizes, n, starts, MPI_ORDER_C, MPI_DOUBLE, &mpi_ctx.MpiGrid );
+    MPI_Type_commit ( &mpi_ctx.MpiGrid );
+
+    if ( mpi_ctx.rank == 0 ) {
+        printf ( "%ldx%ldx%ld grid on %dx%dx%d ranks with %d threads each\n", sim_params.L,
+                 sim_params.M, sim_params.N, cart_dims[0], cart_dims[1], cart_dims[2],
+                 omp_get_max_threads () );
+    }
+}
+
+int
+main ( int argc, char **argv )
+{
+    // Only the main thread makes MPI calls, outside the parallel regions
+    int commsize, my_rank, provided;
+    MPI_Init_thread ( &argc, &argv, MPI_THREAD_FUNNELED, &provided );
+    if ( provided < MPI_THREAD_FUNNELED ) {
+        fprintf ( stderr, "The MPI library does not support MPI_THREAD_FUNNELED\n" );
+        MPI_Abort ( MPI_COMM_WORLD, EXIT_FAILURE );
+    }
+    MPI_Comm_size ( MPI_COMM_WORLD, &commsize );
+    MPI_Comm_rank ( MPI_COMM_WORLD, &my_rank );
+
+    mpi_ctx.rank     = my_rank;
+    mpi_ctx.commsize = commsize;
+    mpi_ctx_initialize ( argc, argv );
+
+    // Set up the initial state of the domain
+    domain_initialize ();
+
+    double time_start = 0.0;
+    double time_end   = 0.0;
+
+    MPI_Barrier ( MPI_COMM_WORLD );
+    if ( mpi_ctx.rank == 0 ) {
+        time_start = MPI_Wtime ();
+    }
+
+    simulate ();
+    MPI_Barrier ( MPI_COMM_WORLD );
+
+    if ( mpi_ctx.rank == 0 ) {
+        time_end = MPI_Wtime ();
+        printf ( "Simulation time: %f\n", time_end - time_start );
+    }
+
+    // Clean up and shut down
+    domain_finalize ();
+    mpi_types_free ();
+    MPI_Comm_free ( &mpi_ctx.cart_comm );
+    MPI_Finalize ();
+
+    exit ( EXIT_SUCCESS );
+}
@@ -0,0 +1,188 @@
+#define _XOPEN_SOURCE 600
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <sys/time.h>
+
+#include "argument_utils.h"
+
+// Reference for wave_3d_parallel: a 7-point stencil on an L x M x N grid
+
+// Convert 'struct timeval' into seconds in double prec. floating point
+#define WALLTIME(t) ((double)(t).tv_sec + 1e-6 * (double)(t).tv_usec)
+
+// Option to change numerical precision
+typedef int64_t int_t;
+typedef double  real_t;
+
+// Simulation parameters: size, step count, and how often to save the state
+int_t L = 128, M = 128, N = 128, max_iteration = 1000, snapshot_freq = 20;
+
+// Wave equation parameters, time step is derived from the space step
+const real_t c = 1.0, dx = 1.0, dy = 1.0, dz = 1.0;
+real_t       dt;
+
+// Buffers for three time steps, indexed with 2 ghost points for the boundary
+real_t *buffers[3] = { NULL, NULL, NULL };
+
+#define INDEX(k, i, j) ((((k) + 1) * (M + 2) + (i) + 1) * (N + 2) + (j) + 1)
+#define U_prv(k, i, j) buffers[0][INDEX(k, i, j)]
+#define U(k, i, j)     buffers[1][INDEX(k, i, j)]
+#define U_nxt(k, i, j) buffers[2][INDEX(k, i, j)]
+
+// Rotate the time step buffers.
+void
+move_buffer_window(void)
+{
+    real_t *temp = buffers[0];
+    buffers[0]   = buffers[1];
+    buffers[1]   = buffers[2];
+    buffers[2]   = temp;
+}
+
+// Save the present time step in a numbered file under 'data/'
+void
+domain_save(int_t step)
+{
+    char filename[256];
+    sprintf(filename, "data/%.5ld.dat", step);
+    FILE *out = fopen(filename, "wb");
+    for(int_t k = 0; k < L; k++) {
+        for(int_t i = 0; i < M; i++) {
+            fwrite(&U(k, i, 0), sizeof(real_t), N, out);
+        }
+    }
+    fclose(out);
+}
+
+// Set up our three buffers, and fill two with an initial perturbation
+void
+domain_initialize(void)
+{
+    size_t size = (L + 2) * (M + 2) * (N + 2) * sizeof(real_t);
+    buffers[0]  = calloc(1, size);
+    buffers[1]  = calloc(1, size);
+    buffers[2]  = calloc(1, size);
+
+    for(int_t k = 0; k < L; k++) {
+        for(int_t i = 0; i < M; i++) {
+            for(int_t j = 0; j < N; j++) {
+                // Calculate delta (radial distance) adjusted for L x M x N grid
+                real_t z     = k - L / 2.0;
+                real_t y     = i - M / 2.0;
+                real_t x     = j - N / 2.0;
+                real_t delta = sqrt(z * z / (real_t)L + y * y / (real_t)M + x * x / (real_t)N);
+                U_prv(k, i, j) = U(k, i, j) = exp(-4.0 * delta * delta);
+            }
+        }
+    }
+
+    // Set the time step for 3D case
+    dt = 1.0 / (c * sqrt(1.0 / (dx * dx) + 1.0 / (dy * dy) + 1.0 / (dz * dz)));
+}
+
+// Get rid of all the memory allocations
+void
+domain_finalize(void)
+{
+    free(buffers[0]);
+    free(buffers[1]);
+    free(buffers[2]);
+}
+
+// Integration formula
+void
+time_step(void)
+{
+    for(int_t k = 0; k < L; k++) {
+        for(int_t i = 0; i < M; i++) {
+            for(int_t j = 0; j < N; j++) {
+                U_nxt(k, i, j)
+                    = -U_prv(k, i, j) + 2.0 * U(k, i, j)
+                    + (dt * dt * c * c)
+                          * ((U(k, i, j - 1) + U(k, i, j + 1) - 2.0 * U(k, i, j)) / (dx * dx)
+                             + (U(k, i - 1, j) + U(k, i + 1, j) - 2.0 * U(k, i, j)) / (dy * dy)
+                             + (U(k - 1, i, j) + U(k + 1, i, j) - 2.0 * U(k, i, j)) / (dz * dz));
+            }
+        }
+    }
+}
+
+// Neumann (reflective) boundary condition
+void
+boundary_condition(void)
+{
+    for(int_t i = 0; i < M; i++) {
+        for(int_t j = 0; j < N; j++) {
+            U(-1, i, j) = U(1, i, j);
+            U(L, i, j)  = U(L - 2, i, j);
+        }
+    }
+    for(int_t k = 0; k < L; k++) {
+        for(int_t j = 0; j < N; j++) {
+            U(k, -1, j) = U(k, 1, j);
+            U(k, M, j)  = U(k, M - 2, j);
+        }
+    }
+    for(int_t k = 0; k < L; k++) {
+        for(int_t i = 0; i < M; i++) {
+            U(k, i, -1) = U(k, i, 1);
+            U(k, i, N)  = U(k, i, N - 2);
+        }
+    }
+}
+
+// Main time integration.
+void
+simulate(void)
+{
+    // Go through each time step
+    for(int_t iteration = 0; iteration <= max_iteration; iteration++) {
+        if((iteration % snapshot_freq) == 0) {
+            domain_save(iteration / snapshot_freq);
+        }
+
+        // Derive step t+1 from steps t and t-1
+        boundary_condition();
+        time_step();
+
+        // Rotate the time step buffers
+        move_buffer_window();
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    OPTIONS  defaults = { .L = 128, .M = 128, .N = 128, .max_iteration = 1000,
+                          .snapshot_frequency = 20, .order = 2 };
+    OPTIONS *options  = parse_args_defaults(argc, argv, defaults);
+    if(!options) {
+        fprintf(stderr, "Argument parsing failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    L             = options->L;
+    M             = options->M;
+    N             = options->N;
+    max_iteration = options->max_iteration;
+    snapshot_freq = options->snapshot_frequency;
+    free(options);
+
+    // Set up the initial state of the domain
+    domain_initialize();
+
+    struct timeval t_start, t_end;
+
+    gettimeofday(&t_start, NULL);
+    simulate();
+    gettimeofday(&t_end, NULL);
+
+    printf("Total elapsed time: %lf seconds\n", WALLTIME(t_end) - WALLTIME(t_start));
+
+    // Clean up and shut down
+    domain_finalize();
+    exit(EXIT_SUCCESS);
+}
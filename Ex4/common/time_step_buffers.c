@@ -0,0 +1,141 @@
+#define _GNU_SOURCE
+#include "time_step_buffers.h"
+
+#include <linux/mempolicy.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// The halo sits in the padding in front of each row so that the interior of every row starts on a
+// cache line. The pitch is an odd number of cache lines: with a power-of-two pitch, the rows read
+// by the stencil map to the same cache sets and evict each other.
+GridLayout
+grid_layout(int_t N, int_t halo)
+{
+    int_t line_len   = CACHE_LINE_SIZE / sizeof(real_t);
+    int_t col_offset = (halo + line_len - 1) / line_len * line_len;
+    int_t n_lines    = (col_offset + N + halo + line_len - 1) / line_len;
+    if(n_lines % 2 == 0) {
+        n_lines += 1;
+    }
+
+    GridLayout grid = { .pitch = n_lines * line_len, .halo = halo };
+    grid.origin     = halo * grid.pitch + col_offset;
+    return grid;
+}
+
+// Uses the mbind system call directly so we don't depend on libnuma.
+void
+interleave_pages(void *addr, size_t size)
+{
+    unsigned long nodemask = 0;
+    char          path[64];
+    for(int node = 0; node < (int)(8 * sizeof(nodemask)); ++node) {
+        sprintf(path, "/sys/devices/system/node/node%d", node);
+        if(access(path, F_OK) == 0) {
+            nodemask |= 1UL << node;
+        }
+    }
+    if(nodemask == 0) {
+        return;
+    }
+
+    if(syscall(SYS_mbind, addr, size, MPOL_INTERLEAVE, &nodemask, 8 * sizeof(nodemask) + 1, 0)
+       != 0) {
+        perror("mbind");
+    }
+}
+
+// Nothing is written to the buffer here: unless interleaved, the pages are placed on a NUMA node
+// when the solver first touches them. With huge pages we first try the reserved pool
+// (MAP_HUGETLB), and otherwise ask for transparent huge pages on a 2 MiB aligned mapping.
+real_t *
+time_step_alloc(BufferParams *params, size_t size, bool interleave)
+{
+    size_t page_sz = params->huge_pages ? HUGE_PAGE_SIZE : (size_t)sysconf(_SC_PAGESIZE);
+    size           = (size + page_sz - 1) / page_sz * page_sz;
+
+    params->alloc_sz = size;
+
+    int   prot   = PROT_READ | PROT_WRITE;
+    int   flags  = MAP_PRIVATE | MAP_ANONYMOUS;
+    void *buffer = MAP_FAILED;
+    if(params->huge_pages) {
+        buffer = mmap(NULL, size, prot, flags | MAP_HUGETLB, -1, 0);
+        if(buffer != MAP_FAILED) {
+            params->n_hugetlb++;
+        } else {
+            // Over-allocate by one huge page and trim, so the buffer starts on a huge page boundary
+            char *raw = mmap(NULL, size + HUGE_PAGE_SIZE, prot, flags, -1, 0);
+            if(raw != MAP_FAILED) {
+                char  *aligned = (char *)(((uintptr_t)raw + HUGE_PAGE_SIZE - 1)
+                                         & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+                size_t head    = aligned - raw;
+                if(head > 0) {
+                    munmap(raw, head);
+                }
+                munmap(aligned + size, HUGE_PAGE_SIZE - head);
+                madvise(aligned, size, MADV_HUGEPAGE);
+                buffer = aligned;
+            }
+        }
+    } else {
+        buffer = mmap(NULL, size, prot, flags, -1, 0);
+    }
+
+    if(buffer == MAP_FAILED) {
+        fprintf(stderr, "Failed to allocate %zu bytes for a time step\n", size);
+        exit(EXIT_FAILURE);
+    }
+    if(interleave) {
+        interleave_pages(buffer, size);
+    }
+
+    return buffer;
+}
+
+// Counts both transparent huge pages and those from the reserved pool, according to
+// /proc/self/smaps
+size_t
+huge_page_bytes(void *addr)
+{
+    FILE *smaps = fopen("/proc/self/smaps", "r");
+    if(!smaps) {
+        return 0;
+    }
+
+    char   line[256];
+    bool   in_mapping = false;
+    size_t total_kib  = 0;
+    while(fgets(line, sizeof(line), smaps)) {
+        unsigned long start, end;
+        size_t        kib;
+        if(sscanf(line, "%lx-%lx ", &start, &end) == 2) {
+            in_mapping = ((uintptr_t)addr >= start && (uintptr_t)addr < end);
+        } else if(in_mapping
+                  && (sscanf(line, "AnonHugePages: %zu kB", &kib) == 1
+                      || sscanf(line, "Private_Hugetlb: %zu kB", &kib) == 1)) {
+            total_kib += kib;
+        }
+    }
+    fclose(smaps);
+
+    return total_kib * 1024;
+}
+
+void
+huge_pages_report(const BufferParams *params, real_t *const buffers[3])
+{
+    if(!params->huge_pages) {
+        return;
+    }
+
+    size_t huge_sz = 0;
+    for(int b = 0; b < 3; ++b) {
+        huge_sz += huge_page_bytes(buffers[b]);
+    }
+    printf("Huge pages: %d of 3 buffers from the reserved pool, %.1f of %.1f MiB on huge pages\n",
+           params->n_hugetlb, huge_sz / (1024.0 * 1024.0), 3 * params->alloc_sz / (1024.0 * 1024.0));
+}
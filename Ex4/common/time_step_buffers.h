@@ -0,0 +1,50 @@
+#ifndef TIME_STEP_BUFFERS_H_
+#define TIME_STEP_BUFFERS_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Layout and allocation of the time step buffers, shared by the pthreads and OpenMP solvers
+
+typedef int64_t int_t;
+typedef double  real_t;
+
+#define CACHE_LINE_SIZE 64
+#define HUGE_PAGE_SIZE  (2 * 1024 * 1024)
+
+// Layout of a time step buffer: rows of 'pitch' points with 'halo' ghost points around the domain,
+// and point (0, 0) at offset 'origin' from the start of the buffer
+typedef struct
+{
+    int_t pitch;
+    int_t halo;
+    int_t origin;
+} GridLayout;
+
+// How the time step buffers are backed. huge_pages asks for 2 MiB pages, the rest records what we
+// got: each buffer is one mapping of alloc_sz bytes, n_hugetlb of which came from reserved pages.
+typedef struct
+{
+    bool   huge_pages;
+    size_t alloc_sz;
+    int    n_hugetlb;
+} BufferParams;
+
+// Lay out N x N points with 'halo' ghost points on each side
+GridLayout grid_layout(int_t N, int_t halo);
+
+// Map a time step buffer of at least 'size' bytes, and spread its pages over all NUMA nodes when
+// 'interleave' is set. Exits when the memory cannot be mapped.
+real_t *time_step_alloc(BufferParams *params, size_t size, bool interleave);
+
+// Spread the pages of a buffer round-robin over all NUMA nodes
+void interleave_pages(void *addr, size_t size);
+
+// Number of bytes of the mapping containing 'addr' that are backed by huge pages
+size_t huge_page_bytes(void *addr);
+
+// Report whether the three time step buffers actually ended up on huge pages
+void huge_pages_report(const BufferParams *params, real_t *const buffers[3]);
+
+#endif
@@ -0,0 +1,265 @@
+#define _XOPEN_SOURCE 600
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <unistd.h>
+
+#include <omp.h>
+
+// Option to change numerical precision, cache line size
+#include "time_step_buffers.h"
+
+typedef struct
+{
+    int_t N;
+    int_t max_iteration;
+    int_t snapshot_freq;
+} SimParams;
+static SimParams sim_params = { 1024, 4000, 20 };
+
+// Wave equation parameters, time step is derived from the space step.
+typedef struct
+{
+    const real_t c;
+    const real_t h;
+    real_t       dt;
+} WaveEquationParams; // wave_equation_params;
+static WaveEquationParams weq_params = { 1.0, 1.0 };
+
+// Layout of the time step buffers
+static GridLayout grid = { 0, 0, 0 };
+
+// The domain is split into bands of consecutive rows. Computing one tile for one time step is one
+// task. The last tile also takes the rows left over when tile_rows does not divide N.
+typedef struct
+{
+    int_t tile_rows;
+    int_t n_tiles;
+} TileParams;
+static TileParams tile_params = { 32, 0 };
+
+// libgomp only clears its table of task dependences when the generating task has no unfinished
+// children, and lookups slow down as it grows. Draining the tasks every TASK_WINDOW steps keeps it
+// small while still letting tiles run ahead of each other within the window.
+#define TASK_WINDOW 64
+
+// Buffers for three time steps, indexed with 2 ghost points for the boundary. Step s lives in
+// buffers[s % 3], with step -1 in buffers[2]. deps[b][tile] is only used as the address in the
+// depend clauses of the tasks that read and write that tile of buffers[b].
+static real_t *buffers[3] = { NULL, NULL, NULL };
+static char   *deps[3]    = { NULL, NULL, NULL };
+
+// The macros index the buffers named prv, cur and nxt in the calling function
+#define U_prv(i, j) prv[grid.origin + (i) * grid.pitch + (j)]
+#define U(i, j)     cur[grid.origin + (i) * grid.pitch + (j)]
+#define U_nxt(i, j) nxt[grid.origin + (i) * grid.pitch + (j)]
+
+static int_t
+tile_row_start(int_t tile)
+{
+    return tile * tile_params.tile_rows;
+}
+
+static int_t
+tile_row_end(int_t tile)
+{
+    return (tile == tile_params.n_tiles - 1) ? sim_params.N : (tile + 1) * tile_params.tile_rows;
+}
+
+// Neumann (reflective) boundary condition for the rows of one tile. The first and last tile also
+// fill the ghost rows, which is why every tile needs at least two rows.
+static void
+boundary_condition(int_t tile, real_t *cur)
+{
+    int_t N = sim_params.N;
+
+    for(int_t i = tile_row_start(tile); i < tile_row_end(tile); i++) {
+        U(i, -1) = U(i, 1);
+        U(i, N)  = U(i, N - 2);
+    }
+    if(tile == 0) {
+        for(int_t j = 0; j < N; j++) {
+            U(-1, j) = U(1, j);
+        }
+    }
+    if(tile == tile_params.n_tiles - 1) {
+        for(int_t j = 0; j < N; j++) {
+            U(N, j) = U(N - 2, j);
+        }
+    }
+}
+
+// Set up our three buffers, and fill two with an initial perturbation
+void
+domain_initialize(void)
+{
+    int_t  N = sim_params.N;
+    real_t h = weq_params.h;
+    real_t c = weq_params.c;
+
+    grid = grid_layout(N, 1);
+    size_t time_step_sz = (N + 2 * grid.halo) * grid.pitch * sizeof(real_t);
+
+    for(int b = 0; b < 3; ++b) {
+        if(posix_memalign((void **)&buffers[b], CACHE_LINE_SIZE, time_step_sz) != 0) {
+            fprintf(stderr, "Failed to allocate %zu bytes for a time step\n", time_step_sz);
+            exit(EXIT_FAILURE);
+        }
+        memset(buffers[b], 0, time_step_sz);
+        deps[b] = calloc(tile_params.n_tiles, sizeof(char));
+    }
+
+    real_t *prv = buffers[2];
+    real_t *cur = buffers[0];
+    for(int_t i = 0; i < N; i++) {
+        for(int_t j = 0; j < N; j++) {
+            real_t delta
+                = sqrt(((i - N / 2) * (i - N / 2) + (j - N / 2) * (j - N / 2)) / (real_t)N);
+            real_t val  = exp(-4.0 * delta * delta);
+            U_prv(i, j) = U(i, j) = val;
+        }
+    }
+
+    // Every task applies the boundary condition to the step it produces, so step 0 needs it here
+    for(int_t tile = 0; tile < tile_params.n_tiles; tile++) {
+        boundary_condition(tile, cur);
+    }
+
+    // Set the time step
+    weq_params.dt = (h * h) / (4.0 * c * c);
+}
+
+// Get rid of all the memory allocations
+static void
+domain_finalize(void)
+{
+    for(int b = 0; b < 3; ++b) {
+        free(buffers[b]);
+        free(deps[b]);
+    }
+}
+
+// Derive the rows of one tile at step t+1 from steps t and t-1, and apply the boundary condition
+// to them so the tile is ready to be read by the next step
+void
+time_step(int_t tile, real_t *prv, real_t *cur, real_t *nxt)
+{
+    int_t  N  = sim_params.N;
+    real_t dt = weq_params.dt;
+    real_t h  = weq_params.h;
+    real_t c  = weq_params.c;
+
+    for(int_t i = tile_row_start(tile); i < tile_row_end(tile); i++) {
+        for(int_t j = 0; j < N; j++) {
+            U_nxt(i, j)
+                = -U_prv(i, j) + 2.0 * U(i, j)
+                + (dt * dt * c * c) / (h * h)
+                      * (U(i - 1, j) + U(i + 1, j) + U(i, j - 1) + U(i, j + 1) - 4.0 * U(i, j));
+        }
+    }
+
+    boundary_condition(tile, nxt);
+}
+
+// Save the rows of one tile in a numbered file under 'data/'. Every tile is written at its own
+// offset in the file, so a snapshot only waits for the tiles it writes.
+void
+domain_save(int_t tile, real_t *cur, int_t step)
+{
+    int_t  N      = sim_params.N;
+    size_t row_sz = N * sizeof(real_t);
+
+    char filename[256];
+    sprintf(filename, "data/%.5ld.dat", step);
+    int out = open(filename, O_WRONLY | O_CREAT, 0644);
+    if(out < 0) {
+        perror(filename);
+        return;
+    }
+    // Cut a stale, longer snapshot down to the grid size. Every writer sets the same length, so
+    // the order in which they get here does not matter.
+    if(ftruncate(out, N * row_sz) != 0) {
+        perror(filename);
+    }
+    for(int_t i = tile_row_start(tile); i < tile_row_end(tile); i++) {
+        if(pwrite(out, &U(i, 0), row_sz, i * row_sz) != (ssize_t)row_sz) {
+            perror(filename);
+            break;
+        }
+    }
+    close(out);
+}
+
+// Main time integration. One thread creates the tasks for every step while the rest of the team
+// executes them. The depend clauses let a tile of step t+1 start as soon as its own tile and its
+// two neighbors at step t are done, and keep it from overwriting step t-2 before all readers of
+// that step are finished.
+void
+simulate(void)
+{
+    int_t max_iteration = sim_params.max_iteration;
+    int_t snapshot_freq = sim_params.snapshot_freq;
+    int_t n_tiles       = tile_params.n_tiles;
+
+#pragma omp parallel
+#pragma omp single
+    for(int_t iteration = 0; iteration <= max_iteration; iteration++) {
+        int     b_prv = (iteration + 2) % 3;
+        int     b_cur = iteration % 3;
+        int     b_nxt = (iteration + 1) % 3;
+        real_t *prv   = buffers[b_prv];
+        real_t *cur   = buffers[b_cur];
+        real_t *nxt   = buffers[b_nxt];
+
+        if(iteration > 0 && (iteration % TASK_WINDOW) == 0) {
+#pragma omp taskwait
+        }
+
+        if((iteration % snapshot_freq) == 0) {
+            for(int_t tile = 0; tile < n_tiles; tile++) {
+#pragma omp task depend(in : deps[b_cur][tile]) firstprivate(tile, cur, iteration)
+                domain_save(tile, cur, iteration / snapshot_freq);
+            }
+        }
+
+        for(int_t tile = 0; tile < n_tiles; tile++) {
+            int_t north = (tile > 0) ? tile - 1 : tile;
+            int_t south = (tile < n_tiles - 1) ? tile + 1 : tile;
+#pragma omp task depend(in : deps[b_cur][north], deps[b_cur][tile], deps[b_cur][south],          \
+                            deps[b_prv][tile]) depend(out : deps[b_nxt][tile])                 \
+    firstprivate(tile, prv, cur, nxt)
+            time_step(tile, prv, cur, nxt);
+        }
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    // Rows per tile is an optional argument
+    if(argc > 1) {
+        tile_params.tile_rows = strtol(argv[1], NULL, 10);
+    }
+    if(tile_params.tile_rows < 2 || tile_params.tile_rows > sim_params.N) {
+        fprintf(stderr, "Rows per tile must be between 2 and %ld\n", sim_params.N);
+        exit(EXIT_FAILURE);
+    }
+    tile_params.n_tiles = sim_params.N / tile_params.tile_rows;
+
+    // Set up the initial state of the domain
+    domain_initialize();
+
+    double t_start, t_end;
+    t_start = omp_get_wtime();
+    simulate();
+    t_end = omp_get_wtime();
+    printf("%lf seconds elapsed with %d threads and %ld tiles\n", t_end - t_start,
+           omp_get_max_threads(), tile_params.n_tiles);
+
+    // Clean up and shut down
+    domain_finalize();
+    exit(EXIT_SUCCESS);
+}
@@ -1,9 +1,15 @@
-#define _XOPEN_SOURCE 600
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 
 // TASK: T6
 // Include the OpenMP library
@@ -11,9 +17,8 @@
 #include <omp.h>
 // END: T6
 
-// Option to change numerical precision
-typedef int64_t int_t;
-typedef double  real_t;
+// Option to change numerical precision, cache line and huge page sizes
+#include "time_step_buffers.h"
 
 typedef struct
 {
@@ -41,9 +46,24 @@ typedef struct
 } TimeSteps;
 static TimeSteps time_steps;
 
-#define U_prv(i, j) time_steps.prev_step[((i) + 1) * (sim_params.N + 2) + (j) + 1]
-#define U(i, j)     time_steps.curr_step[((i) + 1) * (sim_params.N + 2) + (j) + 1]
-#define U_nxt(i, j) time_steps.next_step[((i) + 1) * (sim_params.N + 2) + (j) + 1]
+// NUMA placement: pin thread i to the i-th allowed CPU (unless OMP_PLACES/OMP_PROC_BIND already
+// binds the threads), and/or interleave the buffer pages over all nodes instead of placing them
+// where they are first touched
+typedef struct
+{
+    bool pin_threads;
+    bool interleave;
+    bool runtime_binds;
+} NumaParams;
+static NumaParams numa_params = { false, false, false };
+
+// Layout of the time step buffers, and how they are backed
+static GridLayout   grid          = { 0, 0, 0 };
+static BufferParams buffer_params = { false, 0, 0 };
+
+#define U_prv(i, j) time_steps.prev_step[grid.origin + (i) * grid.pitch + (j)]
+#define U(i, j)     time_steps.curr_step[grid.origin + (i) * grid.pitch + (j)]
+#define U_nxt(i, j) time_steps.next_step[grid.origin + (i) * grid.pitch + (j)]
 
 // Rotate the time step buffers.
 static void
@@ -55,7 +75,76 @@ move_buffer_window(void)
     time_steps.next_step = prev_step;
 }
 
-// Set up our three buffers, and fill two with an initial perturbation
+// Pin every thread of the team to its own cpu, unless the runtime already does it through
+// OMP_PLACES/OMP_PROC_BIND. The threads are reused by later parallel regions, so this sticks.
+static void
+threads_pin(void)
+{
+    numa_params.runtime_binds = (omp_get_proc_bind() != omp_proc_bind_false);
+    if(!numa_params.pin_threads || numa_params.runtime_binds) {
+        return;
+    }
+
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        perror("sched_getaffinity");
+        return;
+    }
+    int n_cpus = CPU_COUNT(&allowed);
+    int cpus[CPU_SETSIZE];
+    for(int cpu = 0, n = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if(CPU_ISSET(cpu, &allowed)) {
+            cpus[n++] = cpu;
+        }
+    }
+
+#pragma omp parallel
+    {
+        int       cpu = cpus[omp_get_thread_num() % n_cpus];
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        CPU_SET(cpu, &cpuset);
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+        if(err != 0) {
+            fprintf(stderr, "Could not pin thread %d to cpu %d: %s\n", omp_get_thread_num(), cpu,
+                    strerror(err));
+        }
+    }
+}
+
+// Print which place, cpu and NUMA node each thread is running on
+static void
+topology_report(void)
+{
+    int  n_threads = omp_get_max_threads();
+    int *places    = malloc(3 * n_threads * sizeof(int));
+
+#pragma omp parallel
+    {
+        int      t_id = omp_get_thread_num();
+        unsigned cpu = 0, node = 0;
+        syscall(SYS_getcpu, &cpu, &node, NULL);
+        places[3 * t_id]     = omp_get_place_num();
+        places[3 * t_id + 1] = cpu;
+        places[3 * t_id + 2] = node;
+    }
+
+    printf("Thread placement (%s, %s):\n",
+           numa_params.runtime_binds ? "bound by OMP_PLACES/OMP_PROC_BIND"
+           : numa_params.pin_threads ? "pinned"
+                                     : "not pinned",
+           numa_params.interleave ? "interleaved pages" : "first-touch pages");
+    for(int t = 0; t < n_threads; ++t) {
+        printf("  thread %3d: place %3d cpu %3d node %d\n", t, places[3 * t], places[3 * t + 1],
+               places[3 * t + 2]);
+    }
+    free(places);
+}
+
+// Set up our three buffers, and fill two with an initial perturbation. The rows are initialized
+// with the same static schedule as time_step, so each page is first touched by the thread that
+// computes it.
 void
 domain_initialize(void)
 {
@@ -63,18 +152,29 @@ domain_initialize(void)
     real_t h = weq_params.h;
     real_t c = weq_params.c;
 
-    size_t time_step_sz = (N + 2) * (N + 2) * sizeof(real_t);
+    grid = grid_layout(N, 1);
+    size_t time_step_sz = (N + 2 * grid.halo) * grid.pitch * sizeof(real_t);
 
-    time_steps.prev_step = malloc(time_step_sz);
-    time_steps.curr_step = malloc(time_step_sz);
-    time_steps.next_step = malloc(time_step_sz);
+    time_steps.prev_step = time_step_alloc(&buffer_params, time_step_sz, numa_params.interleave);
+    time_steps.curr_step = time_step_alloc(&buffer_params, time_step_sz, numa_params.interleave);
+    time_steps.next_step = time_step_alloc(&buffer_params, time_step_sz, numa_params.interleave);
 
+#pragma omp parallel for schedule(static)
     for(int_t i = 0; i < N; i++) {
-        for(int_t j = 0; j < N; j++) {
-            real_t delta
-                = sqrt(((i - N / 2) * (i - N / 2) + (j - N / 2) * (j - N / 2)) / (real_t)N);
-            real_t val  = exp(-4.0 * delta * delta);
-            U_prv(i, j) = U(i, j) = val;
+        // The first and last thread also own the ghost rows
+        int_t row_start = (i == 0) ? -grid.halo : i;
+        int_t row_end   = (i == N - 1) ? N + grid.halo : i + 1;
+        for(int_t r = row_start; r < row_end; r++) {
+            for(int_t j = -grid.halo; j < N + grid.halo; j++) {
+                real_t val = 0.0;
+                if(r >= 0 && r < N && j >= 0 && j < N) {
+                    real_t delta = sqrt(((r - N / 2) * (r - N / 2) + (j - N / 2) * (j - N / 2))
+                                        / (real_t)N);
+                    val          = exp(-4.0 * delta * delta);
+                }
+                U_prv(r, j) = U(r, j) = val;
+                U_nxt(r, j)           = 0.0;
+            }
         }
     }
 
@@ -86,9 +186,9 @@ domain_initialize(void)
 static void
 domain_finalize(void)
 {
-    free(time_steps.prev_step);
-    free(time_steps.curr_step);
-    free(time_steps.next_step);
+    munmap(time_steps.prev_step, buffer_params.alloc_sz);
+    munmap(time_steps.curr_step, buffer_params.alloc_sz);
+    munmap(time_steps.next_step, buffer_params.alloc_sz);
 }
 
 // TASK: T7
@@ -102,7 +202,7 @@ time_step(void)
     real_t c  = weq_params.c;
 
     // BEGIN: T7
-#pragma omp parallel for
+#pragma omp parallel for schedule(static)
     for(int_t i = 0; i < N; i++) {
         for(int_t j = 0; j < N; j++) {
             U_nxt(i, j)
@@ -168,10 +268,36 @@ simulate(void)
 }
 
 int
-main(void)
+main(int argc, char **argv)
 {
+    int opt;
+    while((opt = getopt(argc, argv, "piH")) != -1) {
+        switch(opt) {
+            case 'p':
+                numa_params.pin_threads = true;
+                break;
+            case 'H':
+                buffer_params.huge_pages = true;
+                break;
+            case 'i':
+                numa_params.interleave = true;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-p] [-i] [-H]\n", argv[0]);
+                fprintf(stderr, "  -p  pin each thread to its own cpu (ignored if OMP_PLACES or "
+                                "OMP_PROC_BIND binds the threads)\n");
+                fprintf(stderr, "  -i  interleave the buffers over all NUMA nodes\n");
+                fprintf(stderr, "  -H  back the buffers with 2 MiB pages\n");
+                exit(EXIT_FAILURE);
+        }
+    }
+
     // Set up the initial state of the domain
+    threads_pin();
     domain_initialize();
+    topology_report();
+    real_t *buffers[3] = { time_steps.prev_step, time_steps.curr_step, time_steps.next_step };
+    huge_pages_report(&buffer_params, buffers);
 
     double t_start, t_end;
     t_start = omp_get_wtime();
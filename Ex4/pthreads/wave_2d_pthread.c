@@ -1,11 +1,19 @@
-#define _XOPEN_SOURCE 600
+#define _GNU_SOURCE
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
 #include <math.h>
+#include <sched.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
+#include <unistd.h>
 
 // TASK: T1a
 // Include the pthreads library
@@ -13,27 +21,60 @@
 #include <pthread.h>
 // END: T1a
 
-// Option to change numerical precision
-typedef int64_t int_t;
-typedef double  real_t;
+// Option to change numerical precision, cache line and huge page sizes
+#include "time_step_buffers.h"
 
 // TASK: T1b
 // Pthread management
 // BEGIN: T1b
+// Buffers for three time steps, indexed with 2 ghost points for the boundary
+typedef struct
+{
+    real_t *prev_step;
+    real_t *curr_step;
+    real_t *next_step;
+} TimeSteps;
+
+// Each thread publishes the last time step it has finished computing for its rows. Neighbors wait
+// on the counter instead of on a global barrier. It gets its own cache line so that publishing does
+// not invalidate the counters of other threads.
+typedef struct
+{
+    int32_t step;
+    int32_t n_waiters;
+} __attribute__((aligned(CACHE_LINE_SIZE))) StepCounter;
+
+// Number of times a thread polls a neighbor's counter before it goes to sleep on the futex
+#define STEP_SPIN_COUNT 4096
+
 typedef struct
 {
     int_t t_id;
     int_t row_start, row_end;
+
+    // Private copy of the buffer pointers, rotated locally by each thread
+    TimeSteps time_steps;
+
+    // Where the thread ran when it initialized its rows
+    int cpu, node;
 } PthreadSimContext;
 
 typedef struct
 {
     int_t              n_threads;
-    pthread_barrier_t  barrier;
     pthread_t         *pthreads;
     PthreadSimContext *sim_contexts;
+    StepCounter       *step_counters;
+    TimeSteps          time_steps;
+
+    // NUMA placement: pin thread i to the i-th allowed CPU, and/or interleave the buffer pages
+    // over all nodes instead of placing them where they are first touched
+    bool pin_threads;
+    bool interleave;
+    int  n_cpus;
+    int *cpus;
 } PthreadContext;
-static PthreadContext pt_ctx = {};
+static PthreadContext pt_ctx = { .n_threads = 1 };
 
 // END: T1b
 
@@ -58,27 +99,144 @@ typedef struct
 } WaveEquationParams; // wave_equation_params;
 static WaveEquationParams weq_params = { 1.0, 1.0 };
 
-// Buffers for three time steps, indexed with 2 ghost points for the boundary
-typedef struct
-{
-    real_t *prev_step;
-    real_t *curr_step;
-    real_t *next_step;
-} TimeSteps;
-static TimeSteps time_steps;
+// Layout of the time step buffers, and how they are backed
+static GridLayout   grid          = { 0, 0, 0 };
+static BufferParams buffer_params = { false, 0, 0 };
 
-#define U_prv(i, j) time_steps.prev_step[((i) + 1) * (sim_params.N + 2) + (j) + 1]
-#define U(i, j)     time_steps.curr_step[((i) + 1) * (sim_params.N + 2) + (j) + 1]
-#define U_nxt(i, j) time_steps.next_step[((i) + 1) * (sim_params.N + 2) + (j) + 1]
+// The macros index whichever set of buffers 'time_steps' points to in the calling function
+#define U_prv(i, j) time_steps->prev_step[grid.origin + (i) * grid.pitch + (j)]
+#define U(i, j)     time_steps->curr_step[grid.origin + (i) * grid.pitch + (j)]
+#define U_nxt(i, j) time_steps->next_step[grid.origin + (i) * grid.pitch + (j)]
 
 // Rotate the time step buffers.
 static void
-move_buffer_window(void)
+move_buffer_window(TimeSteps *time_steps)
+{
+    real_t *prev_step     = time_steps->prev_step;
+    time_steps->prev_step = time_steps->curr_step;
+    time_steps->curr_step = time_steps->next_step;
+    time_steps->next_step = prev_step;
+}
+
+static long
+futex(int32_t *addr, int op, int32_t val)
+{
+    return syscall(SYS_futex, addr, op, val, NULL, NULL, 0);
+}
+
+// Make the step counter of a thread visible to its neighbors, and wake them if they are asleep
+static void
+step_publish(StepCounter *counter, int32_t step)
 {
-    real_t *prev_step    = time_steps.prev_step;
-    time_steps.prev_step = time_steps.curr_step;
-    time_steps.curr_step = time_steps.next_step;
-    time_steps.next_step = prev_step;
+    __atomic_store_n(&counter->step, step, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&counter->n_waiters, __ATOMIC_SEQ_CST) > 0) {
+        futex(&counter->step, FUTEX_WAKE_PRIVATE, INT_MAX);
+    }
+}
+
+// Block until the thread owning 'counter' has finished computing 'step'
+static void
+step_wait(StepCounter *counter, int32_t step)
+{
+    for(int spin = 0; spin < STEP_SPIN_COUNT; ++spin) {
+        if(__atomic_load_n(&counter->step, __ATOMIC_ACQUIRE) >= step) {
+            return;
+        }
+    }
+
+    __atomic_add_fetch(&counter->n_waiters, 1, __ATOMIC_SEQ_CST);
+    int32_t seen;
+    while((seen = __atomic_load_n(&counter->step, __ATOMIC_SEQ_CST)) < step) {
+        // Returns immediately if the counter changed after we loaded it
+        futex(&counter->step, FUTEX_WAIT_PRIVATE, seen);
+    }
+    __atomic_sub_fetch(&counter->n_waiters, 1, __ATOMIC_SEQ_CST);
+}
+
+// Collect the CPUs this process may run on. Thread i is pinned to the i-th of them, so that
+// neighboring threads, which share rows, also share a socket.
+static void
+cpus_initialize(void)
+{
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        perror("sched_getaffinity");
+        pt_ctx.pin_threads = false;
+        return;
+    }
+
+    pt_ctx.cpus   = malloc(CPU_COUNT(&allowed) * sizeof(int));
+    pt_ctx.n_cpus = 0;
+    for(int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if(CPU_ISSET(cpu, &allowed)) {
+            pt_ctx.cpus[pt_ctx.n_cpus++] = cpu;
+        }
+    }
+}
+
+// Pin the calling thread if requested, and record where it is running
+static void
+pin_thread(PthreadSimContext *sim_context)
+{
+    if(pt_ctx.pin_threads) {
+        int       cpu = pt_ctx.cpus[(sim_context->t_id - 1) % pt_ctx.n_cpus];
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        CPU_SET(cpu, &cpuset);
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+        if(err != 0) {
+            fprintf(stderr, "Could not pin thread %ld to cpu %d: %s\n", sim_context->t_id, cpu,
+                    strerror(err));
+        }
+    }
+
+    unsigned cpu = 0, node = 0;
+    syscall(SYS_getcpu, &cpu, &node, NULL);
+    sim_context->cpu  = cpu;
+    sim_context->node = node;
+}
+
+// Every thread writes the initial state of the rows it will compute, including the ghost points
+// next to them, so the pages are first touched by the thread that uses them.
+static void *
+domain_first_touch(void *arg)
+{
+    PthreadSimContext *sim_context = arg;
+    TimeSteps         *time_steps  = &sim_context->time_steps;
+    int_t              N           = sim_params.N;
+
+    pin_thread(sim_context);
+
+    int_t halo      = grid.halo;
+    int_t row_start = (sim_context->t_id == 1) ? -halo : sim_context->row_start;
+    int_t row_end   = (sim_context->t_id == pt_ctx.n_threads) ? N + halo : sim_context->row_end;
+    for(int_t i = row_start; i < row_end; i++) {
+        for(int_t j = -halo; j < N + halo; j++) {
+            real_t val = 0.0;
+            if(i >= 0 && i < N && j >= 0 && j < N) {
+                real_t delta
+                    = sqrt(((i - N / 2) * (i - N / 2) + (j - N / 2) * (j - N / 2)) / (real_t)N);
+                val = exp(-4.0 * delta * delta);
+            }
+            U_prv(i, j) = U(i, j) = val;
+            U_nxt(i, j)           = 0.0;
+        }
+    }
+
+    return NULL;
+}
+
+// Run one thread per section of rows and wait for all of them to finish
+static void
+run_threads(void *(*thread_func)(void *))
+{
+    for(int_t i = 0; i < pt_ctx.n_threads; ++i) {
+        pthread_create(&pt_ctx.pthreads[i], NULL, thread_func, &pt_ctx.sim_contexts[i]);
+    }
+    for(int_t i = 0; i < pt_ctx.n_threads; ++i) {
+        pthread_join(pt_ctx.pthreads[i], NULL);
+    }
 }
 
 // Set up our three buffers, and fill two with an initial perturbation
@@ -89,38 +247,49 @@ domain_initialize(void)
     real_t h = weq_params.h;
     real_t c = weq_params.c;
 
-    size_t time_step_sz = (N + 2) * (N + 2) * sizeof(real_t);
+    grid = grid_layout(N, 1);
+    size_t time_step_sz = (N + 2 * grid.halo) * grid.pitch * sizeof(real_t);
 
-    time_steps.prev_step = malloc(time_step_sz);
-    time_steps.curr_step = malloc(time_step_sz);
-    time_steps.next_step = malloc(time_step_sz);
+    TimeSteps *time_steps = &pt_ctx.time_steps;
+    time_steps->prev_step = time_step_alloc(&buffer_params, time_step_sz, pt_ctx.interleave);
+    time_steps->curr_step = time_step_alloc(&buffer_params, time_step_sz, pt_ctx.interleave);
+    time_steps->next_step = time_step_alloc(&buffer_params, time_step_sz, pt_ctx.interleave);
 
-    for(int_t i = 0; i < N; i++) {
-        for(int_t j = 0; j < N; j++) {
-            real_t delta
-                = sqrt(((i - N / 2) * (i - N / 2) + (j - N / 2) * (j - N / 2)) / (real_t)N);
-            real_t val  = exp(-4.0 * delta * delta);
-            U_prv(i, j) = U(i, j) = val;
-        }
+    for(int_t i = 0; i < pt_ctx.n_threads; ++i) {
+        pt_ctx.sim_contexts[i].time_steps = *time_steps;
     }
+    run_threads(domain_first_touch);
 
     // Set the time step
     weq_params.dt = (h * h) / (4.0 * c * c);
 }
 
+// Print which cpu and NUMA node each thread initialized its rows on
+static void
+topology_report(void)
+{
+    printf("Thread placement (%s, %s):\n", pt_ctx.pin_threads ? "pinned" : "not pinned",
+           pt_ctx.interleave ? "interleaved pages" : "first-touch pages");
+    for(int_t i = 0; i < pt_ctx.n_threads; ++i) {
+        PthreadSimContext *sim_context = &pt_ctx.sim_contexts[i];
+        printf("  thread %3ld: rows [%5ld, %5ld) cpu %3d node %d\n", sim_context->t_id,
+               sim_context->row_start, sim_context->row_end, sim_context->cpu, sim_context->node);
+    }
+}
+
 // Get rid of all the memory allocations
 static void
 domain_finalize(void)
 {
-    free(time_steps.prev_step);
-    free(time_steps.curr_step);
-    free(time_steps.next_step);
+    munmap(pt_ctx.time_steps.prev_step, buffer_params.alloc_sz);
+    munmap(pt_ctx.time_steps.curr_step, buffer_params.alloc_sz);
+    munmap(pt_ctx.time_steps.next_step, buffer_params.alloc_sz);
 }
 
 // TASK: T3
 // Integration formula
 void
-time_step(int_t row_start, int_t row_end)
+time_step(TimeSteps *time_steps, int_t row_start, int_t row_end)
 {
     int_t  N  = sim_params.N;
     real_t dt = weq_params.dt;
@@ -143,11 +312,12 @@ time_step(int_t row_start, int_t row_end)
 // TASK: T4
 // Neumann (reflective) boundary condition
 void
-boundary_condition(PthreadSimContext sim_context)
+boundary_condition(PthreadSimContext *sim_context)
 {
-    int_t row_start = sim_context.row_start;
-    int_t row_end   = sim_context.row_end;
-    int_t N         = sim_params.N;
+    TimeSteps *time_steps = &sim_context->time_steps;
+    int_t      row_start  = sim_context->row_start;
+    int_t      row_end    = sim_context->row_end;
+    int_t      N          = sim_params.N;
 
     // BEGIN: T4
     // Left/right
@@ -157,30 +327,46 @@ boundary_condition(PthreadSimContext sim_context)
     }
 
     // Top/bottom
-    if(sim_context.t_id == 1) {
+    if(sim_context->t_id == 1) {
         for(int_t j = 0; j < N; j += 1) {
             U(-1, j) = U(1, j);
         }
     }
-    if(sim_context.t_id == pt_ctx.n_threads) {
+    if(sim_context->t_id == pt_ctx.n_threads) {
         for(int_t j = 0; j < N; j += 1) {
             U(N, j) = U(N - 2, j);
         }
     }
     // END: T4
 }
-// Save the present time step in a numbered file under 'data/'
+// Save the present time step in a numbered file under 'data/'. Every thread writes its own rows at
+// their offset in the file, so saving needs no synchronization between the threads.
 void
-domain_save(int_t step)
+domain_save(PthreadSimContext *sim_context, int_t step)
 {
-    int_t N = sim_params.N;
-    char  filename[256];
+    TimeSteps *time_steps = &sim_context->time_steps;
+    int_t      N          = sim_params.N;
+    size_t     row_sz     = N * sizeof(real_t);
+
+    char filename[256];
     sprintf(filename, "data/%.5ld.dat", step);
-    FILE *out = fopen(filename, "wb");
-    for(int_t i = 0; i < N; i++) {
-        fwrite(&U(i, 0), sizeof(real_t), N, out);
+    int out = open(filename, O_WRONLY | O_CREAT, 0644);
+    if(out < 0) {
+        perror(filename);
+        return;
     }
-    fclose(out);
+    // Cut a stale, longer snapshot down to the grid size. Every writer sets the same length, so
+    // the order in which they get here does not matter.
+    if(ftruncate(out, N * row_sz) != 0) {
+        perror(filename);
+    }
+    for(int_t i = sim_context->row_start; i < sim_context->row_end; i++) {
+        if(pwrite(out, &U(i, 0), row_sz, i * row_sz) != (ssize_t)row_sz) {
+            perror(filename);
+            break;
+        }
+    }
+    close(out);
 }
 
 // TASK: T5
@@ -190,29 +376,38 @@ simulate(void *arg)
 {
     PthreadSimContext sim_ctx;
     memcpy(&sim_ctx, arg, sizeof(PthreadSimContext)); // Move sim context onto the stack
+    pin_thread(&sim_ctx);
 
     // BEGIN: T5
+    // A thread only reads the rows bordering its neighbors' sections, so instead of a barrier it
+    // waits for the two neighbors to have finished the step it is about to read. Since a thread can
+    // be at most one step ahead of its neighbors, the third buffer it writes into is never read by
+    // them anymore.
+    int_t        idx   = sim_ctx.t_id - 1;
+    StepCounter *mine  = &pt_ctx.step_counters[idx];
+    StepCounter *north = (idx > 0) ? &pt_ctx.step_counters[idx - 1] : NULL;
+    StepCounter *south = (idx < pt_ctx.n_threads - 1) ? &pt_ctx.step_counters[idx + 1] : NULL;
+
     // Go through each time step
     for(int_t iteration = 0; iteration <= sim_params.max_iteration; iteration++) {
-        pthread_barrier_wait(&pt_ctx.barrier);
-        if(sim_ctx.t_id == 1) {
-            if((iteration % sim_params.snapshot_freq) == 0) {
-                domain_save(iteration / sim_params.snapshot_freq);
-            }
+        if(north) {
+            step_wait(north, iteration);
+        }
+        if(south) {
+            step_wait(south, iteration);
         }
 
-        // Derive step t+1 from steps t and t-1
-        pthread_barrier_wait(&pt_ctx.barrier);
-        boundary_condition(sim_ctx);
+        if((iteration % sim_params.snapshot_freq) == 0) {
+            domain_save(&sim_ctx, iteration / sim_params.snapshot_freq);
+        }
 
-        pthread_barrier_wait(&pt_ctx.barrier);
-        time_step(sim_ctx.row_start, sim_ctx.row_end);
+        // Derive step t+1 from steps t and t-1
+        boundary_condition(&sim_ctx);
+        time_step(&sim_ctx.time_steps, sim_ctx.row_start, sim_ctx.row_end);
+        step_publish(mine, iteration + 1);
 
         // Rotate the time step buffers
-        pthread_barrier_wait(&pt_ctx.barrier);
-        if(sim_ctx.t_id == 1) {
-            move_buffer_window();
-        }
+        move_buffer_window(&sim_ctx.time_steps);
     }
     // END: T5
 
@@ -222,9 +417,11 @@ simulate(void *arg)
 static void
 pt_ctx_initialize(void)
 {
-    pthread_barrier_init(&pt_ctx.barrier, NULL, pt_ctx.n_threads);
     pt_ctx.pthreads     = malloc(pt_ctx.n_threads * sizeof(pthread_t));
     pt_ctx.sim_contexts = malloc(pt_ctx.n_threads * sizeof(PthreadSimContext));
+    pt_ctx.step_counters
+        = aligned_alloc(CACHE_LINE_SIZE, pt_ctx.n_threads * sizeof(StepCounter));
+    memset(pt_ctx.step_counters, 0, pt_ctx.n_threads * sizeof(StepCounter));
 
     int_t rows_per_thread = sim_params.N / pt_ctx.n_threads;
     int_t remaining_rows  = sim_params.N % pt_ctx.n_threads;
@@ -235,38 +432,60 @@ pt_ctx_initialize(void)
         pt_ctx.sim_contexts[i].row_end   = i * rows_per_thread + rows_per_thread;
     }
     pt_ctx.sim_contexts[pt_ctx.n_threads - 1].row_end += remaining_rows;
-}
 
-static void
-pt_ctx_deinitialize(void)
-{
-    pthread_barrier_destroy(&pt_ctx.barrier);
+    if(pt_ctx.pin_threads) {
+        cpus_initialize();
+    }
 }
 
 static void
-run_simulation(void)
+pt_ctx_deinitialize(void)
 {
-    for(int_t i = 0; i < pt_ctx.n_threads; ++i) {
-        pthread_create(&pt_ctx.pthreads[i], NULL, simulate, &pt_ctx.sim_contexts[i]);
-    }
-    for(int_t i = 0; i < pt_ctx.n_threads; ++i) {
-        pthread_join(pt_ctx.pthreads[i], NULL);
-    }
+    free(pt_ctx.pthreads);
+    free(pt_ctx.sim_contexts);
+    free(pt_ctx.step_counters);
+    free(pt_ctx.cpus);
 }
 
 int
 main(int argc, char **argv)
 {
+    int opt;
+    while((opt = getopt(argc, argv, "piH")) != -1) {
+        switch(opt) {
+            case 'p':
+                pt_ctx.pin_threads = true;
+                break;
+            case 'H':
+                buffer_params.huge_pages = true;
+                break;
+            case 'i':
+                pt_ctx.interleave = true;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-p] [-i] [-H] [n_threads]\n", argv[0]);
+                fprintf(stderr, "  -p  pin each thread to its own cpu\n");
+                fprintf(stderr, "  -i  interleave the buffers over all NUMA nodes\n");
+                fprintf(stderr, "  -H  back the buffers with 2 MiB pages\n");
+                exit(EXIT_FAILURE);
+        }
+    }
+
     // Number of threads is an optional argument, sanity check its value
-    if(argc > 1) {
-        pt_ctx.n_threads = strtol(argv[1], NULL, 10);
+    if(argc > optind) {
+        pt_ctx.n_threads = strtol(argv[optind], NULL, 10);
         if(errno == EINVAL) {
-            fprintf(stderr, "'%s' is not a valid thread count\n", argv[1]);
+            fprintf(stderr, "'%s' is not a valid thread count\n", argv[optind]);
         }
         if(pt_ctx.n_threads < 1) {
             fprintf(stderr, "Number of threads must be >0\n");
             exit(EXIT_FAILURE);
         }
+        if(pt_ctx.n_threads > sim_params.N) {
+            fprintf(stderr, "Number of threads cannot exceed the number of rows (%ld)\n",
+                    sim_params.N);
+            exit(EXIT_FAILURE);
+        }
     }
 
     // TASK: T1c
@@ -277,6 +496,10 @@ main(int argc, char **argv)
 
     // Set up the initial state of the domain
     domain_initialize();
+    topology_report();
+    real_t *buffers[3] = { pt_ctx.time_steps.prev_step, pt_ctx.time_steps.curr_step,
+                           pt_ctx.time_steps.next_step };
+    huge_pages_report(&buffer_params, buffers);
 
     // Time the execution
     gettimeofday(&t_start, NULL);
@@ -284,7 +507,7 @@ main(int argc, char **argv)
     // TASK: T2
     // Run the integration loop
     // BEGIN: T2
-    run_simulation();
+    run_threads(simulate);
     // END: T2
 
     // Report how long we spent in the integration stage
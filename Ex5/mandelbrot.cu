@@ -1,138 +1,124 @@
-#include <cuda_runtime.h>
+#include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/time.h>
-#include <vector_types.h>
+#include <unistd.h>
 
-/* Problem size */
-#define XSIZE 2560
-#define YSIZE 2048
+#include "kernel_backend.h"
+#include "mandelbrot_simd.h"
 
 /* Divide the problem into blocks of BLOCKX x BLOCKY threads */
 #define BLOCKY 32
 #define BLOCKX 32
-#define MAXITER                                                                                    \
-    255 // you may want to increase this
-        //
-double xleft  = -2.01;
-double xright = 1;
-double yupper, ylower;
-double ycenter = 1e-6;
-double step;
-
-int host_pixel[XSIZE * YSIZE];
-int device_pixel[XSIZE * YSIZE];
+
+// Everything that describes one render. The image is xsize x ysize pixels, covering xleft..xright
+// on the real axis, centered on ycenter on the imaginary axis. It is computed, checked and written
+// band_rows rows at a time, so neither the host nor the device has to hold all of it.
+typedef struct
+{
+    int         xsize, ysize;
+    int         maxiter; // you may want to increase this
+    double      xleft, xright, ycenter;
+    int         band_rows;
+    const char *output;
+    // Derived by render_initialize
+    double step, yupper, ylower;
+} RenderParams;
+
+// The view this program has always drawn
+static const RenderParams render_defaults
+    = { 2560, 2048, 255, -2.01, 1, 1e-6, 256, "mandel1.bmp", 0, 0, 0 };
+
+// The largest image a BMP header can describe with a positive height
+#define MAX_SIZE 65535
 
 typedef struct
 {
     float real, imag;
 } complex_t;
 
-#define PIXEL(i, j) ((i) + (j) * XSIZE)
-
 typedef unsigned char uchar;
-// save 24-bits bmp file, buffer must be in bmp format: upside-down
-void
-savebmp(const char *name, uchar *buffer, int x, int y)
+
+// BMP rows are padded to a multiple of 4 bytes
+static size_t
+bmp_row_bytes(int x)
+{
+    return ((size_t)x * 3 + 3) / 4 * 4;
+}
+
+static void
+put_le32(uchar *p, uint32_t v)
+{
+    p[0] = v & 255;
+    p[1] = (v >> 8) & 255;
+    p[2] = (v >> 16) & 255;
+    p[3] = v >> 24;
+}
+
+// Create a 24-bits bmp file and write its header. The rows are written with bmp_write_band. A file
+// size that does not fit the 32-bit header field is stored as 0, and readers go by the dimensions.
+int
+bmp_open(const char *name, int x, int y)
 {
-    FILE *f = fopen(name, "wb");
-    if(!f) {
+    int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) {
         printf("Error writing image to disk.\n");
-        return;
+        return -1;
+    }
+    uint64_t size       = (uint64_t)bmp_row_bytes(x) * y + 54;
+    uchar    header[54] = { 'B', 'M' };
+    put_le32(header + 2, size <= UINT32_MAX ? (uint32_t)size : 0);
+    put_le32(header + 10, 54);
+    put_le32(header + 14, 40);
+    put_le32(header + 18, x);
+    put_le32(header + 22, y);
+    header[26] = 1;
+    header[28] = 24;
+    if(pwrite(fd, header, 54, 0) != 54) {
+        printf("Error writing image to disk.\n");
+        close(fd);
+        return -1;
     }
-    unsigned int size       = x * y * 3 + 54;
-    uchar        header[54] = { 'B',
-                                'M',
-                                (uchar)(size & 255),
-                                (uchar)((size >> 8) & 255),
-                                (uchar)((size >> 16) & 255),
-                                (uchar)(size >> 24),
-                                0,
-                                0,
-                                0,
-                                0,
-                                54,
-                                0,
-                                0,
-                                0,
-                                40,
-                                0,
-                                0,
-                                0,
-                                (uchar)(x & 255),
-                                (uchar)(x >> 8),
-                                0,
-                                0,
-                                (uchar)(y & 255),
-                                (uchar)(y >> 8),
-                                0,
-                                0,
-                                1,
-                                0,
-                                24,
-                                0,
-                                0,
-                                0,
-                                0,
-                                0,
-                                0,
-                                0,
-                                0,
-                                0,
-                                0,
-                                0,
-                                0,
-                                0,
-                                0,
-                                0,
-                                0,
-                                0,
-                                0,
-                                0,
-                                0,
-                                0,
-                                0,
-                                0,
-                                0,
-                                0 };
-    fwrite(header, 1, 54, f);
-    fwrite(buffer, 1, x * y * 3, f);
-    fclose(f);
+    return fd;
 }
 
-void
-host_calculate()
+// The bmp format is upside-down, so the rows [j_start, j_start + n_rows) are one contiguous range
+// of the file. buffer holds them bottom row first.
+int
+bmp_write_band(int fd, const uchar *buffer, int x, int y, int j_start, int n_rows)
 {
-    for(int j = 0; j < YSIZE; j++) {
-        for(int i = 0; i < XSIZE; i++) {
-            /* Calculate the number of iterations until divergence for
-            each pixel.
-            If divergence never happens, return MAXITER */
-            complex_t c, z, temp;
-            int       iter = 0;
-            c.real         = (xleft + step * i);
-            c.imag         = (yupper - step * j);
-            z              = c;
-            while(z.real * z.real + z.imag * z.imag < 4.0) {
-                temp.real = z.real * z.real - z.imag * z.imag + c.real;
-                temp.imag = 2.0 * z.real * z.imag + c.imag;
-                z         = temp;
-                if(++iter == MAXITER) {
-                    break;
-                }
-            }
-            host_pixel[PIXEL(i, j)] = iter;
+    size_t row_bytes = bmp_row_bytes(x), bytes = row_bytes * n_rows;
+    off_t  offset    = 54 + (off_t)row_bytes * (y - j_start - n_rows);
+    for(size_t done = 0; done < bytes;) {
+        ssize_t n = pwrite(fd, buffer + done, bytes - done, offset + done);
+        if(n <= 0) {
+            printf("Error writing image to disk.\n");
+            return -1;
         }
+        done += n;
     }
+    return 0;
+}
+
+// The host reference runs the vectorized CPU kernels in mandelbrot_simd.c, which produce the same
+// counts as iterating one pixel at a time
+void
+host_calculate(const RenderParams *r, int j_start, int n_rows, int *pixels)
+{
+    simd_calculate(pixels, r->xsize, j_start, n_rows, r->maxiter, r->xleft, r->yupper, r->step);
 }
 
-// given iteration number, set a color
+// given iteration number, set a color. Counts past the palette wrap around.
 void
-fancycolour(uchar *p, int iter)
+fancycolour(uchar *p, int iter, int maxiter)
 {
-    if(iter == MAXITER)
-        ;
-    else if(iter < 8) {
+    if(iter == maxiter) {
+        return;
+    }
+    iter %= 255;
+    if(iter < 8) {
         p[0] = 128 + iter * 16;
         p[1] = p[2] = 0;
     } else if(iter < 24) {
@@ -158,49 +144,138 @@ walltime(void)
     return (t.tv_sec + 1e-6 * t.tv_usec);
 }
 
-// ********** SUBTASK1: Create kernel device_calculate ******************/
-// Insert code here
-// Hint: Use _global_ for the kernal function to be executed on the GPU.
-// Also set up a single grid with a 2D thread block
-// ********** SUBTASK1 END ***********************************************/
-
+// The view and the band of rows [row_start, row_start + n_rows) computed by one launch
 struct mb_args
 {
     double xleft;
     double step;
     double yupper;
+    int    xsize;
+    int    maxiter;
+    int    row_start;
+    int    n_rows;
 };
 
-__global__ void
-mandelbrot_gpu(int *pixels, struct mb_args *args)
+// One pixel per thread, launched with launch_2d on either backend
+__device__ void
+mandelbrot_gpu(int t_i, int t_j, int *pixels, const struct mb_args *args)
 {
-    int t_i = blockIdx.x * blockDim.x + threadIdx.x;
-    int t_j = blockIdx.y * blockDim.y + threadIdx.y;
+    if(t_i >= args->xsize || t_j >= args->n_rows) {
+        return;
+    }
 
     complex_t c, z, temp;
     int       iter = 0;
     c.real         = (args->xleft + args->step * t_i);
-    c.imag         = (args->yupper - args->step * t_j);
+    c.imag         = (args->yupper - args->step * (args->row_start + t_j));
     z              = c;
 
     while(z.real * z.real + z.imag * z.imag < 4.0) {
         temp.real = z.real * z.real - z.imag * z.imag + c.real;
         temp.imag = 2.0 * z.real * z.imag + c.imag;
         z         = temp;
-        if(++iter == MAXITER) {
+        if(++iter == args->maxiter) {
             break;
         }
     }
 
-    pixels[PIXEL(t_i, t_j)] = iter;
+    pixels[t_i + (size_t)t_j * args->xsize] = iter;
+}
+
+// Derive the pixel spacing and the imaginary range, such that we preserve the aspect ratio.
+// Returns nonzero if the view can not be drawn.
+int
+render_initialize(RenderParams *r)
+{
+    if(r->xsize < 1 || r->ysize < 1 || r->xsize > MAX_SIZE || r->ysize > MAX_SIZE) {
+        fprintf(stderr, "Image size must be between 1x1 and %dx%d\n", MAX_SIZE, MAX_SIZE);
+        return 1;
+    }
+    if(r->maxiter < 1 || !(r->xright > r->xleft)) {
+        fprintf(stderr, "Need maxiter > 0 and xleft < xright\n");
+        return 1;
+    }
+    if(r->band_rows < 1 || r->band_rows > r->ysize) {
+        r->band_rows = r->ysize;
+    }
+    r->step   = (r->xright - r->xleft) / r->xsize;
+    r->yupper = r->ycenter + (r->step * r->ysize) / 2;
+    r->ylower = r->ycenter - (r->step * r->ysize) / 2;
+    return 0;
+}
+
+void
+usage(void)
+{
+    puts("Usage: MANDEL [options] n");
+    puts("n decides whether image should be written to disk (1=yes, 0 = no) ");
+    puts("Options:");
+    puts("  -s WIDTHxHEIGHT   image size in pixels (2560x2048, at most 65535x65535)");
+    puts("  -m MAXITER        iteration budget (255)");
+    puts("  -x XLEFT:XRIGHT   range of the real axis (-2.01:1)");
+    puts("  -y YCENTER        imaginary part of the image center (1e-6)");
+    puts("  -c X:Y -w WIDTH   view by center and width instead");
+    puts("  -b ROWS           rows computed and written at a time (256)");
+    puts("  -o FILE           image file (mandel1.bmp)");
+}
+
+// Fill in a render from the command line, starting from the defaults. Returns nonzero on a usage
+// error.
+int
+render_parse(RenderParams *r, int argc, char **argv)
+{
+    *r              = render_defaults;
+    double center_x = 0, center_y = 0, width = 0;
+    int    centered = 0, opt;
+    while((opt = getopt(argc, argv, "s:m:x:y:c:w:b:o:")) != -1) {
+        switch(opt) {
+            case 's':
+                if(sscanf(optarg, "%dx%d", &r->xsize, &r->ysize) != 2) {
+                    return 1;
+                }
+                break;
+            case 'm': r->maxiter = strtol(optarg, NULL, 10); break;
+            case 'x':
+                if(sscanf(optarg, "%lf:%lf", &r->xleft, &r->xright) != 2) {
+                    return 1;
+                }
+                break;
+            case 'y': r->ycenter = strtod(optarg, NULL); break;
+            case 'c':
+                if(sscanf(optarg, "%lf:%lf", &center_x, &center_y) != 2) {
+                    return 1;
+                }
+                centered = 1;
+                break;
+            case 'w': width = strtod(optarg, NULL); break;
+            case 'b': r->band_rows = strtol(optarg, NULL, 10); break;
+            case 'o': r->output = optarg; break;
+            default: return 1;
+        }
+    }
+    if(centered) {
+        if(!(width > 0)) {
+            return 1;
+        }
+        r->xleft   = center_x - width / 2;
+        r->xright  = center_x + width / 2;
+        r->ycenter = center_y;
+    }
+    if(optind >= argc) {
+        return 1;
+    }
+    if(strtol(argv[optind], NULL, 10) == 0) {
+        r->output = NULL;
+    }
+    return 0;
 }
 
 int
 main(int argc, char **argv)
 {
-    if(argc == 1) {
-        puts("Usage: MANDEL n");
-        puts("n decides whether image should be written to disk (1=yes, 0 = no) ");
+    RenderParams r;
+    if(render_parse(&r, argc, argv) || render_initialize(&r)) {
+        usage();
         return 0;
     }
 
@@ -213,81 +288,100 @@ main(int argc, char **argv)
     cudaSetDevice(0);
 
     cudaGetDeviceProperties(&p, 0);
-    printf("Using GPU: %s\n", p.name);
+    printf("Using GPU: %s (%s backend)\n", p.name, KERNEL_BACKEND);
     printf("Device compute capability: %d.%d\n", p.major, p.minor);
+    printf("Rendering %dx%d, maxiter %d\n", r.xsize, r.ysize, r.maxiter);
+    printf("Host kernel: %s\n", simd_select_kernel());
+    printf("Host shortcuts: %s\n", simd_select_shortcuts());
 
-    /* Calculate the range in the y-axis such that we preserve the
-    aspect ratio */
-    step   = (xright - xleft) / XSIZE;
-    yupper = ycenter + (step * YSIZE) / 2;
-    ylower = ycenter - (step * YSIZE) / 2;
-
-    /* Host calculates image */
-    start = walltime();
-    host_calculate();
-    hosttime += walltime() - start;
-
-    //********** SUBTASK2: Set up device memory ***************************/
-    // Insert code here
-    /********** SUBTASK2 END **********************************************/
-    start = walltime();
-
-    dim3 block(BLOCKX, BLOCKY);
-    dim3 grid(XSIZE / BLOCKX, YSIZE / BLOCKY);
+    // One band of the image at a time on the host and the device
+    size_t band_pixels = (size_t)r.band_rows * r.xsize;
+    int   *host_pixel   = (int *)malloc(band_pixels * sizeof(int));
+    int   *device_pixel = (int *)malloc(band_pixels * sizeof(int));
 
     int            *gpu_pixels;
     struct mb_args *gpu_args;
-
-    cudaMalloc((void **)&gpu_pixels, XSIZE * YSIZE * sizeof(*gpu_pixels));
+    cudaMalloc((void **)&gpu_pixels, band_pixels * sizeof(*gpu_pixels));
     cudaMalloc((void **)&gpu_args, sizeof(struct mb_args));
 
-    struct mb_args args = { xleft, step, yupper };
-    cudaMemcpy(gpu_args, &args, sizeof(struct mb_args), cudaMemcpyHostToDevice);
-
-    //********* SUBTASK3: Execute the kernel on the device ************/
-    // Insert code here
-    //********** SUBTASK3 END *****************************************/
-    devicetime += walltime() - start;
-    start = walltime();
-
-    mandelbrot_gpu<<<grid, block>>>(gpu_pixels, gpu_args);
-
-    //***** SUBTASK4: Transfer the result from device to device_pixel[][]*/
-    // Insert code here
-    //********** SUBTASK4 END ******************************************/
-    memtime += walltime() - start;
-    cudaMemcpy(device_pixel, gpu_pixels, XSIZE * YSIZE * sizeof(*gpu_pixels),
-               cudaMemcpyDeviceToHost);
-
-    /****** SUBTASK5: Free the device memory also ************************/
-    // Insert code here
-    /********** SUBTASK5 END ******************************************/
-    cudaFree(gpu_pixels);
-    cudaFree(gpu_args);
+    int    fd        = -1;
+    uchar *buffer    = NULL;
+    size_t row_bytes = bmp_row_bytes(r.xsize);
+    if(r.output != NULL) {
+        fd     = bmp_open(r.output, r.xsize, r.ysize);
+        buffer = (uchar *)malloc(row_bytes * r.band_rows);
+    }
 
-    int errors = 0;
-    /* check if result is correct */
-    for(int i = 0; i < XSIZE; i++) {
-        for(int j = 0; j < YSIZE; j++) {
-            int diff = host_pixel[PIXEL(i, j)] - device_pixel[PIXEL(i, j)];
-            if(diff < 0) {
-                diff = -diff;
+    long errors = 0;
+    for(int j_start = 0; j_start < r.ysize; j_start += r.band_rows) {
+        int n_rows = (j_start + r.band_rows <= r.ysize) ? r.band_rows : r.ysize - j_start;
+
+        /* Host calculates the band */
+        start = walltime();
+        host_calculate(&r, j_start, n_rows, host_pixel);
+        hosttime += walltime() - start;
+
+        start = walltime();
+        struct mb_args args = { r.xleft, r.step, r.yupper, r.xsize, r.maxiter, j_start, n_rows };
+        cudaMemcpy(gpu_args, &args, sizeof(struct mb_args), cudaMemcpyHostToDevice);
+
+        dim3 block(BLOCKX, BLOCKY);
+        dim3 grid((r.xsize + BLOCKX - 1) / BLOCKX, (n_rows + BLOCKY - 1) / BLOCKY);
+        launch_2d(grid, block,
+                  DEVICE_LAMBDA(int t_i, int t_j) { mandelbrot_gpu(t_i, t_j, gpu_pixels, gpu_args); });
+        cudaDeviceSynchronize();
+        devicetime += walltime() - start;
+
+        start = walltime();
+        cudaMemcpy(device_pixel, gpu_pixels, (size_t)n_rows * r.xsize * sizeof(*gpu_pixels),
+                   cudaMemcpyDeviceToHost);
+        memtime += walltime() - start;
+
+        /* check if result is correct */
+        for(int j = 0; j < n_rows; j++) {
+            for(int i = 0; i < r.xsize; i++) {
+                size_t pixel = i + (size_t)j * r.xsize;
+                int    diff  = host_pixel[pixel] - device_pixel[pixel];
+                if(diff < 0) {
+                    diff = -diff;
+                }
+                /* allow +-1 difference */
+                if(diff > 1) {
+                    if(errors < 10) {
+                        printf("Error on pixel %d %d: expected %d, found %d\n ", i, j_start + j,
+                               host_pixel[pixel], device_pixel[pixel]);
+                    } else if(errors == 10) {
+                        puts("...");
+                    }
+                    errors++;
+                }
             }
-            /* allow +-1 difference */
-            if(diff > 1) {
-                if(errors < 10) {
-                    printf("Error on pixel %d %d: expected %d, found %d\n ", i, j,
-                           host_pixel[PIXEL(i, j)], device_pixel[PIXEL(i, j)]);
-                } else if(errors == 10) {
-                    puts("...");
+        }
+
+        if(fd >= 0) {
+            /* create nice image from iteration counts. take care to create it
+            upside
+            down (bmp format) */
+            memset(buffer, 0, row_bytes * n_rows);
+            for(int j = 0; j < n_rows; j++) {
+                uchar *line = buffer + row_bytes * (n_rows - j - 1);
+                for(int i = 0; i < r.xsize; i++) {
+                    fancycolour(line + 3 * i, device_pixel[i + (size_t)j * r.xsize], r.maxiter);
                 }
-                errors++;
+            }
+            /* write band to disk */
+            if(bmp_write_band(fd, buffer, r.xsize, r.ysize, j_start, n_rows) != 0) {
+                close(fd);
+                fd = -1;
             }
         }
     }
 
+    cudaFree(gpu_pixels);
+    cudaFree(gpu_args);
+
     if(errors > 0) {
-        printf("Found %d errors.\n", errors);
+        printf("Found %ld errors.\n", errors);
     } else {
         puts("Device calculations are correct.");
     }
@@ -297,19 +391,11 @@ main(int argc, char **argv)
     printf("Device calculation: %7.3f ms\n", devicetime * 1e3);
     printf("Copy result: %7.3f ms\n", memtime * 1e3);
 
-    if(strtol(argv[1], NULL, 10) != 0) {
-        /* create nice image from iteration counts. take care to create it
-        upside
-        down (bmp format) */
-        unsigned char *buffer = (unsigned char *)calloc(XSIZE * YSIZE * 3, 1);
-        for(int i = 0; i < XSIZE; i++) {
-            for(int j = 0; j < YSIZE; j++) {
-                int p = ((YSIZE - j - 1) * XSIZE + i) * 3;
-                fancycolour(buffer + p, device_pixel[PIXEL(i, j)]);
-            }
-        }
-        /* write image to disk */
-        savebmp("mandel1.bmp", buffer, XSIZE, YSIZE);
+    if(fd >= 0) {
+        close(fd);
     }
+    free(buffer);
+    free(host_pixel);
+    free(device_pixel);
     return 0;
 }
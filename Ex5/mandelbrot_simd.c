@@ -0,0 +1,287 @@
+#include <immintrin.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mandelbrot_simd.h"
+
+// Shortcuts for pixels that never diverge, which otherwise run all maxiter iterations. Both keep
+// the counts the same as the plain loop.
+// - Points in the main cardioid and the period-2 bulb are found with a closed form test. The
+//   regions are shrunk by BULB_MARGIN, so points near their boundary, where rounding could change
+//   the outcome, are still iterated.
+// - An orbit that comes back to exactly the same z repeats forever. The orbit is compared with a
+//   saved point, which moves forward at iterations 1, 2, 4, 8, ... (Brent), so cycles of any length
+//   are found. In single precision most interior orbits settle on a cycle quickly.
+#define BULB_MARGIN 1e-3f
+static int use_bulbs = 1, use_period = 1;
+
+static int
+in_bulbs(float x, float y)
+{
+    float xq = x - 0.25f, q = xq * xq + y * y;
+    if(x < sqrtf(q) - 2 * q + 0.25f - BULB_MARGIN) {
+        return 1;
+    }
+    return (x + 1) * (x + 1) + y * y < 0.0625f - BULB_MARGIN;
+}
+
+// The row kernels iterate consecutive pixels of a row in the lanes of a vector. A lane is active
+// until its pixel diverges or is known not to, and all active lanes have done the same number of
+// iterations, so the count of a lane is frozen when it drops out. The arithmetic follows
+// host_calculate exactly, including the imaginary part being computed in double precision (2.0 is
+// a double literal) and rounded back to float, so the counts are the same as the scalar loop. This
+// relies on the compiler not contracting multiplies and adds into FMAs, which -std=c99 guarantees.
+
+typedef void (*row_kernel_t)(int *row, int xsize, int maxiter, double xleft, double ci,
+                             double step);
+
+static int
+iterate_pixel(float c_real, float c_imag, int maxiter)
+{
+    if(use_bulbs && in_bulbs(c_real, c_imag)) {
+        return maxiter;
+    }
+    float z_real = c_real, z_imag = c_imag;
+    float saved_real = z_real, saved_imag = z_imag;
+    int   iter = 0, next_save = 1;
+    while(z_real * z_real + z_imag * z_imag < 4.0) {
+        float temp_real = z_real * z_real - z_imag * z_imag + c_real;
+        float temp_imag = 2.0 * z_real * z_imag + c_imag;
+        z_real          = temp_real;
+        z_imag          = temp_imag;
+        if(++iter == maxiter) {
+            break;
+        }
+        if(use_period) {
+            if(z_real == saved_real && z_imag == saved_imag) {
+                return maxiter;
+            }
+            if(iter == next_save) {
+                saved_real = z_real;
+                saved_imag = z_imag;
+                next_save *= 2;
+            }
+        }
+    }
+    return iter;
+}
+
+static void
+row_scalar(int *row, int xsize, int maxiter, double xleft, double ci, double step)
+{
+    for(int i = 0; i < xsize; i++) {
+        row[i] = iterate_pixel(xleft + step * i, ci, maxiter);
+    }
+}
+
+__attribute__((target("avx2"))) static void
+row_avx2(int *row, int xsize, int maxiter, double xleft, double ci, double step)
+{
+    const __m256  four     = _mm256_set1_ps(4.0f);
+    const __m256i one      = _mm256_set1_epi32(1);
+    const __m256d lane_lo  = _mm256_set_pd(3, 2, 1, 0);
+    const __m256d lane_hi  = _mm256_set_pd(7, 6, 5, 4);
+    const __m256d x0       = _mm256_set1_pd(xleft);
+    const __m256d dx       = _mm256_set1_pd(step);
+    const __m256  c_imag   = _mm256_set1_ps((float)ci);
+    const __m256d c_imag_d = _mm256_cvtps_pd(_mm256_castps256_ps128(c_imag));
+
+    int i = 0;
+    for(; i + 8 <= xsize; i += 8) {
+        __m256d base   = _mm256_set1_pd(i);
+        __m256d x_lo   = _mm256_add_pd(x0, _mm256_mul_pd(dx, _mm256_add_pd(base, lane_lo)));
+        __m256d x_hi   = _mm256_add_pd(x0, _mm256_mul_pd(dx, _mm256_add_pd(base, lane_hi)));
+        __m256  c_real = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm256_cvtpd_ps(x_lo)),
+                                              _mm256_cvtpd_ps(x_hi), 1);
+
+        __m256  z_real = c_real, z_imag = c_imag;
+        __m256  saved_real = z_real, saved_imag = z_imag;
+        __m256i iter = _mm256_setzero_si256();
+
+        // Lanes that are known never to diverge
+        __m256 interior = _mm256_setzero_ps();
+        if(use_bulbs) {
+            __m256 xq   = _mm256_sub_ps(c_real, _mm256_set1_ps(0.25f));
+            __m256 q    = _mm256_add_ps(_mm256_mul_ps(xq, xq), _mm256_mul_ps(c_imag, c_imag));
+            __m256 edge = _mm256_sub_ps(_mm256_sub_ps(_mm256_sqrt_ps(q), _mm256_add_ps(q, q)),
+                                        _mm256_set1_ps(BULB_MARGIN - 0.25f));
+            __m256 xb   = _mm256_add_ps(c_real, _mm256_set1_ps(1.0f));
+            __m256 rb   = _mm256_add_ps(_mm256_mul_ps(xb, xb), _mm256_mul_ps(c_imag, c_imag));
+            interior    = _mm256_or_ps(
+                _mm256_cmp_ps(c_real, edge, _CMP_LT_OQ),
+                _mm256_cmp_ps(rb, _mm256_set1_ps(0.0625f - BULB_MARGIN), _CMP_LT_OQ));
+        }
+
+        for(int k = 0, next_save = 1; k < maxiter; k++) {
+            __m256 zr2    = _mm256_mul_ps(z_real, z_real);
+            __m256 zi2    = _mm256_mul_ps(z_imag, z_imag);
+            __m256 active = _mm256_andnot_ps(
+                interior, _mm256_cmp_ps(_mm256_add_ps(zr2, zi2), four, _CMP_LT_OQ));
+            if(_mm256_movemask_ps(active) == 0) {
+                break;
+            }
+            __m256 temp_real = _mm256_add_ps(_mm256_sub_ps(zr2, zi2), c_real);
+
+            // 2.0 * z.real * z.imag + c.imag in double, four lanes at a time
+            __m256d zr_lo = _mm256_cvtps_pd(_mm256_castps256_ps128(z_real));
+            __m256d zr_hi = _mm256_cvtps_pd(_mm256_extractf128_ps(z_real, 1));
+            __m256d zi_lo = _mm256_cvtps_pd(_mm256_castps256_ps128(z_imag));
+            __m256d zi_hi = _mm256_cvtps_pd(_mm256_extractf128_ps(z_imag, 1));
+            __m128  ti_lo = _mm256_cvtpd_ps(
+                _mm256_add_pd(_mm256_mul_pd(_mm256_add_pd(zr_lo, zr_lo), zi_lo), c_imag_d));
+            __m128 ti_hi = _mm256_cvtpd_ps(
+                _mm256_add_pd(_mm256_mul_pd(_mm256_add_pd(zr_hi, zr_hi), zi_hi), c_imag_d));
+            __m256 temp_imag = _mm256_insertf128_ps(_mm256_castps128_ps256(ti_lo), ti_hi, 1);
+
+            z_real = _mm256_blendv_ps(z_real, temp_real, active);
+            z_imag = _mm256_blendv_ps(z_imag, temp_imag, active);
+            iter   = _mm256_add_epi32(iter, _mm256_and_si256(_mm256_castps_si256(active), one));
+
+            if(use_period) {
+                __m256 same = _mm256_and_ps(_mm256_cmp_ps(z_real, saved_real, _CMP_EQ_OQ),
+                                            _mm256_cmp_ps(z_imag, saved_imag, _CMP_EQ_OQ));
+                interior    = _mm256_or_ps(interior, _mm256_and_ps(active, same));
+                if(k + 1 == next_save) {
+                    saved_real = z_real;
+                    saved_imag = z_imag;
+                    next_save *= 2;
+                }
+            }
+        }
+        iter = _mm256_castps_si256(_mm256_blendv_ps(
+            _mm256_castsi256_ps(iter), _mm256_castsi256_ps(_mm256_set1_epi32(maxiter)), interior));
+        _mm256_storeu_si256((__m256i *)&row[i], iter);
+    }
+    for(; i < xsize; i++) {
+        row[i] = iterate_pixel(xleft + step * i, ci, maxiter);
+    }
+}
+
+__attribute__((target("avx512f"))) static void
+row_avx512(int *row, int xsize, int maxiter, double xleft, double ci, double step)
+{
+    const __m512  four     = _mm512_set1_ps(4.0f);
+    const __m512i one      = _mm512_set1_epi32(1);
+    const __m512d lane_lo  = _mm512_set_pd(7, 6, 5, 4, 3, 2, 1, 0);
+    const __m512d lane_hi  = _mm512_set_pd(15, 14, 13, 12, 11, 10, 9, 8);
+    const __m512d x0       = _mm512_set1_pd(xleft);
+    const __m512d dx       = _mm512_set1_pd(step);
+    const __m512  c_imag   = _mm512_set1_ps((float)ci);
+    const __m512d c_imag_d = _mm512_set1_pd((float)ci);
+
+    int i = 0;
+    for(; i + 16 <= xsize; i += 16) {
+        __m512d base   = _mm512_set1_pd(i);
+        __m512d x_lo   = _mm512_add_pd(x0, _mm512_mul_pd(dx, _mm512_add_pd(base, lane_lo)));
+        __m512d x_hi   = _mm512_add_pd(x0, _mm512_mul_pd(dx, _mm512_add_pd(base, lane_hi)));
+        __m512  c_real = _mm512_castpd_ps(
+            _mm512_insertf64x4(_mm512_castpd256_pd512(_mm256_castps_pd(_mm512_cvtpd_ps(x_lo))),
+                               _mm256_castps_pd(_mm512_cvtpd_ps(x_hi)), 1));
+
+        __m512  z_real = c_real, z_imag = c_imag;
+        __m512  saved_real = z_real, saved_imag = z_imag;
+        __m512i iter = _mm512_setzero_si512();
+
+        // Lanes that are known never to diverge
+        __mmask16 interior = 0;
+        if(use_bulbs) {
+            __m512 xq   = _mm512_sub_ps(c_real, _mm512_set1_ps(0.25f));
+            __m512 q    = _mm512_add_ps(_mm512_mul_ps(xq, xq), _mm512_mul_ps(c_imag, c_imag));
+            __m512 edge = _mm512_sub_ps(_mm512_sub_ps(_mm512_sqrt_ps(q), _mm512_add_ps(q, q)),
+                                        _mm512_set1_ps(BULB_MARGIN - 0.25f));
+            __m512 xb   = _mm512_add_ps(c_real, _mm512_set1_ps(1.0f));
+            __m512 rb   = _mm512_add_ps(_mm512_mul_ps(xb, xb), _mm512_mul_ps(c_imag, c_imag));
+            interior    = _mm512_cmp_ps_mask(c_real, edge, _CMP_LT_OQ)
+                     | _mm512_cmp_ps_mask(rb, _mm512_set1_ps(0.0625f - BULB_MARGIN), _CMP_LT_OQ);
+        }
+
+        for(int k = 0, next_save = 1; k < maxiter; k++) {
+            __m512    zr2    = _mm512_mul_ps(z_real, z_real);
+            __m512    zi2    = _mm512_mul_ps(z_imag, z_imag);
+            __mmask16 active = _mm512_mask_cmp_ps_mask(~interior, _mm512_add_ps(zr2, zi2), four,
+                                                       _CMP_LT_OQ);
+            if(active == 0) {
+                break;
+            }
+            __m512 temp_real = _mm512_add_ps(_mm512_sub_ps(zr2, zi2), c_real);
+
+            // 2.0 * z.real * z.imag + c.imag in double, eight lanes at a time
+            __m512d zr_lo = _mm512_cvtps_pd(_mm512_castps512_ps256(z_real));
+            __m512d zr_hi = _mm512_cvtps_pd(
+                _mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(z_real), 1)));
+            __m512d zi_lo = _mm512_cvtps_pd(_mm512_castps512_ps256(z_imag));
+            __m512d zi_hi = _mm512_cvtps_pd(
+                _mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(z_imag), 1)));
+            __m256 ti_lo = _mm512_cvtpd_ps(
+                _mm512_add_pd(_mm512_mul_pd(_mm512_add_pd(zr_lo, zr_lo), zi_lo), c_imag_d));
+            __m256 ti_hi = _mm512_cvtpd_ps(
+                _mm512_add_pd(_mm512_mul_pd(_mm512_add_pd(zr_hi, zr_hi), zi_hi), c_imag_d));
+            __m512 temp_imag = _mm512_castpd_ps(_mm512_insertf64x4(
+                _mm512_castpd256_pd512(_mm256_castps_pd(ti_lo)), _mm256_castps_pd(ti_hi), 1));
+
+            z_real = _mm512_mask_mov_ps(z_real, active, temp_real);
+            z_imag = _mm512_mask_mov_ps(z_imag, active, temp_imag);
+            iter   = _mm512_mask_add_epi32(iter, active, iter, one);
+
+            if(use_period) {
+                interior |= _mm512_mask_cmp_ps_mask(active, z_real, saved_real, _CMP_EQ_OQ)
+                          & _mm512_cmp_ps_mask(z_imag, saved_imag, _CMP_EQ_OQ);
+                if(k + 1 == next_save) {
+                    saved_real = z_real;
+                    saved_imag = z_imag;
+                    next_save *= 2;
+                }
+            }
+        }
+        iter = _mm512_mask_mov_epi32(iter, interior, _mm512_set1_epi32(maxiter));
+        _mm512_storeu_si512((void *)&row[i], iter);
+    }
+    for(; i < xsize; i++) {
+        row[i] = iterate_pixel(xleft + step * i, ci, maxiter);
+    }
+}
+
+static row_kernel_t row_kernel = NULL;
+
+const char *
+simd_select_shortcuts(void)
+{
+    const char *shortcuts = getenv("MANDEL_SHORTCUTS");
+    if(shortcuts == NULL) {
+        shortcuts = "all";
+    }
+    use_bulbs  = strcmp(shortcuts, "all") == 0 || strcmp(shortcuts, "bulbs") == 0;
+    use_period = strcmp(shortcuts, "all") == 0 || strcmp(shortcuts, "period") == 0;
+    return use_bulbs ? (use_period ? "all" : "bulbs") : (use_period ? "period" : "none");
+}
+
+const char *
+simd_select_kernel(void)
+{
+    const char *isa = getenv("MANDEL_ISA");
+    __builtin_cpu_init();
+    if((isa == NULL || strcmp(isa, "avx512") == 0) && __builtin_cpu_supports("avx512f")) {
+        row_kernel = row_avx512;
+        return "avx512";
+    }
+    if((isa == NULL || strcmp(isa, "scalar") != 0) && __builtin_cpu_supports("avx2")) {
+        row_kernel = row_avx2;
+        return "avx2";
+    }
+    row_kernel = row_scalar;
+    return "scalar";
+}
+
+void
+simd_calculate(int *pixels, int xsize, int j_start, int n_rows, int maxiter, double xleft,
+               double yupper, double step)
+{
+    if(row_kernel == NULL) {
+        simd_select_kernel();
+    }
+    for(int j = j_start; j < j_start + n_rows; j++) {
+        row_kernel(&pixels[(size_t)(j - j_start) * xsize], xsize, maxiter, xleft, yupper - step * j,
+                   step);
+    }
+}
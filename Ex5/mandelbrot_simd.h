@@ -0,0 +1,27 @@
+#ifndef MANDELBROT_SIMD_H
+#define MANDELBROT_SIMD_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Vectorized version of host_calculate for the CPU. Pixel (i, j) of the image is
+// c = (xleft + step * i) + (yupper - step * j) i in single precision, and gets the number of
+// iterations until divergence, at most maxiter. Computes the rows [j_start, j_start + n_rows) into
+// pixels, which holds n_rows rows of xsize pixels.
+void simd_calculate(int *pixels, int xsize, int j_start, int n_rows, int maxiter, double xleft,
+                    double yupper, double step);
+
+// Pick the widest kernel the CPU supports, or the one named by MANDEL_ISA=scalar|avx2|avx512 in
+// the environment. Returns the name of the kernel. simd_calculate calls it if nobody has.
+const char *simd_select_kernel(void);
+
+// Pick the tests that skip pixels which never diverge with MANDEL_SHORTCUTS=none|bulbs|period|all
+// in the environment. All of them are on by default. Returns the name of the selection.
+const char *simd_select_shortcuts(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
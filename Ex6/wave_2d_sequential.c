@@ -4,6 +4,7 @@
 #include <string.h>
 #include <stdint.h>
 #include <math.h>
+#include <pthread.h>
 #include <sys/time.h>
 
 
@@ -37,6 +38,39 @@ real_t
 #define U(i,j)     buffers[1][((i)+1)*(N+2)+(j)+1]
 #define U_nxt(i,j) buffers[2][((i)+1)*(N+2)+(j)+1]
 
+/* Checkpoints hold both time levels, so that '--restart' can pick the run up
+ *  where it stopped and give the same results as one that never did. The
+ *  levels are copied to a staging buffer, and a writer thread puts them in a
+ *  temporary file that replaces CHECKPOINT_FILE when it is complete, so a
+ *  crash during the write leaves the previous checkpoint in place.
+ *
+ *  The interval follows Young's formula, sqrt(2*C*MTBF), where C is the time
+ *  the solver was held up by the last checkpoint (the copy, and waiting for
+ *  the previous write if it was still going) and MTBF the expected time
+ *  between failures.
+ */
+#define CHECKPOINT_FILE  "checkpoint.dat"
+#define CHECKPOINT_MAGIC "WAVE2DCK"
+#define CHECKPOINT_MTBF  3600.0         // Seconds
+#define CHECKPOINT_FIRST 1000           // Steps before the first checkpoint
+
+typedef struct {
+    char magic[8];
+    int_t M, N, iteration;
+    real_t dt;
+} checkpoint_header_t;
+
+struct {
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    real_t *staging;                    // Previous and present time step
+    checkpoint_header_t header;
+    int pending, quit;                  // Staging buffer waits for the writer
+    int_t last, next;                   // Iterations of the last and next checkpoint
+    double t_last;                      // When the last one was taken
+} checkpoint;
+
 
 // Rotate the time step buffers.
 void move_buffer_window ( void )
@@ -62,6 +96,136 @@ void domain_save ( int_t step )
 }
 
 
+// Write the staged checkpoints as they come in
+void *checkpoint_writer ( void *arg )
+{
+    (void) arg;
+    size_t size = 2*M*N*sizeof(real_t);
+    pthread_mutex_lock ( &checkpoint.lock );
+    while ( 1 )
+    {
+        while ( !checkpoint.pending && !checkpoint.quit )
+            pthread_cond_wait ( &checkpoint.cond, &checkpoint.lock );
+        if ( !checkpoint.pending )
+            break;
+        pthread_mutex_unlock ( &checkpoint.lock );
+
+        FILE *out = fopen ( CHECKPOINT_FILE ".tmp", "wb" );
+        int ok = ( out != NULL
+            && fwrite ( &checkpoint.header, sizeof(checkpoint_header_t), 1, out ) == 1
+            && fwrite ( checkpoint.staging, 1, size, out ) == size );
+        if ( out != NULL && fclose ( out ) != 0 )
+            ok = 0;
+        if ( !ok || rename ( CHECKPOINT_FILE ".tmp", CHECKPOINT_FILE ) != 0 )
+            fprintf ( stderr, "Could not write checkpoint at iteration %ld\n",
+                checkpoint.header.iteration );
+
+        pthread_mutex_lock ( &checkpoint.lock );
+        checkpoint.pending = 0;
+        pthread_cond_signal ( &checkpoint.cond );
+    }
+    pthread_mutex_unlock ( &checkpoint.lock );
+    return NULL;
+}
+
+
+void checkpoint_initialize ( int_t iteration )
+{
+    checkpoint.staging = malloc ( 2*M*N*sizeof(real_t) );
+    checkpoint.pending = checkpoint.quit = 0;
+    checkpoint.last = iteration;
+    checkpoint.next = iteration + CHECKPOINT_FIRST;
+    struct timeval t;
+    gettimeofday ( &t, NULL );
+    checkpoint.t_last = WALLTIME(t);
+    pthread_mutex_init ( &checkpoint.lock, NULL );
+    pthread_cond_init ( &checkpoint.cond, NULL );
+    pthread_create ( &checkpoint.writer, NULL, checkpoint_writer, NULL );
+}
+
+
+// Let the writer finish the last checkpoint, and stop it
+void checkpoint_finalize ( void )
+{
+    pthread_mutex_lock ( &checkpoint.lock );
+    checkpoint.quit = 1;
+    pthread_cond_signal ( &checkpoint.cond );
+    pthread_mutex_unlock ( &checkpoint.lock );
+    pthread_join ( checkpoint.writer, NULL );
+    pthread_mutex_destroy ( &checkpoint.lock );
+    pthread_cond_destroy ( &checkpoint.cond );
+    free ( checkpoint.staging );
+}
+
+
+// Hand the present state over to the writer, and schedule the next checkpoint
+void checkpoint_save ( int_t iteration )
+{
+    struct timeval t_start, t_end;
+    gettimeofday ( &t_start, NULL );
+
+    pthread_mutex_lock ( &checkpoint.lock );
+    while ( checkpoint.pending )
+        pthread_cond_wait ( &checkpoint.cond, &checkpoint.lock );
+    for ( int_t i=0; i<M; i++ )
+    {
+        memcpy ( &checkpoint.staging[i*N], &U_prv(i,0), N*sizeof(real_t) );
+        memcpy ( &checkpoint.staging[(M+i)*N], &U(i,0), N*sizeof(real_t) );
+    }
+    memcpy ( checkpoint.header.magic, CHECKPOINT_MAGIC, 8 );
+    checkpoint.header.M = M;
+    checkpoint.header.N = N;
+    checkpoint.header.iteration = iteration;
+    checkpoint.header.dt = dt;
+    checkpoint.pending = 1;
+    pthread_cond_signal ( &checkpoint.cond );
+    pthread_mutex_unlock ( &checkpoint.lock );
+
+    gettimeofday ( &t_end, NULL );
+    double
+        cost = WALLTIME(t_end) - WALLTIME(t_start),
+        t_step = ( WALLTIME(t_start) - checkpoint.t_last ) / ( iteration - checkpoint.last );
+    int_t interval = (int_t) ( sqrt ( 2.0*cost*CHECKPOINT_MTBF ) / t_step );
+    checkpoint.next = iteration + ( interval > 0 ? interval : 1 );
+    checkpoint.last = iteration;
+    checkpoint.t_last = WALLTIME(t_end);
+}
+
+
+// Load both time levels from the checkpoint, and return its iteration
+int_t checkpoint_restore ( void )
+{
+    checkpoint_header_t header;
+    FILE *in = fopen ( CHECKPOINT_FILE, "rb" );
+    if ( in == NULL
+        || fread ( &header, sizeof(checkpoint_header_t), 1, in ) != 1
+        || memcmp ( header.magic, CHECKPOINT_MAGIC, 8 ) != 0 )
+    {
+        fprintf ( stderr, "No checkpoint to restart from in '%s'\n", CHECKPOINT_FILE );
+        exit ( EXIT_FAILURE );
+    }
+    if ( header.M != M || header.N != N || header.dt != dt )
+    {
+        fprintf ( stderr, "Checkpoint is of a %ldx%ld run with dt=%lf\n",
+            header.M, header.N, header.dt );
+        exit ( EXIT_FAILURE );
+    }
+    for ( int_t i=0; i<M; i++ )
+        if ( fread ( &U_prv(i,0), sizeof(real_t), N, in ) != (size_t)N )
+            goto truncated;
+    for ( int_t i=0; i<M; i++ )
+        if ( fread ( &U(i,0), sizeof(real_t), N, in ) != (size_t)N )
+            goto truncated;
+    fclose ( in );
+    printf ( "Restarting from iteration %ld\n", header.iteration );
+    return header.iteration;
+
+truncated:
+    fprintf ( stderr, "Checkpoint '%s' is truncated\n", CHECKPOINT_FILE );
+    exit ( EXIT_FAILURE );
+}
+
+
 // Set up our three buffers, and fill two with an initial perturbation
 void domain_initialize ( void )
 {
@@ -126,12 +290,17 @@ void boundary_condition ( void )
 }
 
 
-// Main time integration.
-void simulate( void )
+// Main time integration, from the iteration the domain is at
+void simulate( int_t start )
 {
     // Go through each time step
-    for ( int_t iteration=0; iteration<=max_iteration; iteration++ )
+    for ( int_t iteration=start; iteration<=max_iteration; iteration++ )
     {
+        if ( iteration == checkpoint.next )
+        {
+            checkpoint_save ( iteration );
+        }
+
         if ( (iteration % snapshot_freq)==0 )
         {
             domain_save ( iteration / snapshot_freq );
@@ -147,15 +316,25 @@ void simulate( void )
 }
 
 
-int main ( void )
+int main ( int argc, char **argv )
 {
+    // Optional argument: '--restart' resumes from the last checkpoint
+    int restart = ( argc > 1 && !strcmp ( argv[1], "--restart" ) );
+    if ( argc > 1 && !restart )
+    {
+        fprintf ( stderr, "Usage: %s [--restart]\n", argv[0] );
+        exit ( EXIT_FAILURE );
+    }
+
     // Set up the initial state of the domain
     domain_initialize();
+    int_t start = restart ? checkpoint_restore() : 0;
+    checkpoint_initialize ( start );
 
     struct timeval t_start, t_end;
 
     gettimeofday ( &t_start, NULL );
-    simulate();
+    simulate ( start );
     gettimeofday ( &t_end, NULL );
 
     printf ( "Total elapsed time: %lf seconds\n",
@@ -163,6 +342,7 @@ int main ( void )
     );
 
     // Clean up and shut down
+    checkpoint_finalize();
     domain_finalize();
     exit ( EXIT_SUCCESS );
 }
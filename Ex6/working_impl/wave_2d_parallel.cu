@@ -1,7 +1,6 @@
 // #define _XOPEN_SOURCE 600
 // I get a compiler warning that macro is already defined in the cuda headers, so i've commented it
 // out
-#include <cuda_runtime_api.h>
 #include <math.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -18,9 +17,9 @@
 // TASK: T1
 // Include the cooperative groups library
 // BEGIN: T1
-#include <cooperative_groups.h>
-#include <cuda_runtime.h>
-namespace cg = cooperative_groups;
+// The kernels are written once and launched through kernel_backend.h, either with CUDA or on the
+// CPU, so they take their thread index as arguments instead of asking cooperative groups for it
+#include "kernel_backend.h"
 //  END: T1
 
 // Convert 'struct timeval' into seconds in double prec. floating point
@@ -261,27 +260,15 @@ d_time_step(void)
 
 
 #if 1
-__global__ void
-d_time_step(real_t *prv, real_t *cur, real_t *nxt)
+// One point per thread. The boundary condition for the step is applied by a first pass over the
+// block, see launch_2d in simulate
+__device__ void
+d_time_step(int t_i, int t_j, real_t *prv, real_t *cur, real_t *nxt)
 {
-    cg::thread_block tb = cg::this_thread_block();
-
-    dim3 b_idx = tb.group_index();
-    dim3 b_dim = tb.group_dim();
-    dim3 t_idx = tb.thread_index();
-
-    int t_i = b_idx.x * b_dim.x + t_idx.x;
-    int t_j = b_idx.y * b_dim.y + t_idx.y;
-
-    tb.sync();
-    d_boundary_condition(t_i, t_j, cur);
-
-    tb.sync();
     U_n(t_i, t_j) = -U_p(t_i, t_j) + 2.0 * U_c(t_i, t_j)
                   + (d_dt * d_dt * d_c * d_c) / (d_dx * d_dy)
                         * (U_c(t_i - 1, t_j) + U_c(t_i + 1, t_j) + U_c(t_i, t_j - 1)
                            + U_c(t_i, t_j + 1) - 4.0 * U_c(t_i, t_j));
-    tb.sync();
 }
 #endif
 
@@ -295,7 +282,8 @@ void
 simulate(void)
 {
     // BEGIN: T7
-    // Go through each time step
+    // Go through each time step. x runs along the rows (j, N points) so that neighbouring threads
+    // touch neighbouring points
     int_t grid_x = h_N / BLOCKX;
     int_t grid_y = h_M / BLOCKY;
     dim3  block(BLOCKX, BLOCKY);
@@ -314,7 +302,12 @@ simulate(void)
         // Derive step t+1 from steps t and t-1
         // boundary_condition();
         // printf("Performing time step\n");
-        d_time_step<<<grid, block>>>(h_timesteps.prv, h_timesteps.cur, h_timesteps.nxt);
+        // The ghost points a block reads are written by the same block, so a barrier across the
+        // block is enough between the boundary condition and the step
+        real_t *prv = h_timesteps.prv, *cur = h_timesteps.cur, *nxt = h_timesteps.nxt;
+        launch_2d(
+            grid, block, DEVICE_LAMBDA(int t_j, int t_i) { d_boundary_condition(t_i, t_j, cur); },
+            DEVICE_LAMBDA(int t_j, int t_i) { d_time_step(t_i, t_j, prv, cur, nxt); });
 
         // Rotate the time step buffers
         h_move_buffer_window();
@@ -326,18 +319,9 @@ simulate(void)
 // TASK: T3
 // Set up our three buffers, and fill two with an initial perturbation
 
-__global__ void
-d_init_timesteps(real_t *prv, real_t *cur)
+__device__ void
+d_init_timesteps(int t_i, int t_j, real_t *prv, real_t *cur)
 {
-    cg::thread_block tb = cg::this_thread_block();
-
-    dim3 b_idx = tb.group_index();
-    dim3 b_dim = tb.group_dim();
-    dim3 t_idx = tb.thread_index();
-
-    int t_i = b_idx.x * b_dim.x + t_idx.x;
-    int t_j = b_idx.y * b_dim.y + t_idx.y;
-
     real_t delta = sqrt(((t_i - d_M / 2.0) * (t_i - d_M / 2.0)) / (real_t)d_M
                         + ((t_j - d_N / 2.0) * (t_j - d_N / 2.0)) / (real_t)d_N);
 
@@ -439,7 +423,8 @@ domain_initialize(void)
 
     dim3 block(BLOCKX, BLOCKY);
     dim3 grid(grid_x, grid_y);
-    d_init_timesteps<<<grid, block>>>(h_timesteps.prv, h_timesteps.cur);
+    real_t *prv = h_timesteps.prv, *cur = h_timesteps.cur;
+    launch_2d(grid, block, DEVICE_LAMBDA(int t_j, int t_i) { d_init_timesteps(t_i, t_j, prv, cur); });
     //  d_init_timesteps<<<grid, block>>>();
 
     // END: T3
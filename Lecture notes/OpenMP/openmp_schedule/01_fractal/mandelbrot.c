@@ -1,38 +1,214 @@
 #define _XOPEN_SOURCE 500
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <tgmath.h>
 #include <omp.h>
 
+#include "../schedule_tuner.h"
+
+const int height = 6000, width = 8000;                      // Image size
+
+#define COUNT(y,x) count[(y)*width+(x)]                     // Indexing macro
+unsigned char *count;                                       // Iteration counts
+
+/* Tiles with a side shorter than MIN_TILE are computed point by point,
+ *  and tiles with fewer than TASK_AREA points are not split into tasks
+ */
+#define MIN_TILE  8
+#define TASK_AREA (64*64)
+
+/* While the schedule is tuned, each candidate computes every ROW_STRIDE'th
+ *  row, so they all get the same mix of cheap and expensive rows
+ */
+#define ROW_STRIDE 16
+schedule_tuner_t tuner;
+
+
+// Number of iterations before the point (x,y) escapes, at most 128
+static int
+iterate ( int y, int x )
+{
+    // Find complex coordinates of the seed
+    float complex c = (2.0*x-width)/width-0.5 + I*(2.0*y-height)/height;
+    float complex z = c;
+    int k;
+    for ( k=0; k<128 && cabsf(z) < 2.0; k++ )   // Test the point
+        z = z * z + c;
+    return k;
+}
+
+
+/* Compute the rows that are 'first' to 'first+per_group-1' past a multiple
+ *  of ROW_STRIDE, with the runtime schedule. Returns the elapsed time, and
+ *  leaves the time of each thread in the tuner
+ */
+static double
+render_rows ( int first, int per_group )
+{
+    int n_rows = (height+ROW_STRIDE-1) / ROW_STRIDE * per_group;
+    double t_start = omp_get_wtime();
+    #pragma omp parallel
+    {
+        double t_thread = omp_get_wtime();
+        #pragma omp for schedule(runtime) nowait
+        for ( int k=0; k<n_rows; k++ )
+        {
+            int y = (k/per_group)*ROW_STRIDE + first + k%per_group;
+            if ( y < height )
+                for ( int x=0; x<width; x++ )
+                    COUNT(y,x) = iterate ( y, x );
+        }
+        tuner.busy[omp_get_thread_num()] = omp_get_wtime() - t_thread;
+    }
+    return omp_get_wtime() - t_start;
+}
+
+
+// For all x/y pairs (parallelize by y/lines). Until the schedule is tuned,
+//  each candidate gets one row out of every ROW_STRIDE, and the rest is done
+//  with the fastest one
+static void
+render_exhaustive ( void )
+{
+    int first = 0;
+    for ( ; first<ROW_STRIDE-1 && tuner_tuning(&tuner); first++ )
+    {
+        tuner_begin ( &tuner );
+        tuner_end ( &tuner, render_rows ( first, 1 ) );
+    }
+    render_rows ( first, ROW_STRIDE-first );
+}
+
+
+/* Recursive rectangle subdivision (Mariani-Silver). The tile covers the
+ *  rows y0..y1 and columns x0..x1, both inclusive, and its border has already
+ *  been computed. If all of the border has the same count, the inside is
+ *  filled with it. Otherwise, the tile is cut into four along a middle row and
+ *  column, which are computed here, and each quarter is handled in a task.
+ *  The quarters only write their own insides, so the tasks never overlap.
+ */
+static void
+render_tile ( int y0, int y1, int x0, int x1 )
+{
+    unsigned char k = COUNT(y0,x0);
+    int uniform = 1;
+    for ( int x=x0; x<=x1 && uniform; x++ )
+        uniform = (COUNT(y0,x) == k && COUNT(y1,x) == k);
+    for ( int y=y0; y<=y1 && uniform; y++ )
+        uniform = (COUNT(y,x0) == k && COUNT(y,x1) == k);
+
+    if ( uniform )
+    {
+        for ( int y=y0+1; y<y1; y++ )
+            memset ( &COUNT(y,x0+1), k, x1-x0-1 );
+        return;
+    }
+
+    if ( y1-y0 < MIN_TILE || x1-x0 < MIN_TILE )
+    {
+        for ( int y=y0+1; y<y1; y++ )
+            for ( int x=x0+1; x<x1; x++ )
+                COUNT(y,x) = iterate ( y, x );
+        return;
+    }
+
+    int ym = (y0+y1)/2, xm = (x0+x1)/2;
+    for ( int x=x0+1; x<x1; x++ )
+        COUNT(ym,x) = iterate ( ym, x );
+    for ( int y=y0+1; y<y1; y++ )
+        if ( y != ym )
+            COUNT(y,xm) = iterate ( y, xm );
+
+    int spawn = (y1-y0)*(x1-x0) >= TASK_AREA;
+    #pragma omp task if(spawn)
+    render_tile ( y0, ym, x0, xm );
+    #pragma omp task if(spawn)
+    render_tile ( y0, ym, xm, x1 );
+    #pragma omp task if(spawn)
+    render_tile ( ym, y1, x0, xm );
+    #pragma omp task if(spawn)
+    render_tile ( ym, y1, xm, x1 );
+}
+
+
+// Compute the border of the whole image, and subdivide from there
+static void
+render_tiles ( void )
+{
+    #pragma omp parallel
+    {
+        #pragma omp for
+        for ( int x=0; x<width; x++ )
+        {
+            COUNT(0,x) = iterate ( 0, x );
+            COUNT(height-1,x) = iterate ( height-1, x );
+        }
+        #pragma omp for
+        for ( int y=1; y<height-1; y++ )
+        {
+            COUNT(y,0) = iterate ( y, 0 );
+            COUNT(y,width-1) = iterate ( y, width-1 );
+        }
+        #pragma omp single
+        render_tile ( 0, height-1, 0, width-1 );
+    }
+}
+
+
 int
-main ()
+main ( int argc, char **argv )
 {
-    const int height = 6000, width = 8000;                  // Image size
+    /* Optional argument: 'tiles' (default) subdivides the image,
+     *  'exhaustive' computes every point, and 'validate' does both and
+     *  counts the points where they differ
+     */
+    const char *mode = (argc > 1) ? argv[1] : "tiles";
+    if ( strcmp(mode,"tiles") && strcmp(mode,"exhaustive") && strcmp(mode,"validate") )
+    {
+        fprintf ( stderr, "Usage: %s [tiles|exhaustive|validate]\n", argv[0] );
+        exit ( EXIT_FAILURE );
+    }
 
     #define SET(y,x,c) set[(y)*width*3+(x)*3+(c)]           // Indexing macro
     char *set = malloc ( width*height*3*sizeof(char) );     // Set array
+    count = malloc ( width*height*sizeof(unsigned char) );
+    tuner_init ( &tuner, 1 );
 
     // Time the computation
     double
         t_start = omp_get_wtime(),
         t_end;
-    // For all x/y pairs (parallelize by y/lines)
+    if ( !strcmp(mode,"exhaustive") )
+        render_exhaustive();
+    else
+        render_tiles();
+    t_end = omp_get_wtime();
+    printf ( "Calculated for %lf seconds (%s)\n", t_end-t_start, mode );
+
+    if ( !strcmp(mode,"validate") )
+    {
+        unsigned char *tiled = count;
+        count = malloc ( width*height*sizeof(unsigned char) );
+        t_start = omp_get_wtime();
+        render_exhaustive();
+        t_end = omp_get_wtime();
+        printf ( "Calculated for %lf seconds (exhaustive)\n", t_end-t_start );
+
+        long differ = 0;
+        #pragma omp parallel for reduction(+:differ)
+        for ( long p=0; p<(long)width*height; p++ )
+            differ += (tiled[p] != count[p]);
+        printf ( "%ld of %ld points differ from the exhaustive result\n",
+            differ, (long)width*height );
+        free ( tiled );
+    }
+
+    // Store result
     #pragma omp parallel for
     for ( int y=0; y<height; y++ )
-    {
         for ( int x=0; x<width; x++ )
-        {
-            // Find complex coordinates of the seed
-            float complex c = (2.0*x-width)/width-0.5 + I*(2.0*y-height)/height;
-            float complex z = c;
-            int k;
-            for ( k=0; k<128 && cabsf(z) < 2.0; k++ )   // Test the point
-                z = z * z + c;
-            SET(y,x,0) = SET(y,x,1) = SET(y,x,2) = k;   // Store result
-        }
-    }
-    t_end = omp_get_wtime();
-    printf ( "Calculated for %lf seconds\n", t_end-t_start );
+            SET(y,x,0) = SET(y,x,1) = SET(y,x,2) = COUNT(y,x);
 
     // Save the result in a PPM file
     FILE *out = fopen ( "output.ppm", "w" );
@@ -41,6 +217,8 @@ main ()
     fclose ( out );
 
     // Free the set array and close shop
+    free ( count );
     free ( set );
+    tuner_finalize ( &tuner );
     exit ( EXIT_SUCCESS );
 }
@@ -6,6 +6,8 @@
 #include <math.h>
 #include <omp.h>
 
+#include "../schedule_tuner.h"
+
 // Typedefs for floats and integers
 typedef double real_t;
 typedef int64_t int_t;
@@ -30,6 +32,11 @@ real_t
 #define U(i,j)      u[0][((i)+1)*(N+2)+(j)+1]
 #define U_next(i,j) u[1][((i)+1)*(N+2)+(j)+1]
 
+// The schedule of the time step loop is tuned over the first time steps,
+//  TUNING_STEPS for each candidate
+#define TUNING_STEPS 16
+schedule_tuner_t tuner;
+
 
 int
 main ( int argc, char **argv )
@@ -59,6 +66,8 @@ main ( int argc, char **argv )
         }
     }
 
+    tuner_init ( &tuner, TUNING_STEPS );
+
     // Record the time spent in our parallel region
     double
         t_timesteps = 0.0,
@@ -81,21 +90,28 @@ main ( int argc, char **argv )
         }
 
         // Start the clock
+        tuner_begin ( &tuner );
         t_start = omp_get_wtime();
         // Solve for next time step, using Lax-Friedrichs approximation
-        #pragma omp parallel for
-        for ( int_t i=0; i<N; i++ )
+        #pragma omp parallel
         {
-            for ( int_t j=0; j<N; j++ )
+            double t_thread = omp_get_wtime();
+            #pragma omp for schedule(runtime) nowait
+            for ( int_t i=0; i<N; i++ )
             {
-                U_next(i,j) = 0.25 * (U(i-1,j) + U(i+1,j) + U(i,j-1) + U(i,j+1))
-                  - vy * (dt/(2.0*dx)) * (U(i+1,j) - U(i-1,j))
-                  - vx * (dt/(2.0*dx)) * (U(i,j+1) - U(i,j-1));
+                for ( int_t j=0; j<N; j++ )
+                {
+                    U_next(i,j) = 0.25 * (U(i-1,j) + U(i+1,j) + U(i,j-1) + U(i,j+1))
+                      - vy * (dt/(2.0*dx)) * (U(i+1,j) - U(i-1,j))
+                      - vx * (dt/(2.0*dx)) * (U(i,j+1) - U(i,j-1));
+                }
             }
+            tuner.busy[omp_get_thread_num()] = omp_get_wtime() - t_thread;
         }
         // Stop the clock and accumulate total time
         t_end = omp_get_wtime();
         t_timesteps += (t_end - t_start);
+        tuner_end ( &tuner, t_end - t_start );
 
         if ( (iter % snapshot_freq) == 0 )
         {
@@ -122,5 +138,6 @@ main ( int argc, char **argv )
     // Clean up and go home
     free ( u[0] );
     free ( u[1] );
+    tuner_finalize ( &tuner );
     exit ( EXIT_SUCCESS );
 }
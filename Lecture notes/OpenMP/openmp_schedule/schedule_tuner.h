@@ -0,0 +1,136 @@
+/* Schedule auto-tuning for loops declared with schedule(runtime).
+ *  The first loops of a program are run once with each of the candidate
+ *  schedules below, and the one with the shortest time is set with
+ *  omp_set_schedule for the rest of the run. The caller times each thread
+ *  inside the loop, and the tuner logs how unevenly the work was spread
+ *  (slowest thread / average thread) next to the time.
+ *
+ *  OMP_SCHEDULE in the environment, or a single thread, turns the tuning off.
+ */
+#ifndef SCHEDULE_TUNER_H
+#define SCHEDULE_TUNER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <omp.h>
+
+typedef struct {
+    omp_sched_t kind;
+    int chunk;                      // 0 is the default chunk of the kind
+} schedule_t;
+
+static const schedule_t schedule_candidates[] = {
+    { omp_sched_static, 0 },  { omp_sched_static, 1 },  { omp_sched_static, 16 },
+    { omp_sched_dynamic, 1 }, { omp_sched_dynamic, 4 }, { omp_sched_dynamic, 16 },
+    { omp_sched_guided, 1 },  { omp_sched_guided, 4 },  { omp_sched_guided, 16 }
+};
+#define N_SCHEDULES (int)(sizeof(schedule_candidates)/sizeof(schedule_t))
+
+typedef struct {
+    int trial;                      // Candidate under trial, N_SCHEDULES when done
+    int samples, per_trial;         // Loops timed so far for this candidate, and needed
+    double time[N_SCHEDULES], imbalance[N_SCHEDULES];
+    double *busy;                   // Time spent in the loop by each thread
+} schedule_tuner_t;
+
+
+static const char *
+schedule_name ( schedule_t s, char *buf, size_t size )
+{
+    const char *kind =
+        (s.kind == omp_sched_static) ? "static" :
+        (s.kind == omp_sched_dynamic) ? "dynamic" : "guided";
+    if ( s.chunk > 0 )
+        snprintf ( buf, size, "%s,%d", kind, s.chunk );
+    else
+        snprintf ( buf, size, "%s", kind );
+    return buf;
+}
+
+
+// Set up a tuner that times each candidate over 'per_trial' loops
+static void
+tuner_init ( schedule_tuner_t *t, int per_trial )
+{
+    t->trial = 0;
+    t->samples = 0;
+    t->per_trial = per_trial;
+    t->busy = calloc ( omp_get_max_threads(), sizeof(double) );
+    for ( int k=0; k<N_SCHEDULES; k++ )
+        t->time[k] = t->imbalance[k] = 0.0;
+    if ( getenv("OMP_SCHEDULE") != NULL || omp_get_max_threads() == 1 )
+    {
+        printf ( "Schedule tuning is off (%s)\n",
+            getenv("OMP_SCHEDULE") ? "OMP_SCHEDULE is set" : "one thread" );
+        t->trial = N_SCHEDULES;
+    }
+}
+
+
+static void
+tuner_finalize ( schedule_tuner_t *t )
+{
+    free ( t->busy );
+}
+
+
+static int
+tuner_tuning ( const schedule_tuner_t *t )
+{
+    return t->trial < N_SCHEDULES;
+}
+
+
+// Call before a tuned loop
+static void
+tuner_begin ( schedule_tuner_t *t )
+{
+    if ( tuner_tuning(t) )
+        omp_set_schedule ( schedule_candidates[t->trial].kind, schedule_candidates[t->trial].chunk );
+    for ( int k=0; k<omp_get_max_threads(); k++ )
+        t->busy[k] = 0.0;
+}
+
+
+// Call after a tuned loop with its elapsed time, once the threads have
+//  filled in t->busy. Locks in the fastest schedule after the last trial
+static void
+tuner_end ( schedule_tuner_t *t, double elapsed )
+{
+    if ( !tuner_tuning(t) )
+        return;
+
+    int n_threads = omp_get_max_threads();
+    double max = 0.0, sum = 0.0;
+    for ( int k=0; k<n_threads; k++ )
+    {
+        sum += t->busy[k];
+        if ( t->busy[k] > max )
+            max = t->busy[k];
+    }
+    t->time[t->trial] += elapsed;
+    t->imbalance[t->trial] += (sum > 0.0) ? max / (sum/n_threads) : 1.0;
+
+    if ( ++t->samples < t->per_trial )
+        return;
+    t->samples = 0;
+    if ( ++t->trial < N_SCHEDULES )
+        return;
+
+    int best = 0;
+    char name[32];
+    for ( int k=0; k<N_SCHEDULES; k++ )
+    {
+        printf ( "  schedule(%-10s) %8.4lf s, imbalance %.2lf\n",
+            schedule_name(schedule_candidates[k],name,sizeof(name)),
+            t->time[k]/t->per_trial, t->imbalance[k]/t->per_trial );
+        if ( t->time[k] < t->time[best] )
+            best = k;
+    }
+    omp_set_schedule ( schedule_candidates[best].kind, schedule_candidates[best].chunk );
+    printf ( "Picked schedule(%s), %.2lfx faster than schedule(static)\n",
+        schedule_name(schedule_candidates[best],name,sizeof(name)),
+        t->time[0] / t->time[best] );
+}
+
+#endif
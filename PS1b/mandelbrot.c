@@ -1,101 +1,1288 @@
+#define _XOPEN_SOURCE 600
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <float.h>
 #include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <immintrin.h>
+#include <pthread.h>
 #include <mpi.h>
 
-#define XSIZE 2560
-#define YSIZE 2048
-
-#define MAXITER 255
+/* A double-double number hi+lo with |lo| <= ulp(hi)/2, which carries about
+   32 significant digits */
+typedef struct {
+	double hi,lo;
+} dd_t;
 
-double xleft=-2.01;
-double xright=1;
-double yupper,ylower;
-double ycenter=1e-6;
-double step;
+/* Everything that describes one render. The image is xsize x ysize pixels,
+   covering xleft..xright on the real axis, centered on ycenter on the
+   imaginary axis. It is computed and written band_rows rows at a time, so the
+   memory use does not grow with ysize */
+typedef struct {
+	int xsize,ysize;
+	int maxiter;
+	double xleft,xright,ycenter;
+	int band_rows;
+	const char *output;
+	int verify;
+	/* A zoom animation of 'frames' frames, each zoomed in by 'zoom' on the
+	   center of the previous one. 'output' is then a printf pattern for the
+	   frame number */
+	int frames;
+	double zoom;
+	int reuse;
+	/* Smooth colouring, see smooth_count() */
+	int smooth;
+	/* The view is also kept as its center and width. Past double precision,
+	   xleft and xright round to the same number, and the pixels are computed
+	   by perturbation around the center */
+	dd_t center_real,center_imag;
+	double width;
+	int perturb;
+	/* Derived by render_initialize */
+	double step,yupper,ylower;
+} render_t;
 
-int pixel[XSIZE*YSIZE];
+/* The view this program has always drawn */
+render_t render_defaults={
+	.xsize=2560, .ysize=2048, .maxiter=255,
+	.xleft=-2.01, .xright=1, .ycenter=1e-6,
+	.band_rows=256, .output="mandel2.bmp", .verify=0,
+	.frames=0, .zoom=2, .reuse=0, .smooth=0, .perturb=0
+};
 
-#define PIXEL(i,j) ((i)+(j)*XSIZE)
+/* The largest image a BMP header can describe with a positive height */
+#define MAX_SIZE 65535
 
 typedef struct {
 	double real,imag;
 } complex_t;
 
-void calculate() {
-	for(int i=0;i<XSIZE;i++) {
-		for(int j=0;j<YSIZE;j++) {
-			/* Calculate the number of iterations until divergence for each pixel.
-			   If divergence never happens, return MAXITER */
-			complex_t c,z,temp;
-			int iter=0;
-			c.real = (xleft + step*i);
-			c.imag = (ylower + step*j);
-			z = c;
-			while(z.real*z.real + z.imag*z.imag < 4) {
-				temp.real = z.real*z.real - z.imag*z.imag + c.real;
-				temp.imag = 2*z.real*z.imag + c.imag;
-				z = temp;
-				if(++iter==MAXITER) break;
+/* Calculate the number of iterations until divergence for one pixel.
+   If divergence never happens, return maxiter */
+int iterate(const render_t *r,int i,int j) {
+	complex_t c,z,temp;
+	int iter=0;
+	c.real = (r->xleft + r->step*i);
+	c.imag = (r->ylower + r->step*j);
+	z = c;
+	while(z.real*z.real + z.imag*z.imag < 4) {
+		temp.real = z.real*z.real - z.imag*z.imag + c.real;
+		temp.imag = 2*z.real*z.imag + c.imag;
+		z = temp;
+		if(++iter==r->maxiter) break;
+	}
+	return iter;
+}
+
+/* Reference for the rows [j_start, j_start+n_rows), one pixel at a time */
+void calculate_reference(const render_t *r,int j_start,int n_rows,int *rows) {
+	for(int j=j_start;j<j_start+n_rows;j++) {
+		int *row=&rows[(size_t)(j-j_start)*r->xsize];
+		for(int i=0;i<r->xsize;i++) {
+			row[i]=iterate(r,i,j);
+		}
+	}
+}
+
+/* Smooth colouring needs to know where between two counts a pixel escaped.
+   The count is then shifted up by SMOOTH_BITS, and the low bits hold the
+   normalized iteration count
+     mu = n + 1 - log2(log2 |z|)
+   taken SMOOTH_EXTRA iterations past the bailout, where |z| is large enough
+   for mu to be continuous. With a bailout of 2, mu-n lies in [-0.5,1], which
+   is what the low bits cover. The count itself stays exact */
+#define SMOOTH_BITS 8
+#define SMOOTH_EXTRA 4
+#define SMOOTH_SCALE (((1<<SMOOTH_BITS)-1)/1.5)
+
+int smooth_count(const render_t *r,int iter,double zr,double zi,double cr,double ci) {
+	if(!r->smooth) return iter;
+	if(iter==r->maxiter) return iter<<SMOOTH_BITS;
+	for(int k=0;k<SMOOTH_EXTRA;k++) {
+		double t=zr*zr-zi*zi+cr;
+		zi=2*zr*zi+ci;
+		zr=t;
+	}
+	double mu=SMOOTH_EXTRA+1-log2(log2(zr*zr+zi*zi)/2);
+	int q=(int)((mu+0.5)*SMOOTH_SCALE+0.5);
+	if(q<0) q=0;
+	if(q>=1<<SMOOTH_BITS) q=(1<<SMOOTH_BITS)-1;
+	return iter<<SMOOTH_BITS | q;
+}
+
+/* Shortcuts for pixels that never diverge, which otherwise run all maxiter
+   iterations. Both give the same counts as iterate().
+   - Points in the main cardioid and the period-2 bulb are found with a closed
+     form test. The regions are shrunk by BULB_MARGIN, so the points near their
+     boundary, where rounding could change the outcome, are still iterated.
+   - An orbit that comes back to exactly the same z repeats forever. The orbit
+     is compared with a saved point, and the saved point moves forward at
+     iterations 1, 2, 4, 8, ... (Brent), which finds cycles of any length. */
+#define BULB_MARGIN 1e-3
+int use_bulbs=1, use_period=1;
+
+int in_bulbs(double x,double y) {
+	double xq=x-0.25, q=xq*xq+y*y;
+	if(x < sqrt(q)-2*q+0.25-BULB_MARGIN) return 1;
+	return (x+1)*(x+1)+y*y < 0.0625-BULB_MARGIN;
+}
+
+int iterate_shortcuts(const render_t *r,int i,int j) {
+	complex_t c,z,temp,saved;
+	int iter=0, next_save=1;
+	c.real = (r->xleft + r->step*i);
+	c.imag = (r->ylower + r->step*j);
+	if(use_bulbs && in_bulbs(c.real,c.imag)) return smooth_count(r,r->maxiter,0,0,0,0);
+	z = saved = c;
+	while(z.real*z.real + z.imag*z.imag < 4) {
+		temp.real = z.real*z.real - z.imag*z.imag + c.real;
+		temp.imag = 2*z.real*z.imag + c.imag;
+		z = temp;
+		if(++iter==r->maxiter) break;
+		if(use_period) {
+			if(z.real==saved.real && z.imag==saved.imag) return smooth_count(r,r->maxiter,0,0,0,0);
+			if(iter==next_save) { saved=z; next_save*=2; }
+		}
+	}
+	return smooth_count(r,iter,z.real,z.imag,c.real,c.imag);
+}
+
+/* Row kernels. The vector kernels iterate consecutive pixels of a row in the
+   lanes of a vector. A lane is active until its pixel diverges or is known not
+   to, and all active lanes have done the same number of iterations, so a lane's
+   count is frozen when it drops out. The arithmetic is the same as in
+   iterate(), and the counts are identical to it as long as the compiler does
+   not contract the multiplies and adds (-std=c99 turns that off). Pixels past
+   the last full vector are done by the scalar code */
+void calculate_row_scalar(const render_t *r,int j,int *row) {
+	for(int i=0;i<r->xsize;i++) {
+		row[i]=iterate_shortcuts(r,i,j);
+	}
+}
+
+__attribute__((target("avx2")))
+void calculate_row_avx2(const render_t *r,int j,int *row) {
+	const __m256d four=_mm256_set1_pd(4.0), one=_mm256_set1_pd(1.0);
+	const __m256d lane=_mm256_set_pd(3,2,1,0);
+	const __m256d ci=_mm256_set1_pd(r->ylower + r->step*j);
+	const int maxiter=r->maxiter;
+	int i=0;
+	for(;i+4<=r->xsize;i+=4) {
+		__m256d cr=_mm256_add_pd(_mm256_set1_pd(r->xleft),
+			_mm256_mul_pd(_mm256_set1_pd(r->step),_mm256_add_pd(_mm256_set1_pd(i),lane)));
+		__m256d zr=cr, zi=ci, iter=_mm256_setzero_pd();
+		__m256d saved_r=cr, saved_i=ci;
+		/* Lanes that are known never to diverge */
+		__m256d interior=_mm256_setzero_pd();
+		if(use_bulbs) {
+			__m256d xq=_mm256_sub_pd(cr,_mm256_set1_pd(0.25));
+			__m256d q=_mm256_add_pd(_mm256_mul_pd(xq,xq),_mm256_mul_pd(ci,ci));
+			__m256d edge=_mm256_sub_pd(_mm256_sub_pd(_mm256_sqrt_pd(q),_mm256_add_pd(q,q)),
+				_mm256_set1_pd(BULB_MARGIN-0.25));
+			__m256d xb=_mm256_add_pd(cr,one);
+			__m256d rb=_mm256_add_pd(_mm256_mul_pd(xb,xb),_mm256_mul_pd(ci,ci));
+			interior=_mm256_or_pd(_mm256_cmp_pd(cr,edge,_CMP_LT_OQ),
+				_mm256_cmp_pd(rb,_mm256_set1_pd(0.0625-BULB_MARGIN),_CMP_LT_OQ));
+		}
+		for(int k=0,next_save=1;k<maxiter;k++) {
+			__m256d zr2=_mm256_mul_pd(zr,zr), zi2=_mm256_mul_pd(zi,zi);
+			__m256d active=_mm256_andnot_pd(interior,
+				_mm256_cmp_pd(_mm256_add_pd(zr2,zi2),four,_CMP_LT_OQ));
+			if(_mm256_movemask_pd(active)==0) break;
+			__m256d nr=_mm256_add_pd(_mm256_sub_pd(zr2,zi2),cr);
+			__m256d ni=_mm256_add_pd(_mm256_mul_pd(_mm256_add_pd(zr,zr),zi),ci);
+			zr=_mm256_blendv_pd(zr,nr,active);
+			zi=_mm256_blendv_pd(zi,ni,active);
+			iter=_mm256_add_pd(iter,_mm256_and_pd(active,one));
+			if(use_period) {
+				__m256d same=_mm256_and_pd(_mm256_cmp_pd(zr,saved_r,_CMP_EQ_OQ),
+					_mm256_cmp_pd(zi,saved_i,_CMP_EQ_OQ));
+				interior=_mm256_or_pd(interior,_mm256_and_pd(active,same));
+				if(k+1==next_save) { saved_r=zr; saved_i=zi; next_save*=2; }
+			}
+		}
+		iter=_mm256_blendv_pd(iter,_mm256_set1_pd(maxiter),interior);
+		_mm_storeu_si128((__m128i *)&row[i],_mm256_cvtpd_epi32(iter));
+		if(r->smooth) {
+			/* The z of a lane stops changing when it escapes */
+			double lane_r[4], lane_i[4], lane_c[4];
+			_mm256_storeu_pd(lane_r,zr);
+			_mm256_storeu_pd(lane_i,zi);
+			_mm256_storeu_pd(lane_c,cr);
+			for(int l=0;l<4;l++) row[i+l]=smooth_count(r,row[i+l],lane_r[l],lane_i[l],lane_c[l],r->ylower+r->step*j);
+		}
+	}
+	for(;i<r->xsize;i++) row[i]=iterate_shortcuts(r,i,j);
+}
+
+__attribute__((target("avx512f")))
+void calculate_row_avx512(const render_t *r,int j,int *row) {
+	const __m512d four=_mm512_set1_pd(4.0), one=_mm512_set1_pd(1.0);
+	const __m512d lane=_mm512_set_pd(7,6,5,4,3,2,1,0);
+	const __m512d ci=_mm512_set1_pd(r->ylower + r->step*j);
+	const int maxiter=r->maxiter;
+	int i=0;
+	for(;i+8<=r->xsize;i+=8) {
+		__m512d cr=_mm512_add_pd(_mm512_set1_pd(r->xleft),
+			_mm512_mul_pd(_mm512_set1_pd(r->step),_mm512_add_pd(_mm512_set1_pd(i),lane)));
+		__m512d zr=cr, zi=ci, iter=_mm512_setzero_pd();
+		__m512d saved_r=cr, saved_i=ci;
+		/* Lanes that are known never to diverge */
+		__mmask8 interior=0;
+		if(use_bulbs) {
+			__m512d xq=_mm512_sub_pd(cr,_mm512_set1_pd(0.25));
+			__m512d q=_mm512_add_pd(_mm512_mul_pd(xq,xq),_mm512_mul_pd(ci,ci));
+			__m512d edge=_mm512_sub_pd(_mm512_sub_pd(_mm512_sqrt_pd(q),_mm512_add_pd(q,q)),
+				_mm512_set1_pd(BULB_MARGIN-0.25));
+			__m512d xb=_mm512_add_pd(cr,one);
+			__m512d rb=_mm512_add_pd(_mm512_mul_pd(xb,xb),_mm512_mul_pd(ci,ci));
+			interior=_mm512_cmp_pd_mask(cr,edge,_CMP_LT_OQ)
+				| _mm512_cmp_pd_mask(rb,_mm512_set1_pd(0.0625-BULB_MARGIN),_CMP_LT_OQ);
+		}
+		for(int k=0,next_save=1;k<maxiter;k++) {
+			__m512d zr2=_mm512_mul_pd(zr,zr), zi2=_mm512_mul_pd(zi,zi);
+			__mmask8 active=_mm512_mask_cmp_pd_mask(~interior,_mm512_add_pd(zr2,zi2),four,_CMP_LT_OQ);
+			if(active==0) break;
+			__m512d nr=_mm512_mask_add_pd(zr,active,_mm512_sub_pd(zr2,zi2),cr);
+			zi=_mm512_mask_add_pd(zi,active,_mm512_mul_pd(_mm512_add_pd(zr,zr),zi),ci);
+			zr=nr;
+			iter=_mm512_mask_add_pd(iter,active,iter,one);
+			if(use_period) {
+				interior|=_mm512_mask_cmp_pd_mask(active,zr,saved_r,_CMP_EQ_OQ)
+					& _mm512_cmp_pd_mask(zi,saved_i,_CMP_EQ_OQ);
+				if(k+1==next_save) { saved_r=zr; saved_i=zi; next_save*=2; }
 			}
-			pixel[PIXEL(i,j)]=iter;
 		}
+		iter=_mm512_mask_mov_pd(iter,interior,_mm512_set1_pd(maxiter));
+		_mm256_storeu_si256((__m256i *)&row[i],_mm512_cvtpd_epi32(iter));
+		if(r->smooth) {
+			double lane_r[8], lane_i[8], lane_c[8];
+			_mm512_storeu_pd(lane_r,zr);
+			_mm512_storeu_pd(lane_i,zi);
+			_mm512_storeu_pd(lane_c,cr);
+			for(int l=0;l<8;l++) row[i+l]=smooth_count(r,row[i+l],lane_r[l],lane_i[l],lane_c[l],r->ylower+r->step*j);
+		}
+	}
+	for(;i<r->xsize;i++) row[i]=iterate_shortcuts(r,i,j);
+}
+
+/* MANDEL_SHORTCUTS=none, bulbs, period or all (the default) picks the shortcuts */
+const char *select_shortcuts() {
+	const char *shortcuts=getenv("MANDEL_SHORTCUTS");
+	if(!shortcuts) shortcuts="all";
+	use_bulbs=!strcmp(shortcuts,"all") || !strcmp(shortcuts,"bulbs");
+	use_period=!strcmp(shortcuts,"all") || !strcmp(shortcuts,"period");
+	return use_bulbs ? (use_period ? "all" : "bulbs") : (use_period ? "period" : "none");
+}
+
+void (*calculate_row)(const render_t *r,int j,int *row)=calculate_row_scalar;
+
+/* Pick the widest kernel the CPU supports. MANDEL_ISA=scalar, avx2 or avx512
+   asks for a specific one */
+const char *select_kernel() {
+	const char *isa=getenv("MANDEL_ISA");
+	__builtin_cpu_init();
+	if((!isa || !strcmp(isa,"avx512")) && __builtin_cpu_supports("avx512f")) {
+		calculate_row=calculate_row_avx512;
+		return "avx512";
+	}
+	if((!isa || strcmp(isa,"scalar")) && __builtin_cpu_supports("avx2")) {
+		calculate_row=calculate_row_avx2;
+		return "avx2";
+	}
+	calculate_row=calculate_row_scalar;
+	return "scalar";
+}
+
+/* Double-double arithmetic. The products are split with Dekker's method,
+   which is exact as long as the compiler does not contract a*b+c (see the row
+   kernels) */
+dd_t two_sum(double a,double b) {
+	double s=a+b, v=s-a;
+	return (dd_t){s,(a-(s-v))+(b-v)};
+}
+
+dd_t quick_two_sum(double a,double b) {
+	double s=a+b;
+	return (dd_t){s,b-(s-a)};
+}
+
+dd_t two_prod(double a,double b) {
+	const double split=134217729.0;
+	double p=a*b;
+	double ta=split*a, ah=ta-(ta-a), al=a-ah;
+	double tb=split*b, bh=tb-(tb-b), bl=b-bh;
+	return (dd_t){p,((ah*bh-p)+ah*bl+al*bh)+al*bl};
+}
+
+dd_t dd_add(dd_t a,dd_t b) {
+	dd_t s=two_sum(a.hi,b.hi), t=two_sum(a.lo,b.lo);
+	s=quick_two_sum(s.hi,s.lo+t.hi);
+	return quick_two_sum(s.hi,s.lo+t.lo);
+}
+
+dd_t dd_mul(dd_t a,dd_t b) {
+	dd_t p=two_prod(a.hi,b.hi);
+	return quick_two_sum(p.hi,p.lo+(a.hi*b.lo+a.lo*b.hi));
+}
+
+dd_t dd_neg(dd_t a) {
+	return (dd_t){-a.hi,-a.lo};
+}
+
+dd_t dd_div_d(dd_t a,double b) {
+	double q=a.hi/b;
+	dd_t p=two_prod(q,b);
+	return quick_two_sum(q,((a.hi-p.hi)-p.lo+a.lo)/b);
+}
+
+/* Read a decimal number such as -0.74364388703715870475219150611477 to double-double
+   precision. Returns nonzero unless all of s is read */
+int dd_parse(const char *s,dd_t *x) {
+	dd_t v={0,0};
+	int negative=0, digits=0, exponent=0;
+	if(*s=='+' || *s=='-') negative=(*s++=='-');
+	for(int fraction=0;;s++) {
+		if(*s=='.' && !fraction) fraction=1;
+		else if(*s>='0' && *s<='9') {
+			v=dd_add(dd_mul(v,(dd_t){10,0}),(dd_t){*s-'0',0});
+			exponent-=fraction;
+			digits++;
+		}
+		else break;
 	}
+	if(!digits) return 1;
+	if(*s=='e' || *s=='E') {
+		char *end;
+		exponent+=strtol(s+1,&end,10);
+		s=end;
+	}
+	if(*s) return 1;
+	for(;exponent>0;exponent--) v=dd_mul(v,(dd_t){10,0});
+	for(;exponent<0;exponent++) v=dd_div_d(v,10);
+	*x=negative ? dd_neg(v) : v;
+	return 0;
+}
+
+/* Perturbation. Only the orbit Z of the center C is iterated in double-double.
+   A pixel c=C+dc is iterated as its offset d=z-Z, which stays small enough for
+   doubles:
+     d(n+1) = 2 Z(n) d(n) + d(n)^2 + dc
+   The orbit starts from Z(0)=0, so a pixel starts at n=1 with d=dc, as z
+   starts at c in iterate().
+   - When |z| drops below |d|, d has lost the digits that matter (a glitch).
+     The pixel then continues from the start of the orbit with d=z, which is
+     also how a pixel goes on past the end of the orbit (rebasing).
+   - The first iterations of all pixels follow the series
+       d(n) = A(n) dc + B(n) dc^2 + C(n) dc^3
+     so they are skipped up to the last n where the series holds for the
+     corners and edges of the view. */
+typedef struct {
+	dd_t center_real,center_imag;
+	int maxiter;
+	/* Z(0..length) */
+	int length;
+	double *real,*imag;
+	/* The series at n=skip, for the view with this step */
+	double step;
+	int skip;
+	complex_t a,b,c;
+} orbit_t;
+
+orbit_t orbit={.length=-1};
+
+/* Series terms smaller than this, relative to a pixel, are ignored */
+#define SERIES_TOLERANCE 1e-3
+
+complex_t complex_mul(complex_t x,complex_t y) {
+	return (complex_t){x.real*y.real-x.imag*y.imag,x.real*y.imag+x.imag*y.real};
+}
+
+complex_t complex_add(complex_t x,complex_t y) {
+	return (complex_t){x.real+y.real,x.imag+y.imag};
+}
+
+double complex_norm(complex_t x) {
+	return x.real*x.real+x.imag*x.imag;
+}
+
+/* The series for dc at iteration n, given the coefficients at n */
+complex_t series_at(const complex_t *a,const complex_t *b,const complex_t *c,complex_t dc) {
+	complex_t dc2=complex_mul(dc,dc);
+	return complex_add(complex_add(complex_mul(*a,dc),complex_mul(*b,dc2)),complex_mul(*c,complex_mul(dc2,dc)));
+}
+
+void orbit_reference(const render_t *r) {
+	free(orbit.real);
+	free(orbit.imag);
+	orbit.center_real=r->center_real;
+	orbit.center_imag=r->center_imag;
+	orbit.maxiter=r->maxiter;
+	orbit.real=malloc(((size_t)r->maxiter+2)*sizeof(double));
+	orbit.imag=malloc(((size_t)r->maxiter+2)*sizeof(double));
+	orbit.real[0]=orbit.imag[0]=0;
+	dd_t zr={0,0}, zi={0,0};
+	int n=0;
+	while(n<=r->maxiter) {
+		dd_t zr2=dd_mul(zr,zr), zi2=dd_mul(zi,zi), zri=dd_mul(zr,zi);
+		zr=dd_add(dd_add(zr2,dd_neg(zi2)),r->center_real);
+		zi=dd_add(dd_add(zri,zri),r->center_imag);
+		n++;
+		orbit.real[n]=zr.hi;
+		orbit.imag[n]=zi.hi;
+		if(zr.hi*zr.hi+zi.hi*zi.hi>4) break;
+	}
+	orbit.length=n;
+	orbit.step=0;
+}
+
+/* Perturb one pixel from iteration n with offset d, and return its count */
+int iterate_perturbed(const render_t *r,complex_t dc,int n,complex_t d,int iter) {
+	const double *Zr=orbit.real, *Zi=orbit.imag;
+	for(;;) {
+		double zr=Zr[n]+d.real, zi=Zi[n]+d.imag;
+		double norm=zr*zr+zi*zi;
+		if(norm>=4) {
+			return smooth_count(r,iter,zr,zi,r->center_real.hi+dc.real,r->center_imag.hi+dc.imag);
+		}
+		if(n==orbit.length || norm<d.real*d.real+d.imag*d.imag) {
+			d.real=zr;
+			d.imag=zi;
+			n=0;
+		}
+		double dr=2*(Zr[n]*d.real-Zi[n]*d.imag)+d.real*d.real-d.imag*d.imag+dc.real;
+		double di=2*(Zr[n]*d.imag+Zi[n]*d.real)+2*d.real*d.imag+dc.imag;
+		d.real=dr;
+		d.imag=di;
+		n++;
+		if(++iter==r->maxiter) break;
+	}
+	return smooth_count(r,iter,0,0,0,0);
+}
+
+/* Compare the series at iteration n with plain perturbation for the corners
+   and edges of the view. The series has to be within SERIES_TOLERANCE of a
+   pixel, scaled by how much the orbit has stretched the view by then */
+int series_holds(const render_t *r,int n,complex_t a,complex_t b,complex_t c) {
+	double half_w=r->step*r->xsize/2, half_h=r->step*r->ysize/2;
+	double pixel=SERIES_TOLERANCE*r->step*sqrt(complex_norm(a));
+	for(int k=0;k<9;k++) {
+		if(k==4) continue;
+		complex_t dc={(k%3-1)*half_w,(k/3-1)*half_h};
+		complex_t d=dc;
+		for(int m=1;m<n;m++) {
+			double zr=orbit.real[m]+d.real, zi=orbit.imag[m]+d.imag;
+			if(zr*zr+zi*zi>=4 || zr*zr+zi*zi<complex_norm(d)) return 0;
+			double dr=2*(orbit.real[m]*d.real-orbit.imag[m]*d.imag)+d.real*d.real-d.imag*d.imag+dc.real;
+			double di=2*(orbit.real[m]*d.imag+orbit.imag[m]*d.real)+2*d.real*d.imag+dc.imag;
+			d.real=dr;
+			d.imag=di;
+		}
+		complex_t e=series_at(&a,&b,&c,dc);
+		if(!(complex_norm((complex_t){e.real-d.real,e.imag-d.imag})<=pixel*pixel)) return 0;
+	}
+	return 1;
+}
+
+/* Make the orbit and the series ready for a view. Every rank does this
+   itself, it is cheap next to the pixels */
+void perturbation_prepare(const render_t *r) {
+	if(orbit.length<0 || orbit.maxiter!=r->maxiter
+		|| memcmp(&orbit.center_real,&r->center_real,sizeof(dd_t))
+		|| memcmp(&orbit.center_imag,&r->center_imag,sizeof(dd_t))) orbit_reference(r);
+	if(orbit.step==r->step) return;
+	orbit.step=r->step;
+
+	/* Advance the series while its third term stays small next to the second
+	   for the farthest pixel, then back off until it matches the probes */
+	double radius=hypot(r->step*r->xsize,r->step*r->ysize)/2;
+	int limit=(orbit.length<r->maxiter ? orbit.length : r->maxiter)-1;
+	complex_t *a=malloc(((size_t)limit+2)*3*sizeof(complex_t)), *b=a+limit+2, *c=b+limit+2;
+	a[1]=(complex_t){1,0};
+	b[1]=c[1]=(complex_t){0,0};
+	int n=1;
+	while(n<limit) {
+		complex_t z2={2*orbit.real[n],2*orbit.imag[n]};
+		a[n+1]=complex_add(complex_mul(z2,a[n]),(complex_t){1,0});
+		b[n+1]=complex_add(complex_mul(z2,b[n]),complex_mul(a[n],a[n]));
+		complex_t ab=complex_mul(a[n],b[n]);
+		c[n+1]=complex_add(complex_mul(z2,c[n]),(complex_t){2*ab.real,2*ab.imag});
+		if(!(sqrt(complex_norm(c[n+1]))*radius<=SERIES_TOLERANCE*sqrt(complex_norm(b[n+1])))) break;
+		n++;
+	}
+	while(n>1 && !series_holds(r,n,a[n],b[n],c[n])) n=n*3/4;
+	orbit.skip=n;
+	orbit.a=a[n];
+	orbit.b=b[n];
+	orbit.c=c[n];
+	free(a);
+}
+
+/* Pixels whose series lands outside the bailout escaped before the skip, and
+   are iterated from the start */
+void calculate_row_perturbed(const render_t *r,int j,int *row) {
+	double dc_imag=r->step*(j-r->ysize/2.0);
+	for(int i=0;i<r->xsize;i++) {
+		complex_t dc={r->step*(i-r->xsize/2.0),dc_imag};
+		if(use_bulbs && in_bulbs(r->center_real.hi+dc.real,r->center_imag.hi+dc.imag)) {
+			row[i]=smooth_count(r,r->maxiter,0,0,0,0);
+			continue;
+		}
+		int n=orbit.skip;
+		complex_t d=series_at(&orbit.a,&orbit.b,&orbit.c,dc);
+		double zr=orbit.real[n]+d.real, zi=orbit.imag[n]+d.imag;
+		if(n==1 || zr*zr+zi*zi>=4) row[i]=iterate_perturbed(r,dc,1,dc,0);
+		else row[i]=iterate_perturbed(r,dc,n,d,n-1);
+	}
+}
+
+/* Calculate the rows [j_start, j_start+n_rows) into rows[], which holds
+   n_rows rows of xsize pixels */
+void calculate_rows(const render_t *r,int j_start,int n_rows,int *rows) {
+	void (*row_kernel)(const render_t *r,int j,int *row)=calculate_row;
+	if(r->perturb) {
+		perturbation_prepare(r);
+		row_kernel=calculate_row_perturbed;
+	}
+	for(int j=j_start;j<j_start+n_rows;j++) {
+		row_kernel(r,j,&rows[(size_t)(j-j_start)*r->xsize]);
+	}
+}
+
+/* Master/worker engine. The root hands out bundles of rows on demand, and the
+   workers send back the iteration counts for them. Every worker has up to
+   BUNDLES_IN_FLIGHT bundles assigned, so the next one is already waiting when
+   it finishes the current one. */
+#define TAG_WORK 1
+#define TAG_COST 2
+#define TAG_ROWS 3
+#define BUNDLES_IN_FLIGHT 2
+
+/* Bundles are sized to take about this many seconds to compute */
+#define TARGET_BUNDLE_TIME 2e-3
+
+typedef struct {
+	int start,count,frame;
+} bundle_t;
+
+/* Pick the number of rows in the next bundle from the measured cost of a row,
+   but never more than a share of the remaining rows, so the last bundles are
+   small and the workers finish at the same time */
+int bundle_size(int rows_left,int n_workers,double row_cost) {
+	int rows=(row_cost>0) ? (int)(TARGET_BUNDLE_TIME/row_cost) : 1;
+	int share=rows_left/(BUNDLES_IN_FLIGHT*n_workers);
+	if(rows>share) rows=share;
+	if(rows<1) rows=1;
+	if(rows>rows_left) rows=rows_left;
+	return rows;
+}
+
+/* The cost of a row carries over from one band to the next */
+double row_cost=0;
+
+/* Hand out the rows [j_start, j_start+n_rows) of a frame and collect them in rows[] */
+void master(const render_t *r,int n_workers,int frame,int j_start,int n_rows,int *rows) {
+	/* FIFO of the bundles assigned to each worker. MPI does not reorder
+	   messages between two ranks, so results arrive in the order assigned */
+	bundle_t *assigned=calloc((n_workers+1)*BUNDLES_IN_FLIGHT,sizeof(bundle_t));
+	int *head=calloc(n_workers+1,sizeof(int));
+	int *n_assigned=calloc(n_workers+1,sizeof(int));
+	int j_end=j_start+n_rows, next_row=j_start, rows_done=0;
+
+	for(int k=0;k<BUNDLES_IN_FLIGHT;k++) {
+		for(int w=1;w<=n_workers;w++) {
+			bundle_t b={next_row,0,frame};
+			if(next_row<j_end) b.count=bundle_size(j_end-next_row,n_workers,row_cost);
+			next_row+=b.count;
+			if(b.count==0) continue;
+			assigned[w*BUNDLES_IN_FLIGHT+(head[w]+n_assigned[w])%BUNDLES_IN_FLIGHT]=b;
+			n_assigned[w]++;
+			MPI_Send(&b,3,MPI_INT,w,TAG_WORK,MPI_COMM_WORLD);
+		}
+	}
+
+	while(rows_done<n_rows) {
+		MPI_Status status;
+		double cost;
+		MPI_Probe(MPI_ANY_SOURCE,TAG_COST,MPI_COMM_WORLD,&status);
+		int w=status.MPI_SOURCE;
+		MPI_Recv(&cost,1,MPI_DOUBLE,w,TAG_COST,MPI_COMM_WORLD,MPI_STATUS_IGNORE);
+
+		bundle_t done=assigned[w*BUNDLES_IN_FLIGHT+head[w]];
+		head[w]=(head[w]+1)%BUNDLES_IN_FLIGHT;
+		n_assigned[w]--;
+
+		/* Receive the rows straight into place while we hand out more work */
+		MPI_Request request;
+		MPI_Irecv(&rows[(size_t)(done.start-j_start)*r->xsize],done.count*r->xsize,MPI_INT,w,
+			TAG_ROWS,MPI_COMM_WORLD,&request);
+
+		/* Neighbouring rows cost about the same, so weigh recent bundles most */
+		double cost_per_row=cost/done.count;
+		row_cost=(row_cost>0) ? 0.5*row_cost+0.5*cost_per_row : cost_per_row;
+
+		if(next_row<j_end) {
+			bundle_t b={next_row,bundle_size(j_end-next_row,n_workers,row_cost),frame};
+			next_row+=b.count;
+			assigned[w*BUNDLES_IN_FLIGHT+(head[w]+n_assigned[w])%BUNDLES_IN_FLIGHT]=b;
+			n_assigned[w]++;
+			MPI_Send(&b,3,MPI_INT,w,TAG_WORK,MPI_COMM_WORLD);
+		}
+
+		MPI_Wait(&request,MPI_STATUS_IGNORE);
+		rows_done+=done.count;
+	}
+	free(assigned);
+	free(head);
+	free(n_assigned);
+}
+
+/* An empty bundle tells the workers to stop */
+void master_finalize(int n_workers) {
+	for(int w=1;w<=n_workers;w++) {
+		bundle_t stop={0,0,0};
+		MPI_Send(&stop,3,MPI_INT,w,TAG_WORK,MPI_COMM_WORLD);
+	}
+}
+
+void frame_view(const render_t *r,int frame,render_t *view);
+
+/* A bundle never spans more than one band, so a band sized buffer holds it.
+   Every rank derives the view of a frame the same way, so only its number is
+   sent along */
+void worker(const render_t *r) {
+	int *rows=malloc((size_t)r->band_rows*r->xsize*sizeof(int));
+	render_t view=*r;
+	int frame=0;
+	for(;;) {
+		bundle_t b;
+		MPI_Recv(&b,3,MPI_INT,0,TAG_WORK,MPI_COMM_WORLD,MPI_STATUS_IGNORE);
+		if(b.count==0) break;
+		if(b.frame!=frame) {
+			frame=b.frame;
+			frame_view(r,frame,&view);
+		}
+
+		double start=MPI_Wtime();
+		calculate_rows(&view,b.start,b.count,rows);
+		double cost=MPI_Wtime()-start;
+
+		MPI_Send(&cost,1,MPI_DOUBLE,0,TAG_COST,MPI_COMM_WORLD);
+		MPI_Send(rows,b.count*r->xsize,MPI_INT,0,TAG_ROWS,MPI_COMM_WORLD);
+	}
+	free(rows);
 }
 
 typedef unsigned char uchar;
 
-/* save 24-bits bmp file, buffer must be in bmp format: upside-down */
-void savebmp(char *name,uchar *buffer,int x,int y) {
-	FILE *f=fopen(name,"wb");
-	if(!f) {
+/* BMP rows are padded to a multiple of 4 bytes */
+size_t bmp_row_bytes(int x) {
+	return ((size_t)x*3+3)/4*4;
+}
+
+void put_le32(uchar *p,uint32_t v) {
+	p[0]=v&255; p[1]=(v>>8)&255; p[2]=(v>>16)&255; p[3]=v>>24;
+}
+
+/* Create a 24-bits bmp file and write its header. The rows are written with
+   bmp_write_band. A file size that does not fit the 32-bit header field is
+   stored as 0, and readers go by the dimensions instead */
+int bmp_open(const char *name,int x,int y) {
+	int fd=open(name,O_WRONLY|O_CREAT|O_TRUNC,0644);
+	if(fd<0) {
+		printf("Error writing image to disk.\n");
+		return -1;
+	}
+	uint64_t image_size=(uint64_t)bmp_row_bytes(x)*y;
+	uint64_t size=image_size+54;
+	uchar header[54]={'B','M'};
+	put_le32(header+2,size<=UINT32_MAX ? size : 0);
+	put_le32(header+10,54);
+	put_le32(header+14,40);
+	put_le32(header+18,x);
+	put_le32(header+22,y);
+	header[26]=1;
+	header[28]=24;
+	if(pwrite(fd,header,54,0)!=54) {
 		printf("Error writing image to disk.\n");
-		return;
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* The bmp format is upside-down, so the rows [j_start, j_start+n_rows) are
+   one contiguous range of the file. buffer holds them bottom row first */
+int bmp_write_band(int fd,const uchar *buffer,int x,int y,int j_start,int n_rows) {
+	size_t row_bytes=bmp_row_bytes(x), bytes=row_bytes*n_rows;
+	off_t offset=54+(off_t)row_bytes*(y-j_start-n_rows);
+	for(size_t done=0;done<bytes;) {
+		ssize_t n=pwrite(fd,buffer+done,bytes-done,offset+done);
+		if(n<=0) {
+			printf("Error writing image to disk.\n");
+			return -1;
+		}
+		done+=n;
+	}
+	return 0;
+}
+
+/* given iteration number, set a colour. Counts past the palette wrap around.
+   The palette is built from it, see palette_build() */
+void fancycolour(uchar *p,int iter,int maxiter) {
+	if(iter==maxiter);
+	else {
+		iter%=255;
+		if(iter<8) { p[0]=128+iter*16; p[1]=p[2]=0; }
+		else if(iter<24) { p[0]=255; p[1]=p[2]=(iter-8)*16; }
+		else if(iter<160) { p[0]=p[1]=255-(iter-24)*2; p[2]=255; }
+		else { p[0]=p[1]=(iter-160)*2; p[2]=255-(iter-160)*2; }
+	}
+}
+
+/* Deep zooms run out of double precision when neighbouring pixels round to
+   the same point */
+int render_resolvable(const render_t *r) {
+	double extent=fmax(fmax(fabs(r->xleft),fabs(r->xright)),fmax(fabs(r->yupper),fabs(r->ylower)));
+	return r->step > 4*DBL_EPSILON*extent;
+}
+
+/* The colours of fancycolour() for every count up to maxiter+1, built once
+   per maxiter, with the three bytes of a pixel in the low bytes of an int.
+   Interior pixels are black and are not looked up */
+typedef struct {
+	int maxiter;
+	uint32_t *colour;
+} palette_t;
+
+palette_t palette_build(int maxiter) {
+	palette_t pal={maxiter,malloc(((size_t)maxiter+2)*sizeof(uint32_t))};
+	for(int k=0;k<=maxiter+1;k++) {
+		uchar p[3]={0,0,0};
+		fancycolour(p,k,-1);
+		pal.colour[k]=p[0] | p[1]<<8 | (uint32_t)p[2]<<16;
+	}
+	return pal;
+}
+
+void colour_row_scalar(const palette_t *pal,const int *counts,int n,uchar *line) {
+	for(int i=0;i<n;i++) {
+		uint32_t c=(counts[i]==pal->maxiter) ? 0 : pal->colour[counts[i]];
+		line[3*i]=c;
+		line[3*i+1]=c>>8;
+		line[3*i+2]=c>>16;
+	}
+}
+
+/* Gather the colours of 8 pixels, squeeze the 4 byte entries to 3 bytes
+   within each 128-bit half, move the two 12 byte halves together, and store
+   the 24 bytes without touching the bytes after them */
+__attribute__((target("avx2")))
+void colour_row_avx2(const palette_t *pal,const int *counts,int n,uchar *line) {
+	const __m256i interior=_mm256_set1_epi32(pal->maxiter);
+	const __m256i squeeze=_mm256_setr_epi8(0,1,2,4,5,6,8,9,10,12,13,14,-1,-1,-1,-1,
+		0,1,2,4,5,6,8,9,10,12,13,14,-1,-1,-1,-1);
+	const __m256i join=_mm256_setr_epi32(0,1,2,4,5,6,3,7);
+	const __m256i store=_mm256_setr_epi32(-1,-1,-1,-1,-1,-1,0,0);
+	int i=0;
+	for(;i+8<=n;i+=8) {
+		__m256i k=_mm256_loadu_si256((const __m256i *)&counts[i]);
+		__m256i c=_mm256_i32gather_epi32((const int *)pal->colour,k,4);
+		c=_mm256_andnot_si256(_mm256_cmpeq_epi32(k,interior),c);
+		c=_mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(c,squeeze),join);
+		_mm256_maskstore_epi32((int *)(line+3*i),store,c);
+	}
+	colour_row_scalar(pal,counts+i,n-i,line+3*i);
+}
+
+void (*colour_row)(const palette_t *pal,const int *counts,int n,uchar *line)=colour_row_scalar;
+
+/* The gathers need AVX2. MANDEL_ISA=scalar keeps the scalar colouring too */
+void select_colourizer() {
+	const char *isa=getenv("MANDEL_ISA");
+	__builtin_cpu_init();
+	if((!isa || strcmp(isa,"scalar")) && __builtin_cpu_supports("avx2")) colour_row=colour_row_avx2;
+	else colour_row=colour_row_scalar;
+}
+
+/* Smooth colouring blends the colours of the two counts around mu, in
+   steps of 1/256 */
+void colour_row_smooth(const palette_t *pal,const int *counts,int n,uchar *line) {
+	for(int i=0;i<n;i++) {
+		int iter=counts[i]>>SMOOTH_BITS;
+		uchar *p=line+3*i;
+		if(iter==pal->maxiter) {
+			p[0]=p[1]=p[2]=0;
+			continue;
+		}
+		int q=counts[i]&((1<<SMOOTH_BITS)-1);
+		int mu=(iter<<8)+(int)(q*(256/SMOOTH_SCALE))-128;
+		if(mu<0) mu=0;
+		int k=mu>>8, f=mu&255;
+		uint32_t a=pal->colour[k], b=pal->colour[k+1];
+		for(int c=0;c<3;c++) {
+			int lo=(a>>8*c)&255, hi=(b>>8*c)&255;
+			p[c]=lo+(((hi-lo)*f+128)>>8);
+		}
+	}
+}
+
+/* Colour n_rows rows of counts into a BMP band, bottom row first */
+void colourize(const render_t *r,const palette_t *pal,const int *rows,int n_rows,uchar *buffer) {
+	size_t row_bytes=bmp_row_bytes(r->xsize);
+	for(int j=0;j<n_rows;j++) {
+		uchar *line=buffer+row_bytes*(n_rows-j-1);
+		const int *counts=&rows[(size_t)j*r->xsize];
+		if(r->smooth) colour_row_smooth(pal,counts,r->xsize,line);
+		else colour_row(pal,counts,r->xsize,line);
+		memset(line+3*(size_t)r->xsize,0,row_bytes-3*(size_t)r->xsize);
+	}
+}
+
+/* The number of pixels whose count differs from the reference counts */
+long count_differences(const render_t *r,const int *rows,const int *reference,size_t n) {
+	int shift=r->smooth ? SMOOTH_BITS : 0;
+	long errors=0;
+	for(size_t p=0;p<n;p++) {
+		if(rows[p]>>shift!=reference[p]) errors++;
+	}
+	return errors;
+}
+
+/* Derive the pixel spacing and the imaginary range, such that we preserve the
+   aspect ratio. Returns nonzero if the view can not be drawn */
+int render_initialize(render_t *r) {
+	if(r->xsize<1 || r->ysize<1 || r->xsize>MAX_SIZE || r->ysize>MAX_SIZE) {
+		fprintf(stderr,"Image size must be between 1x1 and %dx%d\n",MAX_SIZE,MAX_SIZE);
+		return 1;
+	}
+	if(r->maxiter<1 || !(r->width>0)) {
+		fprintf(stderr,"Need maxiter > 0 and xleft < xright\n");
+		return 1;
+	}
+	if(r->smooth && r->maxiter>INT32_MAX>>SMOOTH_BITS) {
+		fprintf(stderr,"Smooth colouring needs maxiter <= %d\n",INT32_MAX>>SMOOTH_BITS);
+		return 1;
+	}
+	if(r->band_rows<1 || r->band_rows>r->ysize) r->band_rows=r->ysize;
+	r->step=r->perturb ? r->width/r->xsize : (r->xright-r->xleft)/r->xsize;
+	r->yupper=r->ycenter+(r->step*r->ysize)/2;
+	r->ylower=r->ycenter-(r->step*r->ysize)/2;
+	/* Views too deep for doubles are computed by perturbation instead */
+	if(!r->perturb && !render_resolvable(r)) {
+		r->perturb=1;
+		return render_initialize(r);
+	}
+	return 0;
+}
+
+void usage() {
+	puts("Usage: MANDEL [options] n [v]");
+	puts("n decides whether image should be written to disk (1=yes, 0=no)");
+	puts("v decides whether the result is checked against a serial run (1=yes, 0=no),");
+	puts("  which in double precision is only meaningful above the deep zoom range");
+	puts("Options:");
+	puts("  -s WIDTHxHEIGHT   image size in pixels (2560x2048, at most 65535x65535)");
+	puts("  -m MAXITER        iteration budget (255)");
+	puts("  -x XLEFT:XRIGHT   range of the real axis (-2.01:1)");
+	puts("  -y YCENTER        imaginary part of the image center (1e-6)");
+	puts("  -c X:Y -w WIDTH   view by center and width instead, for deep zooms (X and Y to 32 digits)");
+	puts("  -S                smooth colouring from the normalized iteration count");
+	puts("  -P                perturbation around the center, which views past double precision use anyway");
+	puts("  -b ROWS           rows computed and written at a time (256)");
+	puts("  -o FILE           image file (mandel2.bmp)");
+	puts("  -a FRAMES         zoom animation, FILE is a pattern for the frame number (mandel%05d.bmp)");
+	puts("  -z FACTOR         zoom between frames of the animation (2)");
+	puts("  -R                reuse the pixels of the previous frame, for an integer FACTOR on one rank");
+	puts("MANDEL_ISA=scalar|avx2|avx512 in the environment picks the kernel");
+	puts("MANDEL_SHORTCUTS=none|bulbs|period|all picks the tests for pixels that never diverge");
+}
+
+/* Read the center X:Y both as doubles and to double-double precision. The
+   high parts are the doubles, so a view in double range is the same either way */
+int parse_center(const char *arg,double *x,double *y,render_t *r) {
+	char real[128];
+	const char *colon=strchr(arg,':');
+	if(!colon || colon-arg>=(long)sizeof(real)) return 1;
+	memcpy(real,arg,colon-arg);
+	real[colon-arg]=0;
+	dd_t cr,ci;
+	if(dd_parse(real,&cr) || dd_parse(colon+1,&ci)) return 1;
+	*x=strtod(real,NULL);
+	*y=strtod(colon+1,NULL);
+	r->center_real=(dd_t){*x,dd_add(cr,(dd_t){-*x,0}).hi};
+	r->center_imag=(dd_t){*y,dd_add(ci,(dd_t){-*y,0}).hi};
+	return 0;
+}
+
+/* Fill in a render from the command line, starting from the defaults.
+   Returns nonzero on a usage error */
+int render_parse(render_t *r,int argc,char **argv) {
+	*r=render_defaults;
+	double center_x=0, center_y=0, width=0;
+	int centered=0, opt;
+	while((opt=getopt(argc,argv,"s:m:x:y:c:w:b:o:a:z:RPS"))!=-1) {
+		switch(opt) {
+			case 's': if(sscanf(optarg,"%dx%d",&r->xsize,&r->ysize)!=2) return 1; break;
+			case 'm': r->maxiter=strtol(optarg,NULL,10); break;
+			case 'x': if(sscanf(optarg,"%lf:%lf",&r->xleft,&r->xright)!=2) return 1; break;
+			case 'y': r->ycenter=strtod(optarg,NULL); break;
+			case 'c': if(parse_center(optarg,&center_x,&center_y,r)) return 1; centered=1; break;
+			case 'w': width=strtod(optarg,NULL); break;
+			case 'b': r->band_rows=strtol(optarg,NULL,10); break;
+			case 'o': r->output=optarg; break;
+			case 'a': r->frames=strtol(optarg,NULL,10); break;
+			case 'z': r->zoom=strtod(optarg,NULL); break;
+			case 'R': r->reuse=1; break;
+			case 'P': r->perturb=1; break;
+			case 'S': r->smooth=1; break;
+			default: return 1;
+		}
+	}
+	if(centered) {
+		if(!(width>0)) return 1;
+		r->xleft=center_x-width/2;
+		r->xright=center_x+width/2;
+		r->ycenter=center_y;
+		r->width=width;
+	}
+	else {
+		r->center_real=(dd_t){(r->xleft+r->xright)/2,0};
+		r->center_imag=(dd_t){r->ycenter,0};
+		r->width=r->xright-r->xleft;
+	}
+	/* An animation computes whole frames, one while the previous is written */
+	if(r->frames>0) {
+		if(!(r->zoom>0)) return 1;
+		if(r->output==render_defaults.output) r->output="mandel%05d.bmp";
+		if(!strchr(r->output,'%')) return 1;
+		r->band_rows=0;
+	}
+	if(optind>=argc) return 1;
+	if(strtol(argv[optind],NULL,10)==0) r->output=NULL;
+	r->verify=(optind+1<argc && strtol(argv[optind+1],NULL,10)!=0);
+	return 0;
+}
+
+/* Frame k of an animation is centered on the base view, zoom^k times narrower */
+void frame_view(const render_t *r,int frame,render_t *view) {
+	*view=*r;
+	if(frame>0) {
+		view->width=r->width/pow(r->zoom,frame);
+		view->xleft=r->center_real.hi-view->width/2;
+		view->xright=r->center_real.hi+view->width/2;
+		render_initialize(view);
 	}
-	unsigned int size=x*y*3+54;
-	uchar header[54]={'B','M',size&255,(size>>8)&255,(size>>16)&255,size>>24,0,
-		0,0,0,54,0,0,0,40,0,0,0,x&255,x>>8,0,0,y&255,y>>8,0,0,1,0,24,0,0,0,0,0,0,
-		0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0};
-	fwrite(header,1,54,f);
-	fwrite(buffer,1,XSIZE*YSIZE*3,f);
-	fclose(f);
 }
 
-/* given iteration number, set a colour */
-void fancycolour(uchar *p,int iter) {
-	if(iter==MAXITER);
-	else if(iter<8) { p[0]=128+iter*16; p[1]=p[2]=0; }
-	else if(iter<24) { p[0]=255; p[1]=p[2]=(iter-8)*16; }
-	else if(iter<160) { p[0]=p[1]=255-(iter-24)*2; p[2]=255; }
-	else { p[0]=p[1]=(iter-160)*2; p[2]=255-(iter-160)*2; }
+/* With an integer zoom F, every F'th pixel of every F'th row of a frame was a
+   pixel of the previous frame, a columns and b rows into it. Returns F, or 0
+   if the pixels do not line up */
+int reuse_offsets(const render_t *r,int *a,int *b) {
+	int F=(int)r->zoom;
+	if(F<2 || F!=r->zoom) return 0;
+	if((r->xsize*(F-1))%(2*F) || (r->ysize*(F-1))%(2*F)) return 0;
+	*a=r->xsize*(F-1)/(2*F);
+	*b=r->ysize*(F-1)/(2*F);
+	return F;
+}
+
+/* Copy the pixels shared with the previous frame and compute the rest. In a
+   row with copied pixels, the pixels s, s+F, s+2F, ... are one row of a view F
+   times coarser, so they still go through the vector kernels. The frames
+   derive their coordinates differently, so c can differ in the last bit
+   between a copied and a fresh pixel, and the count with it, rarely */
+void calculate_frame_reusing(const render_t *view,int F,int a,int b,const int *prev,int *rows,int *scratch) {
+	for(int j=0;j<view->ysize;j++) {
+		int *row=&rows[(size_t)j*view->xsize];
+		if(j%F) {
+			calculate_row(view,j,row);
+			continue;
+		}
+		const int *src=&prev[(size_t)(b+j/F)*view->xsize+a];
+		for(int i=0;i<view->xsize;i+=F) row[i]=src[i/F];
+		for(int s=1;s<F && s<view->xsize;s++) {
+			render_t sub=*view;
+			sub.xsize=(view->xsize-s+F-1)/F;
+			sub.xleft=view->xleft+view->step*s;
+			sub.step=view->step*F;
+			sub.ylower=view->ylower+view->step*j;
+			calculate_row(&sub,0,scratch);
+			for(int m=0;m<sub.xsize;m++) row[s+m*F]=scratch[m];
+		}
+	}
+}
+
+/* Frames in flight: one being computed, one being coloured and written, and
+   with reuse, the previous one the computation copies from */
+#define FRAME_POOL 3
+
+typedef struct {
+	int *counts;
+	int number;
+	int refs;
+} frame_t;
+
+/* The frame pool and the queue of frames for the writer thread. The writer
+   makes no MPI calls, so MPI_THREAD_FUNNELED is enough */
+typedef struct {
+	const render_t *r;
+	palette_t palette;
+	frame_t pool[FRAME_POOL];
+	frame_t *queue[FRAME_POOL];
+	int head,queued;
+	int finished,failed;
+	double writing;
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+} animation_t;
+
+double wall_time() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC,&t);
+	return t.tv_sec+1e-9*t.tv_nsec;
+}
+
+/* Wait for a frame nobody holds. Returns NULL once the writer has failed */
+frame_t *frame_acquire(animation_t *anim) {
+	frame_t *f=NULL;
+	pthread_mutex_lock(&anim->lock);
+	while(!anim->failed && !f) {
+		for(int k=0;k<FRAME_POOL && !f;k++) {
+			if(anim->pool[k].refs==0) f=&anim->pool[k];
+		}
+		if(!f) pthread_cond_wait(&anim->changed,&anim->lock);
+	}
+	if(f) f->refs=1;
+	pthread_mutex_unlock(&anim->lock);
+	return f;
+}
+
+void frame_release(animation_t *anim,frame_t *f) {
+	pthread_mutex_lock(&anim->lock);
+	f->refs--;
+	pthread_cond_broadcast(&anim->changed);
+	pthread_mutex_unlock(&anim->lock);
+}
+
+/* Hand a frame to the writer, which holds its own reference until written */
+void frame_submit(animation_t *anim,frame_t *f) {
+	pthread_mutex_lock(&anim->lock);
+	f->refs++;
+	anim->queue[(anim->head+anim->queued)%FRAME_POOL]=f;
+	anim->queued++;
+	pthread_cond_broadcast(&anim->changed);
+	pthread_mutex_unlock(&anim->lock);
+}
+
+/* Colour and write the frames in the order they were submitted */
+void *frame_writer(void *arg) {
+	animation_t *anim=arg;
+	const render_t *r=anim->r;
+	size_t row_bytes=bmp_row_bytes(r->xsize);
+	uchar *buffer=malloc(row_bytes*r->ysize);
+	for(;;) {
+		pthread_mutex_lock(&anim->lock);
+		while(anim->queued==0 && !anim->finished) pthread_cond_wait(&anim->changed,&anim->lock);
+		if(anim->queued==0) {
+			pthread_mutex_unlock(&anim->lock);
+			break;
+		}
+		frame_t *f=anim->queue[anim->head];
+		anim->head=(anim->head+1)%FRAME_POOL;
+		anim->queued--;
+		pthread_mutex_unlock(&anim->lock);
+
+		double start=wall_time();
+		colourize(r,&anim->palette,f->counts,r->ysize,buffer);
+		char name[4096];
+		snprintf(name,sizeof(name),r->output,f->number);
+		int fd=bmp_open(name,r->xsize,r->ysize);
+		int failed=(fd<0 || bmp_write_band(fd,buffer,r->xsize,r->ysize,0,r->ysize));
+		if(fd>=0) close(fd);
+		anim->writing+=wall_time()-start;
+
+		pthread_mutex_lock(&anim->lock);
+		if(failed) anim->failed=1;
+		pthread_mutex_unlock(&anim->lock);
+		frame_release(anim,f);
+	}
+	free(buffer);
+	return NULL;
+}
+
+/* Render a zoom animation on the root. Frame k+1 is computed while frame k is
+   coloured and written by a second thread */
+int animate(const render_t *r,int size) {
+	animation_t anim={.r=r, .palette=palette_build(r->maxiter)};
+	pthread_mutex_init(&anim.lock,NULL);
+	pthread_cond_init(&anim.changed,NULL);
+	size_t frame_pixels=(size_t)r->xsize*r->ysize;
+	for(int k=0;k<FRAME_POOL;k++) anim.pool[k].counts=malloc(frame_pixels*sizeof(int));
+	int *reference=r->verify ? malloc(frame_pixels*sizeof(int)) : NULL;
+	int *scratch=malloc(r->xsize*sizeof(int));
+
+	pthread_t writer;
+	int writing=(r->output && pthread_create(&writer,NULL,frame_writer,&anim)==0);
+	if(r->output && !writing) printf("Could not start the writer thread, frames are not written.\n");
+
+	int F=0, a=0, b=0;
+	if(r->reuse) {
+		if(size==1) F=reuse_offsets(r,&a,&b);
+		if(!F) printf("Not reusing pixels: needs one rank and a zoom that lines up the pixels.\n");
+	}
+
+	frame_t *prev=NULL;
+	long errors=0;
+	double calculated=0, start_all=wall_time();
+	for(int k=0;k<r->frames;k++) {
+		frame_t *f=frame_acquire(&anim);
+		if(!f) break;
+		render_t view;
+		frame_view(r,k,&view);
+		f->number=k;
+
+		double start=MPI_Wtime();
+		if(prev && !view.perturb) calculate_frame_reusing(&view,F,a,b,prev->counts,f->counts,scratch);
+		else if(size==1) calculate_rows(&view,0,view.ysize,f->counts);
+		else master(&view,size-1,k,0,view.ysize,f->counts);
+		calculated+=MPI_Wtime()-start;
+
+		if(reference) {
+			calculate_reference(&view,0,view.ysize,reference);
+			errors+=count_differences(r,f->counts,reference,frame_pixels);
+		}
+
+		if(writing) frame_submit(&anim,f);
+		if(F) {
+			if(prev) frame_release(&anim,prev);
+			prev=f;
+		}
+		else frame_release(&anim,f);
+	}
+	if(size>1) master_finalize(size-1);
+	if(prev) frame_release(&anim,prev);
+
+	if(writing) {
+		pthread_mutex_lock(&anim.lock);
+		anim.finished=1;
+		pthread_cond_broadcast(&anim.changed);
+		pthread_mutex_unlock(&anim.lock);
+		pthread_join(writer,NULL);
+	}
+
+	printf("Calculated %d frames in %.3f s with %d ranks\n",r->frames,calculated,size);
+	if(writing) printf("Coloured and wrote them in %.3f s, %.3f s in total\n",anim.writing,wall_time()-start_all);
+	if(anim.failed) printf("Stopped after a frame could not be written.\n");
+	if(reference) {
+		if(errors>0) printf("Found %ld pixels that differ from the serial result.\n",errors);
+		else puts("Result is identical to the serial calculation.");
+	}
+	for(int k=0;k<FRAME_POOL;k++) free(anim.pool[k].counts);
+	free(anim.palette.colour);
+	free(reference);
+	free(scratch);
+	pthread_cond_destroy(&anim.changed);
+	pthread_mutex_destroy(&anim.lock);
+	return anim.failed;
+}
+
+/* Render on all ranks. The root writes the image as the bands complete */
+int render(const render_t *r,int rank,int size) {
+	if(size>1 && rank!=0) {
+		worker(r);
+		return 0;
+	}
+	if(r->frames>0) return animate(r,size);
+
+	int fd=-1;
+	if(r->output) {
+		fd=bmp_open(r->output,r->xsize,r->ysize);
+		if(fd<0) {
+			if(size>1) master_finalize(size-1);
+			return 1;
+		}
+	}
+	size_t band_pixels=(size_t)r->band_rows*r->xsize;
+	size_t row_bytes=bmp_row_bytes(r->xsize);
+	int *rows=malloc(band_pixels*sizeof(int));
+	int *reference=r->verify ? malloc(band_pixels*sizeof(int)) : NULL;
+	uchar *buffer=fd>=0 ? malloc(row_bytes*r->band_rows) : NULL;
+	palette_t palette=palette_build(r->maxiter);
+	long errors=0;
+	double calculated=0, coloured=0;
+
+	for(int j_start=0;j_start<r->ysize;j_start+=r->band_rows) {
+		int n_rows=(j_start+r->band_rows<=r->ysize) ? r->band_rows : r->ysize-j_start;
+
+		double start=MPI_Wtime();
+		if(size==1) calculate_rows(r,j_start,n_rows,rows);
+		else master(r,size-1,0,j_start,n_rows,rows);
+		calculated+=MPI_Wtime()-start;
+
+		if(reference) {
+			calculate_reference(r,j_start,n_rows,reference);
+			errors+=count_differences(r,rows,reference,(size_t)n_rows*r->xsize);
+		}
+
+		if(buffer) {
+			/* create nice image from iteration counts. take care to create it upside
+			   down (bmp format) */
+			start=MPI_Wtime();
+			colourize(r,&palette,rows,n_rows,buffer);
+			coloured+=MPI_Wtime()-start;
+			if(bmp_write_band(fd,buffer,r->xsize,r->ysize,j_start,n_rows)) break;
+		}
+	}
+	if(size>1) master_finalize(size-1);
+
+	printf("Calculated in %.3f s with %d ranks\n",calculated,size);
+	if(buffer) printf("Coloured in %.3f s\n",coloured);
+	if(reference) {
+		if(errors>0) printf("Found %ld pixels that differ from the serial result.\n",errors);
+		else puts("Result is identical to the serial calculation.");
+	}
+	if(fd>=0) close(fd);
+	free(rows);
+	free(reference);
+	free(buffer);
+	free(palette.colour);
+	return 0;
 }
 
 int main(int argc,char **argv) {
-	if(argc==1) {
-		puts("Usage: MANDEL n");
-		puts("n decides whether image should be written to disk (1=yes, 0=no)");
+	/* Only the main thread of an animation makes MPI calls */
+	int provided;
+	MPI_Init_thread(&argc,&argv,MPI_THREAD_FUNNELED,&provided);
+	int rank,size;
+	MPI_Comm_rank(MPI_COMM_WORLD,&rank);
+	MPI_Comm_size(MPI_COMM_WORLD,&size);
+
+	render_t r;
+	if(render_parse(&r,argc,argv) || render_initialize(&r)) {
+		if(rank==0) usage();
+		MPI_Finalize();
 		return 0;
 	}
-	/* Calculate the range in the y-axis such that we preserve the
-	   aspect ratio */
-	step=(xright-xleft)/XSIZE;
-	yupper=ycenter+(step*YSIZE)/2;
-	ylower=ycenter-(step*YSIZE)/2;
-
-	calculate();
-
-	if(strtol(argv[1],NULL,10)!=0) {
-		/* create nice image from iteration counts. take care to create it upside
-		   down (bmp format) */
-		unsigned char *buffer=calloc(XSIZE*YSIZE*3,1);
-		for(int i=0;i<XSIZE;i++) {
-			for(int j=0;j<YSIZE;j++) {
-				int p=((YSIZE-j-1)*XSIZE+i)*3;
-				fancycolour(buffer+p,pixel[PIXEL(i,j)]);
-			}
+
+	const char *isa=select_kernel();
+	const char *shortcuts=select_shortcuts();
+	select_colourizer();
+	if(rank==0) {
+		printf("Rendering %dx%d, maxiter %d, %s kernel, %s shortcuts\n",
+			r.xsize,r.ysize,r.maxiter,r.perturb ? "perturbation" : isa,shortcuts);
+		if(r.perturb) {
+			perturbation_prepare(&r);
+			printf("Reference orbit of %d iterations, the series skips %d\n",orbit.length,orbit.skip-1);
 		}
-		/* write image to disk */
-		savebmp("mandel2.bmp",buffer,XSIZE,YSIZE);
 	}
+	render(&r,rank,size);
+
+	MPI_Finalize();
 	return 0;
 }
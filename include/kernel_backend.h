@@ -0,0 +1,222 @@
+#ifndef KERNEL_BACKEND_H
+#define KERNEL_BACKEND_H
+
+// Kernels are written once, as a __device__ function of the global thread index (t_i along x, t_j
+// along y), and launched over a 2D grid of blocks with launch_2d. Built with nvcc, launch_2d is a
+// CUDA kernel launch. Built as plain C++ (g++ -x c++ -fopenmp), the same file runs on the CPU: the
+// blocks are spread over OpenMP threads, and the threads of a block along x are the lanes of a SIMD
+// loop. The parts of the runtime API the programs use are emulated on the host, so the program
+// around the kernels is the same for both backends.
+//
+// A second function passed to launch_2d runs after a barrier across the block (__syncthreads), which
+// on the CPU means that all threads of a block finish the first function before any starts the second.
+
+#ifdef __CUDACC__
+
+#include <cuda_runtime.h>
+
+#define KERNEL_BACKEND "CUDA"
+#define DEVICE_LAMBDA  [=] __device__
+
+template <typename F>
+__global__ void
+launch_2d_kernel(F f)
+{
+    f(blockIdx.x * blockDim.x + threadIdx.x, blockIdx.y * blockDim.y + threadIdx.y);
+}
+
+template <typename F, typename G>
+__global__ void
+launch_2d_kernel(F f, G g)
+{
+    int t_i = blockIdx.x * blockDim.x + threadIdx.x;
+    int t_j = blockIdx.y * blockDim.y + threadIdx.y;
+    f(t_i, t_j);
+    __syncthreads();
+    g(t_i, t_j);
+}
+
+template <typename F>
+void
+launch_2d(dim3 grid, dim3 block, F f)
+{
+    launch_2d_kernel<<<grid, block>>>(f);
+}
+
+template <typename F, typename G>
+void
+launch_2d(dim3 grid, dim3 block, F f, G g)
+{
+    launch_2d_kernel<<<grid, block>>>(f, g);
+}
+
+#else
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <omp.h>
+
+#define KERNEL_BACKEND "CPU"
+#define DEVICE_LAMBDA  [=]
+
+#define __global__
+#define __device__
+#define __host__
+#define __constant__
+
+struct dim3
+{
+    unsigned x, y, z;
+    dim3(unsigned x_ = 1, unsigned y_ = 1, unsigned z_ = 1) : x(x_), y(y_), z(z_) {}
+};
+
+enum cudaError_t
+{
+    cudaSuccess               = 0,
+    cudaErrorMemoryAllocation = 2,
+    cudaErrorInvalidDevice    = 101
+};
+
+enum cudaMemcpyKind
+{
+    cudaMemcpyHostToHost,
+    cudaMemcpyHostToDevice,
+    cudaMemcpyDeviceToHost,
+    cudaMemcpyDeviceToDevice
+};
+
+// The one device is the host, described in the fields the programs print
+struct cudaDeviceProp
+{
+    char   name[256];
+    int    major, minor;
+    int    multiProcessorCount;
+    int    warpSize;
+    size_t totalGlobalMem;
+    size_t sharedMemPerBlock;
+    int    regsPerBlock;
+    int    maxThreadsPerBlock;
+    int    maxThreadsDim[3];
+    int    maxGridSize[3];
+};
+
+static inline const char *
+cudaGetErrorString(cudaError_t code)
+{
+    return (code == cudaSuccess) ? "no error" : "CPU backend error";
+}
+
+static inline cudaError_t
+cudaGetDeviceCount(int *count)
+{
+    *count = 1;
+    return cudaSuccess;
+}
+
+static inline cudaError_t
+cudaSetDevice(int device)
+{
+    return (device == 0) ? cudaSuccess : cudaErrorInvalidDevice;
+}
+
+static inline cudaError_t
+cudaGetDeviceProperties(cudaDeviceProp *p, int device)
+{
+    if(device != 0) {
+        return cudaErrorInvalidDevice;
+    }
+    memset(p, 0, sizeof(*p));
+    snprintf(p->name, sizeof(p->name), "CPU, %d OpenMP threads", omp_get_max_threads());
+    p->multiProcessorCount = omp_get_num_procs();
+    p->warpSize            = 1;
+    p->maxThreadsPerBlock  = 1024;
+    p->maxThreadsDim[0] = p->maxThreadsDim[1] = p->maxThreadsDim[2] = 1024;
+    p->maxGridSize[0] = p->maxGridSize[1] = p->maxGridSize[2] = 1 << 30;
+    return cudaSuccess;
+}
+
+// Device memory is host memory, aligned for the SIMD loops
+static inline cudaError_t
+cudaMalloc(void **ptr, size_t size)
+{
+    return posix_memalign(ptr, 64, size) == 0 ? cudaSuccess : cudaErrorMemoryAllocation;
+}
+
+static inline cudaError_t
+cudaFree(void *ptr)
+{
+    free(ptr);
+    return cudaSuccess;
+}
+
+static inline cudaError_t
+cudaMemcpy(void *dst, const void *src, size_t count, cudaMemcpyKind)
+{
+    memcpy(dst, src, count);
+    return cudaSuccess;
+}
+
+template <typename T>
+static inline cudaError_t
+cudaMemcpyToSymbol(T &symbol, const void *src, size_t count, size_t offset = 0,
+                   cudaMemcpyKind = cudaMemcpyHostToDevice)
+{
+    memcpy((char *)&symbol + offset, src, count);
+    return cudaSuccess;
+}
+
+// Launches finish before they return
+static inline cudaError_t
+cudaDeviceSynchronize(void)
+{
+    return cudaSuccess;
+}
+
+template <typename F>
+void
+launch_2d(dim3 grid, dim3 block, F f)
+{
+#pragma omp parallel for collapse(2) schedule(static)
+    for(unsigned b_j = 0; b_j < grid.y; b_j++) {
+        for(unsigned b_i = 0; b_i < grid.x; b_i++) {
+            for(unsigned t_y = 0; t_y < block.y; t_y++) {
+                int t_j = b_j * block.y + t_y;
+#pragma omp simd
+                for(unsigned t_x = 0; t_x < block.x; t_x++) {
+                    f(b_i * block.x + t_x, t_j);
+                }
+            }
+        }
+    }
+}
+
+template <typename F, typename G>
+void
+launch_2d(dim3 grid, dim3 block, F f, G g)
+{
+#pragma omp parallel for collapse(2) schedule(static)
+    for(unsigned b_j = 0; b_j < grid.y; b_j++) {
+        for(unsigned b_i = 0; b_i < grid.x; b_i++) {
+            for(unsigned t_y = 0; t_y < block.y; t_y++) {
+                int t_j = b_j * block.y + t_y;
+#pragma omp simd
+                for(unsigned t_x = 0; t_x < block.x; t_x++) {
+                    f(b_i * block.x + t_x, t_j);
+                }
+            }
+            for(unsigned t_y = 0; t_y < block.y; t_y++) {
+                int t_j = b_j * block.y + t_y;
+#pragma omp simd
+                for(unsigned t_x = 0; t_x < block.x; t_x++) {
+                    g(b_i * block.x + t_x, t_j);
+                }
+            }
+        }
+    }
+}
+
+#endif
+
+#endif